@@ -0,0 +1,328 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+#include <errno.h>
+#include "AsyncFileOutput.h"
+
+namespace Kinovea
+{
+namespace VideoFiles
+{
+
+// Entry points given to the I/O context. The opaque pointer is a handle on the AsyncFileOutput.
+static int AsyncWritePacket(void* _pOpaque, uint8_t* _pBuffer, int _iSize)
+{
+	AsyncFileOutput^ output = safe_cast<AsyncFileOutput^>(GCHandle::FromIntPtr(IntPtr(_pOpaque)).Target);
+	return output->Write(_pBuffer, _iSize);
+}
+static int64_t AsyncSeek(void* _pOpaque, int64_t _iOffset, int _iWhence)
+{
+	AsyncFileOutput^ output = safe_cast<AsyncFileOutput^>(GCHandle::FromIntPtr(IntPtr(_pOpaque)).Target);
+	return output->Seek(_iOffset, _iWhence);
+}
+
+AsyncFileOutput::AsyncFileOutput(int _iBlockSize, int64_t _iBudget, AsyncWriteStats^ _stats)
+{
+	// Blocks are a whole number of pages, and there are always at least two so the disk and the muxer can overlap.
+	m_iBlockSize = Math::Max(4096, (_iBlockSize + 4095) & ~4095);
+	m_iBlocks = (int)Math::Max((int64_t)2, _iBudget / m_iBlockSize);
+	m_Stats = (_stats != nullptr) ? _stats : gcnew AsyncWriteStats();
+	m_pContext = nullptr;
+	m_iPosition = 0;
+	m_iSize = 0;
+	m_bError = false;
+}
+
+///<summary>
+/// AsyncFileOutput::Open
+/// Create the file, the I/O context and start the disk thread.
+///</summary>
+bool AsyncFileOutput::Open(String^ _FilePath)
+{
+	m_FilePath = _FilePath;
+
+	// No buffering in the stream: blocks are already large, and the small ones from explicit flushes 
+	// reach the system right away without flushing the stream after each write.
+	try
+	{
+		m_Stream = gcnew FileStream(_FilePath, FileMode::Create, FileAccess::Write, FileShare::Read, 1);
+	}
+	catch(Exception^ exp)
+	{
+		log->Error(String::Format("File not opened for asynchronous writing: {0}", exp->Message));
+		return false;
+	}
+
+	m_FreeBlocks = gcnew BoundedQueue<WriteBlock^>(m_iBlocks);
+	m_PendingBlocks = gcnew BoundedQueue<WriteBlock^>(m_iBlocks);
+	for(int i=0;i<m_iBlocks;i++)
+	{
+		WriteBlock^ block = gcnew WriteBlock();
+		block->data = gcnew array<Byte>(m_iBlockSize);
+		m_FreeBlocks->Enqueue(block);
+	}
+
+	// The muxer buffer is one block, so each flush of the I/O context fills exactly one block.
+	uint8_t* pBuffer = (uint8_t*)av_malloc(m_iBlockSize);
+	m_Handle = GCHandle::Alloc(this);
+
+	if(pBuffer != nullptr)
+	{
+		m_pContext = avio_alloc_context(pBuffer, m_iBlockSize, 1, GCHandle::ToIntPtr(m_Handle).ToPointer(), nullptr, &AsyncWritePacket, &AsyncSeek);
+	}
+
+	if(m_pContext == nullptr)
+	{
+		log->Error("Asynchronous I/O context not allocated");
+		av_free(pBuffer);
+		m_Handle.Free();
+		m_Stream->Close();
+		return false;
+	}
+
+	Monitor::Enter(m_Outputs);
+	try
+	{
+		m_Outputs->Add(IntPtr(m_pContext), this);
+	}
+	finally
+	{
+		Monitor::Exit(m_Outputs);
+	}
+
+	m_WriteThread = gcnew Thread(gcnew ThreadStart(this, &AsyncFileOutput::WriteLoop));
+	m_WriteThread->Name = "Writer - Disk";
+	m_WriteThread->IsBackground = true;
+	m_WriteThread->Start();
+
+	log->Debug(String::Format("Asynchronous output opened. Blocks:{0} x {1} bytes.", m_iBlocks, m_iBlockSize));
+
+	return true;
+}
+
+///<summary>
+/// AsyncFileOutput::Close
+/// Push the last bytes, wait for every block to reach the disk and release everything.
+/// Returns false if any block could not be written, the file is then incomplete.
+///</summary>
+bool AsyncFileOutput::Close()
+{
+	if(m_pContext == nullptr)
+		return !m_bError;
+
+	avio_flush(m_pContext);
+
+	m_PendingBlocks->Close();
+	m_WriteThread->Join();
+	m_WriteThread = nullptr;
+
+	try
+	{
+		m_Stream->Flush();
+		m_Stream->Close();
+	}
+	catch(Exception^ exp)
+	{
+		log->Error(String::Format("Error while closing {0}: {1}", m_FilePath, exp->Message));
+		m_bError = true;
+	}
+
+	FreeContext();
+
+	return !m_bError;
+}
+
+///<summary>
+/// AsyncFileOutput::FromContext
+/// Return the output owning an I/O context, or null if it was opened by url_fopen.
+///</summary>
+AsyncFileOutput^ AsyncFileOutput::FromContext(AVIOContext* _pContext)
+{
+	AsyncFileOutput^ output = nullptr;
+
+	Monitor::Enter(m_Outputs);
+	try
+	{
+		m_Outputs->TryGetValue(IntPtr(_pContext), output);
+	}
+	finally
+	{
+		Monitor::Exit(m_Outputs);
+	}
+
+	return output;
+}
+
+///<summary>
+/// AsyncFileOutput::Write
+/// I/O context callback. Copy the muxer output into free blocks and queue them for the disk thread.
+/// Only waits when the whole budget is in flight.
+///</summary>
+int AsyncFileOutput::Write(uint8_t* _pBuffer, int _iSize)
+{
+	int iOffset = 0;
+	while(iOffset < _iSize)
+	{
+		if(m_bError)
+			return AVERROR(EIO);
+
+		WriteBlock^ block = nullptr;
+		if(!m_FreeBlocks->TryDequeue(block))
+		{
+			// The disk is slower than the muxer right now.
+			Stopwatch^ stallWatch = Stopwatch::StartNew();
+			if(!m_FreeBlocks->Dequeue(block))
+				return AVERROR(EIO);
+
+			Monitor::Enter(m_Stats);
+			m_Stats->iStalls++;
+			m_Stats->fStallTime += stallWatch->Elapsed.TotalMilliseconds;
+			Monitor::Exit(m_Stats);
+		}
+
+		int iSize = Math::Min(m_iBlockSize, _iSize - iOffset);
+		Marshal::Copy(IntPtr(_pBuffer + iOffset), block->data, 0, iSize);
+		block->iSize = iSize;
+		block->iPosition = m_iPosition;
+
+		m_iPosition += iSize;
+		m_iSize = Math::Max(m_iSize, m_iPosition);
+		iOffset += iSize;
+
+		Monitor::Enter(m_Stats);
+		m_Stats->iPendingBytes += iSize;
+		m_Stats->iMaxPendingBytes = Math::Max(m_Stats->iMaxPendingBytes, m_Stats->iPendingBytes);
+		Monitor::Exit(m_Stats);
+
+		m_PendingBlocks->Enqueue(block);
+	}
+
+	return _iSize;
+}
+
+///<summary>
+/// AsyncFileOutput::Seek
+/// I/O context callback. Only moves the position given to the next blocks, the disk thread follows.
+///</summary>
+int64_t AsyncFileOutput::Seek(int64_t _iOffset, int _iWhence)
+{
+	int64_t iPosition;
+
+	switch(_iWhence)
+	{
+		case AVSEEK_SIZE:
+			return m_iSize;
+		case SEEK_SET:
+			iPosition = _iOffset;
+			break;
+		case SEEK_CUR:
+			iPosition = m_iPosition + _iOffset;
+			break;
+		case SEEK_END:
+			iPosition = m_iSize + _iOffset;
+			break;
+		default:
+			return AVERROR(EINVAL);
+	}
+
+	if(iPosition < 0)
+		return AVERROR(EINVAL);
+
+	m_iPosition = iPosition;
+	return m_iPosition;
+}
+
+///<summary>
+/// AsyncFileOutput::WriteLoop
+/// Disk thread. Write the blocks in order and recycle them.
+///</summary>
+void AsyncFileOutput::WriteLoop()
+{
+	Stopwatch^ writeWatch = gcnew Stopwatch();
+	int64_t iFilePosition = 0;
+	WriteBlock^ block = nullptr;
+
+	while(m_PendingBlocks->Dequeue(block))
+	{
+		if(!m_bError)
+		{
+			writeWatch->Reset();
+			writeWatch->Start();
+
+			try
+			{
+				if(block->iPosition != iFilePosition)
+				{
+					m_Stream->Position = block->iPosition;
+				}
+
+				m_Stream->Write(block->data, 0, block->iSize);
+				iFilePosition = block->iPosition + block->iSize;
+			}
+			catch(Exception^ exp)
+			{
+				// The muxer gets an error on its next write.
+				log->Error(String::Format("Error while writing {0}: {1}", m_FilePath, exp->Message));
+				m_bError = true;
+			}
+
+			writeWatch->Stop();
+			double fLatency = writeWatch->Elapsed.TotalMilliseconds;
+
+			Monitor::Enter(m_Stats);
+			m_Stats->iWrites++;
+			m_Stats->iBytesWritten += block->iSize;
+			m_Stats->fTotalLatency += fLatency;
+			m_Stats->fMaxLatency = Math::Max(m_Stats->fMaxLatency, fLatency);
+			Monitor::Exit(m_Stats);
+		}
+
+		Monitor::Enter(m_Stats);
+		m_Stats->iPendingBytes -= block->iSize;
+		Monitor::Exit(m_Stats);
+
+		m_FreeBlocks->Enqueue(block);
+	}
+}
+
+///<summary>
+/// AsyncFileOutput::FreeContext
+/// Release the I/O context and its buffer.
+///</summary>
+void AsyncFileOutput::FreeContext()
+{
+	Monitor::Enter(m_Outputs);
+	try
+	{
+		m_Outputs->Remove(IntPtr(m_pContext));
+	}
+	finally
+	{
+		Monitor::Exit(m_Outputs);
+	}
+
+	av_free(m_pContext->buffer);
+	av_free(m_pContext);
+	m_pContext = nullptr;
+
+	m_Handle.Free();
+}
+
+}
+}
@@ -0,0 +1,125 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+//-----------------------------------------------------------------------------
+// AsyncFileOutput - an output I/O context for the muxer, with write-behind.
+//
+// The muxer writes into fixed size blocks that are queued and written to disk,
+// in order, by a dedicated thread. A slow disk only stalls the muxer once
+// the in-flight budget is used up.
+// Seeks (header updates at the end of the file) are recorded with the blocks.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::Diagnostics;
+using namespace System::IO;
+using namespace System::Reflection;
+using namespace System::Runtime::InteropServices;
+using namespace System::Threading;
+
+extern "C"
+{
+#define __STDC_CONSTANT_MACROS
+#define __STDC_LIMIT_MACROS
+#include <avformat.h>
+}
+
+#include "BoundedQueue.h"
+
+namespace Kinovea
+{
+	namespace VideoFiles
+	{
+		/// <summary>
+		/// Disk statistics of the asynchronous output, shared by the successive files of a recording.
+		/// Durations are in milliseconds.
+		/// </summary>
+		public ref class AsyncWriteStats
+		{
+		public:
+			int64_t iWrites;						// Blocks written to disk.
+			int64_t iBytesWritten;
+			double fTotalLatency;					// Time spent in disk writes.
+			double fMaxLatency;
+			int64_t iPendingBytes;					// Given by the muxer, not yet on disk.
+			int64_t iMaxPendingBytes;
+			int iStalls;							// Number of times the muxer waited for the disk because the budget was used up.
+			double fStallTime;
+
+			property double AverageLatency
+			{
+				double get(){ return (iWrites > 0) ? fTotalLatency / iWrites : 0;}
+			}
+		};
+
+		/// <summary>
+		/// A chunk of muxer output waiting to be written to disk. Recycled for the whole file.
+		/// </summary>
+		public ref class WriteBlock
+		{
+		public:
+			array<Byte>^ data;
+			int iSize;
+			int64_t iPosition;						// Offset in the file.
+		};
+
+		public ref class AsyncFileOutput
+		{
+		public:
+			AsyncFileOutput(int _iBlockSize, int64_t _iBudget, AsyncWriteStats^ _stats);
+			bool Open(String^ _FilePath);
+			bool Close();
+
+		internal:
+			property AVIOContext* Context
+			{
+				AVIOContext* get(){ return m_pContext;}
+			}
+			static AsyncFileOutput^ FromContext(AVIOContext* _pContext);
+			int		Write(uint8_t* _pBuffer, int _iSize);
+			int64_t Seek(int64_t _iOffset, int _iWhence);
+
+		private:
+			void	WriteLoop();
+			void	FreeContext();
+
+			static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+			static Dictionary<IntPtr, AsyncFileOutput^>^ m_Outputs = gcnew Dictionary<IntPtr, AsyncFileOutput^>();
+
+			AVIOContext* m_pContext;
+			GCHandle m_Handle;
+			FileStream^ m_Stream;
+			String^ m_FilePath;
+
+			int m_iBlockSize;
+			int m_iBlocks;
+			BoundedQueue<WriteBlock^>^ m_FreeBlocks;
+			BoundedQueue<WriteBlock^>^ m_PendingBlocks;
+			Thread^ m_WriteThread;
+			AsyncWriteStats^ m_Stats;
+
+			int64_t m_iPosition;					// Position of the muxer in the file.
+			int64_t m_iSize;						// Size of the file once every pending block is written.
+			bool m_bError;
+		};
+	}
+}
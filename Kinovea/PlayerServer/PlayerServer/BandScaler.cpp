@@ -0,0 +1,379 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+#include <string.h>
+#include "BandScaler.h"
+
+namespace Kinovea
+{
+namespace VideoFiles
+{
+
+// Pointers to row _iRow of each plane. Chroma planes are _iChromaShift times shorter.
+static void OffsetPlanes(uint8_t** _pPlanes, int* _pStrides, int _iRow, int _iChromaShift, uint8_t** _pResult)
+{
+	for(int i=0;i<4;i++)
+	{
+		int iRow = (i == 1 || i == 2) ? (_iRow >> _iChromaShift) : _iRow;
+		_pResult[i] = (_pPlanes[i] != nullptr) ? _pPlanes[i] + iRow * _pStrides[i] : nullptr;
+	}
+}
+
+static int GreatestCommonDivisor(int _a, int _b)
+{
+	while(_b != 0)
+	{
+		int t = _a % _b;
+		_a = _b;
+		_b = t;
+	}
+	return _a;
+}
+
+///<summary>
+/// ScaleBandKernel
+/// One sws_scale call per band, with the context of that band.
+/// The band is extended by iMarginRows on both sides and scaled into its own buffer,
+/// then the rows of the band proper are copied to the output.
+///</summary>
+class ScaleBandKernel : public RowKernel
+{
+public:
+	ScaledBand* pBands;
+	int iBandRows;
+	int iMarginRows;
+	bool bFailed;
+
+	uint8_t** pSource;
+	int* pSourceStrides;
+	int iSourceHeight;
+	int iSourceShift;
+	uint8_t** pDestination;
+	int* pDestinationStrides;
+	int iDestinationHeight;
+	int iDestinationShift;
+
+	// Output rows [iStepRows * k] match input rows [iSourceStepRows * k] exactly.
+	int iStepRows;
+	int iSourceStepRows;
+
+	///<summary>
+	/// Output rows of a band with its margins, and the input rows they are scaled from.
+	///</summary>
+	void GetExtendedRows(int _iFirstRow, int _iRows, int* _pFirst, int* _pEnd, int* _pSourceFirst, int* _pSourceEnd)
+	{
+		int iFirst = Math::Max(0, _iFirstRow - iMarginRows);
+		int iEnd = Math::Min(iDestinationHeight, _iFirstRow + _iRows + iMarginRows);
+
+		*_pFirst = iFirst;
+		*_pEnd = iEnd;
+		*_pSourceFirst = iFirst / iStepRows * iSourceStepRows;
+		*_pSourceEnd = (iEnd == iDestinationHeight) ? iSourceHeight : iEnd / iStepRows * iSourceStepRows;
+	}
+
+	virtual void Process(int _iFirstRow, int _iRows)
+	{
+		ScaledBand* pBand = &pBands[_iFirstRow / iBandRows];
+
+		if(iMarginRows == 0)
+		{
+			if(sws_scale(pBand->pContext, pSource, pSourceStrides, 0, iSourceHeight, pDestination, pDestinationStrides) < 0)
+				bFailed = true;
+			return;
+		}
+
+		int iFirst;
+		int iEnd;
+		int iSourceFirst;
+		int iSourceEnd;
+		GetExtendedRows(_iFirstRow, _iRows, &iFirst, &iEnd, &iSourceFirst, &iSourceEnd);
+
+		uint8_t* pSourceBand[4];
+		OffsetPlanes(pSource, pSourceStrides, iSourceFirst, iSourceShift, pSourceBand);
+
+		if(sws_scale(pBand->pContext, pSourceBand, pSourceStrides, 0, iSourceEnd - iSourceFirst, pBand->picture.data, pBand->picture.linesize) < 0)
+		{
+			bFailed = true;
+			return;
+		}
+
+		// Keep the band proper, drop the margins.
+		int iChromaRound = (1 << iDestinationShift) - 1;
+		for(int i=0;i<4;i++)
+		{
+			if(pBand->picture.data[i] == nullptr || pDestination[i] == nullptr)
+				continue;
+
+			bool bChroma = (i == 1 || i == 2);
+			int iSkip = bChroma ? ((_iFirstRow - iFirst) >> iDestinationShift) : (_iFirstRow - iFirst);
+			int iRows = bChroma ? ((_iRows + iChromaRound) >> iDestinationShift) : _iRows;
+			// The destination may have a tighter stride than the band buffer.
+			int iRowBytes = Math::Min(pBand->picture.linesize[i], pDestinationStrides[i]);
+			uint8_t* pFrom = pBand->picture.data[i] + iSkip * pBand->picture.linesize[i];
+			uint8_t* pTo = pDestination[i] + (bChroma ? (_iFirstRow >> iDestinationShift) : _iFirstRow) * pDestinationStrides[i];
+
+			for(int y=0;y<iRows;y++)
+			{
+				memcpy(pTo + y * pDestinationStrides[i], pFrom + y * pBand->picture.linesize[i], iRowBytes);
+			}
+		}
+	}
+};
+
+BandScaler::BandScaler()
+{
+	m_pBands = nullptr;
+	m_iBands = 0;
+	m_iBytes = 0;
+}
+BandScaler::~BandScaler()
+{
+	this->!BandScaler();
+}
+BandScaler::!BandScaler()
+{
+	Release();
+}
+
+///<summary>
+/// BandScaler::Scale
+/// Same as a full frame sws_scale, in parallel bands when the image is large enough.
+///</summary>
+bool BandScaler::Scale(uint8_t** _pSource, int* _pSourceStrides, int _iSourceWidth, int _iSourceHeight, PixelFormat _sourceFormat,
+	uint8_t** _pDestination, int* _pDestinationStrides, int _iDestinationWidth, int _iDestinationHeight, PixelFormat _destinationFormat, int _iFlags)
+{
+	int iHorizontalShift;
+	ScaleBandKernel kernel;
+	kernel.bFailed = false;
+	kernel.pSource = _pSource;
+	kernel.pSourceStrides = _pSourceStrides;
+	kernel.iSourceHeight = _iSourceHeight;
+	avcodec_get_chroma_sub_sample(_sourceFormat, &iHorizontalShift, &kernel.iSourceShift);
+	kernel.pDestination = _pDestination;
+	kernel.pDestinationStrides = _pDestinationStrides;
+	kernel.iDestinationHeight = _iDestinationHeight;
+	avcodec_get_chroma_sub_sample(_destinationFormat, &iHorizontalShift, &kernel.iDestinationShift);
+
+	// Single context unless every band can be cut on aligned rows with a margin covering the filter.
+	kernel.iBandRows = _iDestinationHeight;
+	kernel.iMarginRows = 0;
+	kernel.iStepRows = 1;
+	kernel.iSourceStepRows = 1;
+
+	int iRadius = GetFilterRadius(_iFlags);
+	if(iRadius > 0 && CanSplit(_sourceFormat, _destinationFormat))
+	{
+		int iBands = ParallelRows::BandCount(Math::Max(_iSourceWidth, _iDestinationWidth), Math::Max(_iSourceHeight, _iDestinationHeight));
+
+		// Smallest row steps matching on both sides, also on chroma rows.
+		int iDivisor = GreatestCommonDivisor(_iSourceHeight, _iDestinationHeight);
+		int iStepRows = _iDestinationHeight / iDivisor;
+		int iSourceStepRows = _iSourceHeight / iDivisor;
+		while((iStepRows & ((1 << kernel.iDestinationShift) - 1)) != 0 || (iSourceStepRows & ((1 << kernel.iSourceShift) - 1)) != 0)
+		{
+			iStepRows *= 2;
+			iSourceStepRows *= 2;
+		}
+
+		// Input rows seen by the filter on each side of a row, counted in the most subsampled plane.
+		int iShift = Math::Max(kernel.iSourceShift, kernel.iDestinationShift);
+		int iRatio = (_iSourceHeight + _iDestinationHeight - 1) / _iDestinationHeight;
+		int iSourceMargin = ((iRadius + 1) * iRatio) << iShift;
+		int iMarginRows = (int)(((int64_t)iSourceMargin * _iDestinationHeight + _iSourceHeight - 1) / _iSourceHeight);
+		iMarginRows = (iMarginRows + iStepRows - 1) / iStepRows * iStepRows;
+
+		int iBandRows = ParallelRows::BandRows(_iDestinationHeight, iBands);
+		iBandRows = (iBandRows + iStepRows - 1) / iStepRows * iStepRows;
+
+		// Not worth it if the margins are larger than the bands.
+		if(iBands > 1 && iBandRows < _iDestinationHeight && iBandRows >= iMarginRows)
+		{
+			kernel.iBandRows = iBandRows;
+			kernel.iMarginRows = iMarginRows;
+			kernel.iStepRows = iStepRows;
+			kernel.iSourceStepRows = iSourceStepRows;
+		}
+	}
+
+	int iBandCount = (_iDestinationHeight + kernel.iBandRows - 1) / kernel.iBandRows;
+	Allocate(iBandCount);
+	kernel.pBands = m_pBands;
+
+	// Contexts and buffers are prepared here, the bands only use them.
+	for(int i=0;i<iBandCount;i++)
+	{
+		ScaledBand* pBand = &m_pBands[i];
+
+		if(kernel.iMarginRows == 0)
+		{
+			pBand->pContext = sws_getCachedContext(pBand->pContext, _iSourceWidth, _iSourceHeight, _sourceFormat, _iDestinationWidth, _iDestinationHeight, _destinationFormat, _iFlags, NULL, NULL, NULL);
+			if(pBand->pContext == nullptr)
+				return false;
+			continue;
+		}
+
+		int iFirstRow = i * kernel.iBandRows;
+		int iRows = Math::Min(kernel.iBandRows, _iDestinationHeight - iFirstRow);
+		int iFirst;
+		int iEnd;
+		int iSourceFirst;
+		int iSourceEnd;
+		kernel.GetExtendedRows(iFirstRow, iRows, &iFirst, &iEnd, &iSourceFirst, &iSourceEnd);
+
+		pBand->pContext = sws_getCachedContext(pBand->pContext, _iSourceWidth, iSourceEnd - iSourceFirst, _sourceFormat, _iDestinationWidth, iEnd - iFirst, _destinationFormat, _iFlags, NULL, NULL, NULL);
+		if(pBand->pContext == nullptr)
+			return false;
+
+		if(!pBand->bPictureAllocated || pBand->iPictureWidth != _iDestinationWidth || pBand->iPictureHeight != iEnd - iFirst || pBand->pictureFormat != _destinationFormat)
+		{
+			FreePicture(pBand);
+
+			if(avpicture_alloc(&pBand->picture, _destinationFormat, _iDestinationWidth, iEnd - iFirst) < 0)
+				return false;
+
+			Interlocked::Add(m_iBytes, (int64_t)avpicture_get_size(_destinationFormat, _iDestinationWidth, iEnd - iFirst));
+			pBand->bPictureAllocated = true;
+			pBand->iPictureWidth = _iDestinationWidth;
+			pBand->iPictureHeight = iEnd - iFirst;
+			pBand->pictureFormat = _destinationFormat;
+		}
+	}
+
+	ParallelRows::RunBands(&kernel, _iDestinationHeight, kernel.iBandRows);
+
+	return !kernel.bFailed;
+}
+
+///<summary>
+/// BandScaler::Release
+/// Free the scaling contexts and band buffers.
+///</summary>
+void BandScaler::Release()
+{
+	if(m_pBands == nullptr)
+		return;
+
+	for(int i=0;i<m_iBands;i++)
+	{
+		if(m_pBands[i].pContext != nullptr)
+		{
+			sws_freeContext(m_pBands[i].pContext);
+		}
+
+		FreePicture(&m_pBands[i]);
+	}
+
+	delete [] m_pBands;
+	m_pBands = nullptr;
+	m_iBands = 0;
+	Interlocked::Exchange(m_iBytes, 0);
+}
+
+void BandScaler::FreePicture(ScaledBand* _pBand)
+{
+	if(!_pBand->bPictureAllocated)
+		return;
+
+	avpicture_free(&_pBand->picture);
+	Interlocked::Add(m_iBytes, -(int64_t)avpicture_get_size(_pBand->pictureFormat, _pBand->iPictureWidth, _pBand->iPictureHeight));
+	_pBand->bPictureAllocated = false;
+}
+
+void BandScaler::Allocate(int _iBands)
+{
+	if(_iBands <= m_iBands)
+		return;
+
+	ScaledBand* pBands = new ScaledBand[_iBands];
+	for(int i=0;i<_iBands;i++)
+	{
+		if(i < m_iBands)
+		{
+			pBands[i] = m_pBands[i];
+		}
+		else
+		{
+			memset(&pBands[i], 0, sizeof(ScaledBand));
+			pBands[i].pictureFormat = PIX_FMT_NONE;
+		}
+	}
+
+	delete [] m_pBands;
+	m_pBands = pBands;
+	m_iBands = _iBands;
+}
+
+///<summary>
+/// BandScaler::CanSplit
+/// Palette formats can't be offset to a band. Output chroma rows must not be shared by two bands.
+///</summary>
+bool BandScaler::CanSplit(PixelFormat _sourceFormat, PixelFormat _destinationFormat)
+{
+	switch(_sourceFormat)
+	{
+		case PIX_FMT_PAL8:
+		case PIX_FMT_GRAY8:
+		case PIX_FMT_RGB8:
+		case PIX_FMT_BGR8:
+		case PIX_FMT_RGB4_BYTE:
+		case PIX_FMT_BGR4_BYTE:
+			return false;
+		default:
+			break;
+	}
+
+	switch(_destinationFormat)
+	{
+		case PIX_FMT_PAL8:
+		case PIX_FMT_GRAY8:
+		case PIX_FMT_RGB8:
+		case PIX_FMT_BGR8:
+		case PIX_FMT_RGB4_BYTE:
+		case PIX_FMT_BGR4_BYTE:
+			return false;
+		default:
+			break;
+	}
+
+	int iHorizontalShift;
+	int iVerticalShift;
+	avcodec_get_chroma_sub_sample(_destinationFormat, &iHorizontalShift, &iVerticalShift);
+	return iVerticalShift <= 1;
+}
+
+///<summary>
+/// BandScaler::GetFilterRadius
+/// Input rows used by the vertical filter on each side of a row, at scale 1.
+/// Zero when the support is too wide to split the image.
+///</summary>
+int BandScaler::GetFilterRadius(int _iFlags)
+{
+	if(_iFlags & SWS_SINC)
+		return 0;
+	if(_iFlags & (SWS_LANCZOS | SWS_SPLINE | SWS_GAUSS | SWS_X))
+		return 4;
+	if(_iFlags & (SWS_BICUBIC | SWS_BICUBLIN))
+		return 2;
+
+	// Point, area, bilinear.
+	return 1;
+}
+
+}
+}
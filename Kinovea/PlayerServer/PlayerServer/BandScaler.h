@@ -0,0 +1,102 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+//-----------------------------------------------------------------------------
+// BandScaler - swscale conversion split in horizontal bands converted in parallel.
+//
+// Each band of the output has its own scaling context, fed with the matching
+// rows of the input. Bands are only used for large images (see ParallelRows),
+// smaller ones go through a single context.
+// The contexts are kept between calls and only rebuilt when the geometry changes.
+//
+// To avoid seams, each band is scaled with a margin of rows above and below,
+// wider than the support of the filter, into a buffer of its own. Only the rows
+// of the band itself are then copied to the output.
+// Band limits fall on rows where input and output line up exactly, so the
+// filter sees the same input rows as in a full frame conversion.
+// Filters with an unbounded support (sinc) always use a single context.
+//
+// An instance must not be used from two threads at the same time.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+using namespace System;
+using namespace System::Threading;
+
+extern "C"
+{
+#define __STDC_CONSTANT_MACROS
+#define __STDC_LIMIT_MACROS
+#include <avcodec.h>
+#include <swscale.h>
+}
+
+#include "ParallelRows.h"
+
+namespace Kinovea
+{
+	namespace VideoFiles
+	{
+		// Context and output buffer of one band. The buffer is only used when there are several bands.
+		struct ScaledBand
+		{
+			SwsContext* pContext;
+			AVPicture picture;
+			bool bPictureAllocated;
+			int iPictureWidth;
+			int iPictureHeight;
+			PixelFormat pictureFormat;
+		};
+
+		public ref class BandScaler
+		{
+		public:
+			BandScaler();
+			~BandScaler();
+		protected:
+			!BandScaler();
+
+		public:
+			/// <summary>
+			/// Bytes held between frames by the band buffers.
+			/// </summary>
+			property int64_t Bytes
+			{
+				int64_t get(){ return Interlocked::Read(m_iBytes);}
+			}
+
+		internal:
+			bool Scale(uint8_t** _pSource, int* _pSourceStrides, int _iSourceWidth, int _iSourceHeight, PixelFormat _sourceFormat,
+				uint8_t** _pDestination, int* _pDestinationStrides, int _iDestinationWidth, int _iDestinationHeight, PixelFormat _destinationFormat, int _iFlags);
+			void Release();
+
+		private:
+			void Allocate(int _iBands);
+			void FreePicture(ScaledBand* _pBand);
+			static bool CanSplit(PixelFormat _sourceFormat, PixelFormat _destinationFormat);
+			static int GetFilterRadius(int _iFlags);
+
+		private:
+			ScaledBand* m_pBands;
+			int m_iBands;
+			int64_t m_iBytes;
+		};
+	}
+}
@@ -0,0 +1,180 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+#pragma once
+
+using namespace System;
+using namespace System::Collections::Generic;
+using namespace System::Threading;
+
+namespace Kinovea
+{
+	namespace VideoFiles
+	{
+		/// <summary>
+		/// A thread safe FIFO with a fixed capacity, used to connect the stages of the encoding pipeline.
+		/// Producers either block while the queue is full or get an immediate refusal (TryEnqueue).
+		/// Consumers block until an item is available or the queue is closed and drained.
+		/// </summary>
+		generic<typename T>
+		public ref class BoundedQueue
+		{
+		public:
+			property int Count
+			{
+				int get()
+				{
+					Monitor::Enter(m_Locker);
+					try { return m_Queue->Count; }
+					finally { Monitor::Exit(m_Locker); }
+				}
+			}
+			property int Capacity
+			{
+				int get(){ return m_iCapacity; }
+			}
+			property bool Full
+			{
+				bool get(){ return Count >= m_iCapacity; }
+			}
+
+			BoundedQueue(int _iCapacity)
+			{
+				m_iCapacity = (_iCapacity > 0) ? _iCapacity : 1;
+				m_Queue = gcnew Queue<T>(m_iCapacity);
+				m_Locker = gcnew Object();
+				m_bClosed = false;
+			}
+
+			/// <summary>
+			/// Push an item, waiting for room if needed. Returns false if the queue was closed meanwhile.
+			/// </summary>
+			bool Enqueue(T _item)
+			{
+				Monitor::Enter(m_Locker);
+				try
+				{
+					while(m_Queue->Count >= m_iCapacity && !m_bClosed)
+						Monitor::Wait(m_Locker);
+
+					if(m_bClosed)
+						return false;
+
+					m_Queue->Enqueue(_item);
+					Monitor::PulseAll(m_Locker);
+					return true;
+				}
+				finally
+				{
+					Monitor::Exit(m_Locker);
+				}
+			}
+
+			/// <summary>
+			/// Push an item if there is room right now. Never blocks.
+			/// </summary>
+			bool TryEnqueue(T _item)
+			{
+				Monitor::Enter(m_Locker);
+				try
+				{
+					if(m_bClosed || m_Queue->Count >= m_iCapacity)
+						return false;
+
+					m_Queue->Enqueue(_item);
+					Monitor::PulseAll(m_Locker);
+					return true;
+				}
+				finally
+				{
+					Monitor::Exit(m_Locker);
+				}
+			}
+
+			/// <summary>
+			/// Pop an item, waiting for one if needed.
+			/// Returns false once the queue is closed and there is nothing left to consume.
+			/// </summary>
+			bool Dequeue(T% _item)
+			{
+				Monitor::Enter(m_Locker);
+				try
+				{
+					while(m_Queue->Count == 0 && !m_bClosed)
+						Monitor::Wait(m_Locker);
+
+					if(m_Queue->Count == 0)
+						return false;
+
+					_item = m_Queue->Dequeue();
+					Monitor::PulseAll(m_Locker);
+					return true;
+				}
+				finally
+				{
+					Monitor::Exit(m_Locker);
+				}
+			}
+
+			/// <summary>
+			/// Pop an item if one is available right now. Never blocks.
+			/// </summary>
+			bool TryDequeue(T% _item)
+			{
+				Monitor::Enter(m_Locker);
+				try
+				{
+					if(m_Queue->Count == 0)
+						return false;
+
+					_item = m_Queue->Dequeue();
+					Monitor::PulseAll(m_Locker);
+					return true;
+				}
+				finally
+				{
+					Monitor::Exit(m_Locker);
+				}
+			}
+
+			/// <summary>
+			/// Signal that no more items will be pushed. Wakes up every waiting thread.
+			/// </summary>
+			void Close()
+			{
+				Monitor::Enter(m_Locker);
+				try
+				{
+					m_bClosed = true;
+					Monitor::PulseAll(m_Locker);
+				}
+				finally
+				{
+					Monitor::Exit(m_Locker);
+				}
+			}
+
+		private:
+			Queue<T>^ m_Queue;
+			Object^ m_Locker;
+			int m_iCapacity;
+			bool m_bClosed;
+		};
+	}
+}
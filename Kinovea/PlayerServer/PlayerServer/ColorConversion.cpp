@@ -0,0 +1,448 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+#include "ColorConversion.h"
+
+//------------------------------------------------------------------------
+// Native kernels.
+// SSE intrinsics can't be compiled to MSIL, this part must stay unmanaged.
+//------------------------------------------------------------------------
+#pragma managed(push, off)
+
+#include <emmintrin.h>
+#include <intrin.h>
+
+namespace Kinovea
+{
+namespace VideoFiles
+{
+
+// YUV to RGB coefficients, in 1/8192.
+struct YuvCoefficients
+{
+	int iYOffset;
+	int iY;
+	int iRV;
+	int iGU;
+	int iGV;
+	int iBU;
+};
+static const YuvCoefficients VideoRange = { 16, 9535, 13074, 3203, 6660, 16531 };
+static const YuvCoefficients FullRange = { 0, 8192, 11485, 2818, 5849, 14516 };
+
+// RGB to YUV coefficients, in 1/256.
+struct RgbCoefficients
+{
+	int iYOffset;
+	int iYR;
+	int iYG;
+	int iYB;
+	int iUR;
+	int iUG;
+	int iUB;
+	int iVR;
+	int iVG;
+	int iVB;
+};
+static const RgbCoefficients VideoRangeRgb = { 16, 66, 129, 25, -38, -74, 112, 112, -94, -18 };
+static const RgbCoefficients FullRangeRgb = { 0, 77, 150, 29, -43, -85, 128, 128, -107, -21 };
+
+static bool DetectSse2()
+{
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+}
+
+static inline uint8_t Clip(int _iValue)
+{
+	return (uint8_t)(_iValue < 0 ? 0 : (_iValue > 255 ? 255 : _iValue));
+}
+
+///<summary>
+/// YuvRowToBgra
+/// Plain version, from pixel _iFirst to the end of the row.
+/// _iChromaStep is 1 for planar chroma and 2 for interleaved (NV12).
+///</summary>
+static void YuvRowToBgra(const uint8_t* _pY, const uint8_t* _pU, const uint8_t* _pV, int _iChromaStep, uint8_t* _pOutput, int _iFirst, int _iWidth, const YuvCoefficients& _c)
+{
+	for(int x=_iFirst;x<_iWidth;x++)
+	{
+		int y = (_pY[x] - _c.iYOffset) * _c.iY + 4096;
+		int u = _pU[(x >> 1) * _iChromaStep] - 128;
+		int v = _pV[(x >> 1) * _iChromaStep] - 128;
+
+		uint8_t* pPixel = _pOutput + x * 4;
+		pPixel[0] = Clip((y + _c.iBU * u) >> 13);
+		pPixel[1] = Clip((y - _c.iGU * u - _c.iGV * v) >> 13);
+		pPixel[2] = Clip((y + _c.iRV * v) >> 13);
+		pPixel[3] = 255;
+	}
+}
+
+///<summary>
+/// YuvRowToBgraSse2
+/// 16 pixels at a time, in 16 bits fixed point (1/32). Returns the number of pixels done.
+///</summary>
+static int YuvRowToBgraSse2(const uint8_t* _pY, const uint8_t* _pU, const uint8_t* _pV, int _iChromaStep, uint8_t* _pOutput, int _iWidth, const YuvCoefficients& _c)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i yOffset = _mm_set1_epi16((short)_c.iYOffset);
+	const __m128i chromaOffset = _mm_set1_epi16(128);
+	const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+	const __m128i round = _mm_set1_epi16(16);
+	const __m128i alpha = _mm_set1_epi8((char)0xFF);
+	const __m128i cy = _mm_set1_epi16((short)(_c.iY * 2));
+	const __m128i crv = _mm_set1_epi16((short)_c.iRV);
+	const __m128i cgu = _mm_set1_epi16((short)_c.iGU);
+	const __m128i cgv = _mm_set1_epi16((short)_c.iGV);
+	const __m128i cbu = _mm_set1_epi16((short)_c.iBU);
+
+	int x = 0;
+	for(;x + 16 <= _iWidth;x += 16)
+	{
+		// The 8 chroma samples shared by the 16 pixels, widened to 16 bits.
+		__m128i u;
+		__m128i v;
+		if(_iChromaStep == 1)
+		{
+			u = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(_pU + x / 2)), zero);
+			v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(_pV + x / 2)), zero);
+		}
+		else
+		{
+			__m128i uv = _mm_loadu_si128((const __m128i*)(_pU + x));
+			u = _mm_and_si128(uv, lowBytes);
+			v = _mm_srli_epi16(uv, 8);
+		}
+
+		// Chroma terms. Centered values are scaled by 256 so the high half of the product is in 1/32.
+		u = _mm_slli_epi16(_mm_sub_epi16(u, chromaOffset), 8);
+		v = _mm_slli_epi16(_mm_sub_epi16(v, chromaOffset), 8);
+		__m128i r = _mm_mulhi_epi16(v, crv);
+		__m128i g = _mm_add_epi16(_mm_mulhi_epi16(u, cgu), _mm_mulhi_epi16(v, cgv));
+		__m128i b = _mm_mulhi_epi16(u, cbu);
+
+		// Luma term, in 1/32 too.
+		__m128i y8 = _mm_loadu_si128((const __m128i*)(_pY + x));
+		__m128i yLow = _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(y8, zero), yOffset), 7), cy);
+		__m128i yHigh = _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(y8, zero), yOffset), 7), cy);
+
+		// Each chroma term is used by two neighbor pixels.
+		__m128i R = _mm_packus_epi16(
+			_mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(yLow, _mm_unpacklo_epi16(r, r)), round), 5),
+			_mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(yHigh, _mm_unpackhi_epi16(r, r)), round), 5));
+		__m128i G = _mm_packus_epi16(
+			_mm_srai_epi16(_mm_adds_epi16(_mm_subs_epi16(yLow, _mm_unpacklo_epi16(g, g)), round), 5),
+			_mm_srai_epi16(_mm_adds_epi16(_mm_subs_epi16(yHigh, _mm_unpackhi_epi16(g, g)), round), 5));
+		__m128i B = _mm_packus_epi16(
+			_mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(yLow, _mm_unpacklo_epi16(b, b)), round), 5),
+			_mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(yHigh, _mm_unpackhi_epi16(b, b)), round), 5));
+
+		// Interleave to B, G, R, A. Alpha is opaque so the result is also premultiplied.
+		__m128i bgLow = _mm_unpacklo_epi8(B, G);
+		__m128i bgHigh = _mm_unpackhi_epi8(B, G);
+		__m128i raLow = _mm_unpacklo_epi8(R, alpha);
+		__m128i raHigh = _mm_unpackhi_epi8(R, alpha);
+
+		__m128i* pOutput = (__m128i*)(_pOutput + x * 4);
+		_mm_storeu_si128(pOutput, _mm_unpacklo_epi16(bgLow, raLow));
+		_mm_storeu_si128(pOutput + 1, _mm_unpackhi_epi16(bgLow, raLow));
+		_mm_storeu_si128(pOutput + 2, _mm_unpacklo_epi16(bgHigh, raHigh));
+		_mm_storeu_si128(pOutput + 3, _mm_unpackhi_epi16(bgHigh, raHigh));
+	}
+
+	return x;
+}
+
+///<summary>
+/// BgrRowsToYuv
+/// Plain version for a pair of rows, from pixel _iFirst (even) to the end.
+/// _pYBottom is null for the last row of an odd height picture, _pBottom is then the same as _pTop.
+///</summary>
+static void BgrRowsToYuv(const uint8_t* _pTop, const uint8_t* _pBottom, int _iPixelSize, uint8_t* _pYTop, uint8_t* _pYBottom, uint8_t* _pU, uint8_t* _pV, int _iFirst, int _iWidth, const RgbCoefficients& _c)
+{
+	for(int x=_iFirst;x<_iWidth;x++)
+	{
+		const uint8_t* p = _pTop + x * _iPixelSize;
+		_pYTop[x] = Clip(((_c.iYR * p[2] + _c.iYG * p[1] + _c.iYB * p[0] + 128) >> 8) + _c.iYOffset);
+
+		if(_pYBottom != nullptr)
+		{
+			p = _pBottom + x * _iPixelSize;
+			_pYBottom[x] = Clip(((_c.iYR * p[2] + _c.iYG * p[1] + _c.iYB * p[0] + 128) >> 8) + _c.iYOffset);
+		}
+	}
+
+	for(int x=_iFirst / 2;x<(_iWidth + 1) / 2;x++)
+	{
+		// Last column of an odd width picture has no pair.
+		int iLeft = 2 * x * _iPixelSize;
+		int iRight = (2 * x + 1 < _iWidth) ? iLeft + _iPixelSize : iLeft;
+		int b = _pTop[iLeft] + _pTop[iRight] + _pBottom[iLeft] + _pBottom[iRight];
+		int g = _pTop[iLeft + 1] + _pTop[iRight + 1] + _pBottom[iLeft + 1] + _pBottom[iRight + 1];
+		int r = _pTop[iLeft + 2] + _pTop[iRight + 2] + _pBottom[iLeft + 2] + _pBottom[iRight + 2];
+
+		_pU[x] = Clip(((_c.iUR * r + _c.iUG * g + _c.iUB * b + 512) >> 10) + 128);
+		_pV[x] = Clip(((_c.iVR * r + _c.iVG * g + _c.iVB * b + 512) >> 10) + 128);
+	}
+}
+
+// [a0+a1, a2+a3, b0+b1, b2+b3], from the pairs of partial sums left by _mm_madd_epi16.
+static inline __m128i PairSums(__m128i _a, __m128i _b)
+{
+	__m128i a = _mm_shuffle_epi32(_a, _MM_SHUFFLE(3, 1, 2, 0));
+	__m128i b = _mm_shuffle_epi32(_b, _MM_SHUFFLE(3, 1, 2, 0));
+	return _mm_add_epi32(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+}
+
+// Luma of 4 BGRA pixels, as 32 bits integers.
+static inline __m128i LumaOf4(__m128i _pixels, __m128i _coefficients, __m128i _round)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(_pixels, zero), _coefficients);
+	__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(_pixels, zero), _coefficients);
+	return _mm_srai_epi32(_mm_add_epi32(PairSums(lo, hi), _round), 8);
+}
+
+// Sums of the 2x2 blocks of 4 BGRA pixels on two rows, as 16 bits [B G R A B G R A].
+static inline __m128i BlockSums(__m128i _top, __m128i _bottom)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(_top, zero), _mm_unpacklo_epi8(_bottom, zero));
+	__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(_top, zero), _mm_unpackhi_epi8(_bottom, zero));
+	lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+	hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+	return _mm_unpacklo_epi64(lo, hi);
+}
+
+// 8 chroma samples from the block sums of 16 pixels.
+static inline __m128i Chroma(const __m128i* _pBlocks, __m128i _coefficients, __m128i _round)
+{
+	__m128i first = PairSums(_mm_madd_epi16(_pBlocks[0], _coefficients), _mm_madd_epi16(_pBlocks[1], _coefficients));
+	__m128i second = PairSums(_mm_madd_epi16(_pBlocks[2], _coefficients), _mm_madd_epi16(_pBlocks[3], _coefficients));
+	first = _mm_srai_epi32(_mm_add_epi32(first, _round), 10);
+	second = _mm_srai_epi32(_mm_add_epi32(second, _round), 10);
+	__m128i words = _mm_packs_epi32(first, second);
+	return _mm_packus_epi16(words, words);
+}
+
+///<summary>
+/// BgraRowsToYuvSse2
+/// 16 pixels of two rows at a time. Returns the number of pixels done.
+///</summary>
+static int BgraRowsToYuvSse2(const uint8_t* _pTop, const uint8_t* _pBottom, uint8_t* _pYTop, uint8_t* _pYBottom, uint8_t* _pU, uint8_t* _pV, int _iWidth, const RgbCoefficients& _c)
+{
+	const __m128i cy = _mm_set_epi16(0, (short)_c.iYR, (short)_c.iYG, (short)_c.iYB, 0, (short)_c.iYR, (short)_c.iYG, (short)_c.iYB);
+	const __m128i cu = _mm_set_epi16(0, (short)_c.iUR, (short)_c.iUG, (short)_c.iUB, 0, (short)_c.iUR, (short)_c.iUG, (short)_c.iUB);
+	const __m128i cv = _mm_set_epi16(0, (short)_c.iVR, (short)_c.iVG, (short)_c.iVB, 0, (short)_c.iVR, (short)_c.iVG, (short)_c.iVB);
+	const __m128i lumaRound = _mm_set1_epi32(128 + (_c.iYOffset << 8));
+	const __m128i chromaRound = _mm_set1_epi32(512 + (128 << 10));
+
+	int x = 0;
+	for(;x + 16 <= _iWidth;x += 16)
+	{
+		__m128i top[4];
+		__m128i bottom[4];
+		__m128i blocks[4];
+		for(int i=0;i<4;i++)
+		{
+			top[i] = _mm_loadu_si128((const __m128i*)(_pTop + (x + 4 * i) * 4));
+			bottom[i] = _mm_loadu_si128((const __m128i*)(_pBottom + (x + 4 * i) * 4));
+			blocks[i] = BlockSums(top[i], bottom[i]);
+		}
+
+		__m128i luma = _mm_packus_epi16(
+			_mm_packs_epi32(LumaOf4(top[0], cy, lumaRound), LumaOf4(top[1], cy, lumaRound)),
+			_mm_packs_epi32(LumaOf4(top[2], cy, lumaRound), LumaOf4(top[3], cy, lumaRound)));
+		_mm_storeu_si128((__m128i*)(_pYTop + x), luma);
+
+		if(_pYBottom != nullptr)
+		{
+			luma = _mm_packus_epi16(
+				_mm_packs_epi32(LumaOf4(bottom[0], cy, lumaRound), LumaOf4(bottom[1], cy, lumaRound)),
+				_mm_packs_epi32(LumaOf4(bottom[2], cy, lumaRound), LumaOf4(bottom[3], cy, lumaRound)));
+			_mm_storeu_si128((__m128i*)(_pYBottom + x), luma);
+		}
+
+		_mm_storel_epi64((__m128i*)(_pU + x / 2), Chroma(blocks, cu, chromaRound));
+		_mm_storel_epi64((__m128i*)(_pV + x / 2), Chroma(blocks, cv, chromaRound));
+	}
+
+	return x;
+}
+
+///<summary>
+/// YuvToBgraKernel
+/// 4:2:0 planar or interleaved chroma to BGRA, same size.
+///</summary>
+class YuvToBgraKernel : public RowKernel
+{
+public:
+	const uint8_t* pPlanes[3];
+	int iStrides[3];
+	bool bInterleaved;
+	const YuvCoefficients* pCoefficients;
+	bool bSse2;
+	int iWidth;
+	uint8_t* pOutput;
+	int iOutputStride;
+
+	virtual void Process(int _iFirstRow, int _iRows)
+	{
+		int iChromaStep = bInterleaved ? 2 : 1;
+
+		for(int iRow=_iFirstRow;iRow<_iFirstRow + _iRows;iRow++)
+		{
+			const uint8_t* pY = pPlanes[0] + iRow * iStrides[0];
+			const uint8_t* pU = pPlanes[1] + (iRow >> 1) * iStrides[1];
+			const uint8_t* pV = bInterleaved ? pU + 1 : pPlanes[2] + (iRow >> 1) * iStrides[2];
+			uint8_t* pRow = pOutput + iRow * iOutputStride;
+
+			int iDone = bSse2 ? YuvRowToBgraSse2(pY, pU, pV, iChromaStep, pRow, iWidth, *pCoefficients) : 0;
+			YuvRowToBgra(pY, pU, pV, iChromaStep, pRow, iDone, iWidth, *pCoefficients);
+		}
+	}
+};
+
+///<summary>
+/// BgrToYuvKernel
+/// BGRA or BGR24 to 4:2:0 planar, same size. Rows are taken two by two.
+///</summary>
+class BgrToYuvKernel : public RowKernel
+{
+public:
+	const uint8_t* pInput;
+	int iInputStride;
+	int iPixelSize;
+	const RgbCoefficients* pCoefficients;
+	bool bSse2;
+	int iWidth;
+	int iHeight;
+	uint8_t* pPlanes[3];
+	int iStrides[3];
+
+	virtual void Process(int _iFirstRow, int _iRows)
+	{
+		for(int iRow=_iFirstRow;iRow<_iFirstRow + _iRows;iRow += 2)
+		{
+			bool bPair = iRow + 1 < iHeight;
+			const uint8_t* pTop = pInput + iRow * iInputStride;
+			const uint8_t* pBottom = bPair ? pTop + iInputStride : pTop;
+			uint8_t* pYTop = pPlanes[0] + iRow * iStrides[0];
+			uint8_t* pYBottom = bPair ? pYTop + iStrides[0] : nullptr;
+			uint8_t* pU = pPlanes[1] + (iRow >> 1) * iStrides[1];
+			uint8_t* pV = pPlanes[2] + (iRow >> 1) * iStrides[2];
+
+			int iDone = (bSse2 && iPixelSize == 4) ? BgraRowsToYuvSse2(pTop, pBottom, pYTop, pYBottom, pU, pV, iWidth, *pCoefficients) : 0;
+			BgrRowsToYuv(pTop, pBottom, iPixelSize, pYTop, pYBottom, pU, pV, iDone, iWidth, *pCoefficients);
+		}
+	}
+};
+
+}
+}
+
+#pragma managed(pop)
+
+namespace Kinovea
+{
+namespace VideoFiles
+{
+
+bool ColorConversion::Sse2::get()
+{
+	if(m_iSse2 < 0)
+	{
+		m_iSse2 = DetectSse2() ? 1 : 0;
+	}
+	return m_iSse2 == 1;
+}
+
+///<summary>
+/// ColorConversion::CanConvertToBgra
+/// Whether ToBgra handles this input. The size must not change either.
+///</summary>
+bool ColorConversion::CanConvertToBgra(PixelFormat _inputFormat, PixelFormat _outputFormat)
+{
+	if(!m_bEnabled || _outputFormat != PIX_FMT_BGRA)
+		return false;
+
+	return _inputFormat == PIX_FMT_YUV420P || _inputFormat == PIX_FMT_YUVJ420P || _inputFormat == PIX_FMT_NV12;
+}
+
+///<summary>
+/// ColorConversion::ToBgra
+/// Convert a decoded picture straight into the output surface, in bands for large images.
+///</summary>
+void ColorConversion::ToBgra(uint8_t** _pPlanes, int* _pStrides, PixelFormat _inputFormat, int _iWidth, int _iHeight, uint8_t* _pOutput, int _iOutputStride)
+{
+	YuvToBgraKernel kernel;
+	kernel.bInterleaved = (_inputFormat == PIX_FMT_NV12);
+	kernel.pCoefficients = (_inputFormat == PIX_FMT_YUVJ420P) ? &FullRange : &VideoRange;
+	kernel.bSse2 = Sse2;
+	kernel.iWidth = _iWidth;
+	kernel.pOutput = _pOutput;
+	kernel.iOutputStride = _iOutputStride;
+	for(int i=0;i<3;i++)
+	{
+		kernel.pPlanes[i] = _pPlanes[i];
+		kernel.iStrides[i] = _pStrides[i];
+	}
+
+	ParallelRows::Run(&kernel, _iHeight, ParallelRows::BandCount(_iWidth, _iHeight));
+}
+
+///<summary>
+/// ColorConversion::CanConvertToYuv420p
+/// Whether ToYuv420p handles this input. The size must not change either.
+///</summary>
+bool ColorConversion::CanConvertToYuv420p(PixelFormat _inputFormat, PixelFormat _outputFormat)
+{
+	if(!m_bEnabled || (_outputFormat != PIX_FMT_YUV420P && _outputFormat != PIX_FMT_YUVJ420P))
+		return false;
+
+	return _inputFormat == PIX_FMT_BGRA || _inputFormat == PIX_FMT_BGR24;
+}
+
+///<summary>
+/// ColorConversion::ToYuv420p
+/// Convert a packed image into the planes of a picture to encode, in bands for large images.
+///</summary>
+void ColorConversion::ToYuv420p(uint8_t* _pInput, int _iInputStride, PixelFormat _inputFormat, int _iWidth, int _iHeight, uint8_t** _pPlanes, int* _pStrides, PixelFormat _outputFormat)
+{
+	BgrToYuvKernel kernel;
+	kernel.pInput = _pInput;
+	kernel.iInputStride = _iInputStride;
+	kernel.iPixelSize = (_inputFormat == PIX_FMT_BGRA) ? 4 : 3;
+	kernel.pCoefficients = (_outputFormat == PIX_FMT_YUVJ420P) ? &FullRangeRgb : &VideoRangeRgb;
+	kernel.bSse2 = Sse2;
+	kernel.iWidth = _iWidth;
+	kernel.iHeight = _iHeight;
+	for(int i=0;i<3;i++)
+	{
+		kernel.pPlanes[i] = _pPlanes[i];
+		kernel.iStrides[i] = _pStrides[i];
+	}
+
+	ParallelRows::Run(&kernel, _iHeight, ParallelRows::BandCount(_iWidth, _iHeight));
+}
+
+}
+}
@@ -0,0 +1,81 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+//-----------------------------------------------------------------------------
+// ColorConversion - Pixel format conversions of the most common cases,
+// without going through swscale.
+// Decoded YUV 4:2:0 to BGRA for display, BGRA/BGR24 to YUV 4:2:0 for encoding.
+//
+// Only same size conversions are handled, anything else must use swscale.
+// The kernels are native code, with an SSE2 version selected at runtime
+// and a plain C version for older processors and for the end of rows.
+// Large images are converted in parallel bands (see ParallelRows).
+//
+// Colors follow swscale defaults: ITU-R BT.601, video range unless the format is full range (YUVJ).
+// Chroma subsampling averages each 2x2 block, in the same pass as the luma.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+using namespace System;
+
+extern "C"
+{
+#define __STDC_CONSTANT_MACROS
+#define __STDC_LIMIT_MACROS
+#include <avcodec.h>
+}
+
+#include "ParallelRows.h"
+
+namespace Kinovea
+{
+	namespace VideoFiles
+	{
+		public ref class ColorConversion abstract sealed
+		{
+		public:
+			/// <summary>
+			/// False to send every conversion through swscale, for comparison.
+			/// </summary>
+			static property bool Enabled
+			{
+				bool get(){ return m_bEnabled;}
+				void set(bool _bEnabled){ m_bEnabled = _bEnabled;}
+			}
+			/// <summary>
+			/// Whether the processor supports the SSE2 kernels.
+			/// </summary>
+			static property bool Sse2
+			{
+				bool get();
+			}
+
+		internal:
+			static bool CanConvertToBgra(PixelFormat _inputFormat, PixelFormat _outputFormat);
+			static void ToBgra(uint8_t** _pPlanes, int* _pStrides, PixelFormat _inputFormat, int _iWidth, int _iHeight, uint8_t* _pOutput, int _iOutputStride);
+			static bool CanConvertToYuv420p(PixelFormat _inputFormat, PixelFormat _outputFormat);
+			static void ToYuv420p(uint8_t* _pInput, int _iInputStride, PixelFormat _inputFormat, int _iWidth, int _iHeight, uint8_t** _pPlanes, int* _pStrides, PixelFormat _outputFormat);
+
+		private:
+			static bool m_bEnabled = true;
+			static int m_iSse2 = -1;				// Not detected yet.
+		};
+	}
+}
@@ -0,0 +1,200 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+#include "Deinterlacer.h"
+#include "ColorConversion.h"
+
+namespace Kinovea
+{
+namespace VideoFiles
+{
+
+Deinterlacer::Deinterlacer()
+{
+	m_pPicture = nullptr;
+	m_pBuffer = nullptr;
+	m_pPostprocContext = nullptr;
+	m_pPostprocMode = nullptr;
+	m_PixelFormat = PIX_FMT_NONE;
+	m_iWidth = 0;
+	m_iHeight = 0;
+	m_Mode = DeinterlaceMode::Fast;
+	m_iBytes = 0;
+}
+Deinterlacer::~Deinterlacer()
+{
+	this->!Deinterlacer();
+}
+Deinterlacer::!Deinterlacer()
+{
+	Release();
+}
+
+///<summary>
+/// Deinterlacer::Deinterlace
+/// Deinterlace a decoded picture into the kept buffer.
+/// Returns the deinterlaced picture, or nullptr if the format is not supported.
+///</summary>
+AVPicture* Deinterlacer::Deinterlace(AVPicture* _pInput, PixelFormat _pixelFormat, int _iWidth, int _iHeight, DeinterlaceMode _mode)
+{
+	if(!Setup(_pixelFormat, _iWidth, _iHeight, _mode))
+		return nullptr;
+
+	if(m_pPostprocContext != nullptr)
+	{
+		pp_postprocess((const uint8_t**)_pInput->data, _pInput->linesize, m_pPicture->data, m_pPicture->linesize,
+			_iWidth, _iHeight, NULL, 0, m_pPostprocMode, m_pPostprocContext, 0);
+	}
+	else if(avpicture_deinterlace(m_pPicture, _pInput, _pixelFormat, _iWidth, _iHeight) < 0)
+	{
+		return nullptr;
+	}
+
+	return m_pPicture;
+}
+
+///<summary>
+/// Deinterlacer::Release
+/// Free the buffer and contexts. The next call to Deinterlace builds them again.
+///</summary>
+void Deinterlacer::Release()
+{
+	if(m_pPostprocMode != nullptr)
+	{
+		pp_free_mode(m_pPostprocMode);
+		m_pPostprocMode = nullptr;
+	}
+
+	if(m_pPostprocContext != nullptr)
+	{
+		pp_free_context(m_pPostprocContext);
+		m_pPostprocContext = nullptr;
+	}
+
+	if(m_pBuffer != nullptr)
+	{
+		av_free(m_pBuffer);
+		m_pBuffer = nullptr;
+	}
+
+	if(m_pPicture != nullptr)
+	{
+		delete m_pPicture;
+		m_pPicture = nullptr;
+	}
+
+	m_PixelFormat = PIX_FMT_NONE;
+	Interlocked::Exchange(m_iBytes, 0);
+}
+
+///<summary>
+/// Deinterlacer::Setup
+/// Make sure the buffer and the contexts match the picture. Only does something on changes.
+///</summary>
+bool Deinterlacer::Setup(PixelFormat _pixelFormat, int _iWidth, int _iHeight, DeinterlaceMode _mode)
+{
+	if(m_pPicture != nullptr && _pixelFormat == m_PixelFormat && _iWidth == m_iWidth && _iHeight == m_iHeight && _mode == m_Mode)
+		return true;
+
+	Release();
+
+	bool bSuccess = false;
+	do
+	{
+		int iSize = avpicture_get_size(_pixelFormat, _iWidth, _iHeight);
+		if(iSize <= 0 || (m_pBuffer = (uint8_t*)av_malloc(iSize)) == nullptr)
+		{
+			log->Error("Deinterlacing buffer not allocated.");
+			break;
+		}
+
+		m_pPicture = new AVPicture();
+		avpicture_fill(m_pPicture, m_pBuffer, _pixelFormat, _iWidth, _iHeight);
+
+		int iPostprocFormat = GetPostprocFormat(_pixelFormat);
+		if(_mode == DeinterlaceMode::Quality && iPostprocFormat != 0)
+		{
+			// The MMX2 code is used when available, any processor with SSE2 has it.
+			int iFlags = iPostprocFormat;
+			if(ColorConversion::Sse2)
+			{
+				iFlags |= PP_CPU_CAPS_MMX | PP_CPU_CAPS_MMX2;
+			}
+
+			m_pPostprocContext = pp_get_context(_iWidth, _iHeight, iFlags);
+			m_pPostprocMode = pp_get_mode_by_name_and_quality("ci", PP_QUALITY_MAX);
+			if(m_pPostprocContext == nullptr || m_pPostprocMode == nullptr)
+			{
+				log->Error("Postprocessing deinterlacer not created, using the fast one.");
+				if(m_pPostprocMode != nullptr)
+				{
+					pp_free_mode(m_pPostprocMode);
+					m_pPostprocMode = nullptr;
+				}
+				if(m_pPostprocContext != nullptr)
+				{
+					pp_free_context(m_pPostprocContext);
+					m_pPostprocContext = nullptr;
+				}
+			}
+		}
+		else if(_mode == DeinterlaceMode::Quality)
+		{
+			log->Debug("Pixel format not supported by the postprocessing deinterlacer, using the fast one.");
+		}
+
+		m_PixelFormat = _pixelFormat;
+		m_iWidth = _iWidth;
+		m_iHeight = _iHeight;
+		m_Mode = _mode;
+		Interlocked::Exchange(m_iBytes, (int64_t)iSize);
+		bSuccess = true;
+	}
+	while(false);
+
+	if(!bSuccess)
+	{
+		Release();
+	}
+
+	return bSuccess;
+}
+
+int Deinterlacer::GetPostprocFormat(PixelFormat _pixelFormat)
+{
+	switch(_pixelFormat)
+	{
+		case PIX_FMT_YUV420P:
+		case PIX_FMT_YUVJ420P:
+			return PP_FORMAT_420;
+		case PIX_FMT_YUV422P:
+		case PIX_FMT_YUVJ422P:
+			return PP_FORMAT_422;
+		case PIX_FMT_YUV444P:
+		case PIX_FMT_YUVJ444P:
+			return PP_FORMAT_444;
+		case PIX_FMT_YUV411P:
+			return PP_FORMAT_411;
+		default:
+			return 0;
+	}
+}
+
+}
+}
@@ -0,0 +1,96 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+//-----------------------------------------------------------------------------
+// Deinterlacer - Deinterlace decoded frames into a buffer kept between frames.
+//
+// The buffer and the postprocessing context are built on the first frame
+// and rebuilt only when the geometry, pixel format or mode changes.
+// The output picture is only valid until the next call, it is meant to be fed
+// directly to the conversion to the output format.
+//
+// An instance must not be used from two threads at the same time,
+// each export chunk has its own.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+using namespace System;
+using namespace System::Reflection;
+using namespace System::Threading;
+
+extern "C"
+{
+#define __STDC_CONSTANT_MACROS
+#define __STDC_LIMIT_MACROS
+#include <avcodec.h>
+#include <postprocess.h>
+}
+
+namespace Kinovea
+{
+	namespace VideoFiles
+	{
+		public enum class DeinterlaceMode
+		{
+			Fast,				// Lowpass filter of libavcodec (avpicture_deinterlace).
+			Quality				// Cubic interpolation deinterlacer of libpostproc.
+		};
+
+		public ref class Deinterlacer
+		{
+		public:
+			Deinterlacer();
+			~Deinterlacer();
+		protected:
+			!Deinterlacer();
+
+		public:
+			/// <summary>
+			/// Bytes held between frames.
+			/// </summary>
+			property int64_t Bytes
+			{
+				int64_t get(){ return Interlocked::Read(m_iBytes);}
+			}
+
+		internal:
+			AVPicture* Deinterlace(AVPicture* _pInput, PixelFormat _pixelFormat, int _iWidth, int _iHeight, DeinterlaceMode _mode);
+			void Release();
+
+		private:
+			bool Setup(PixelFormat _pixelFormat, int _iWidth, int _iHeight, DeinterlaceMode _mode);
+			static int GetPostprocFormat(PixelFormat _pixelFormat);
+
+		private:
+			static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+
+			AVPicture* m_pPicture;
+			uint8_t* m_pBuffer;
+			pp_context* m_pPostprocContext;
+			pp_mode* m_pPostprocMode;
+
+			PixelFormat m_PixelFormat;
+			int m_iWidth;
+			int m_iHeight;
+			DeinterlaceMode m_Mode;
+			int64_t m_iBytes;
+		};
+	}
+}
@@ -0,0 +1,163 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+#pragma once
+
+using namespace System;
+using namespace System::Reflection;
+
+extern "C"
+{
+#define __STDC_CONSTANT_MACROS
+#define __STDC_LIMIT_MACROS
+#include <avcodec.h>
+}
+
+namespace Kinovea
+{
+	namespace VideoFiles
+	{
+		public enum class RecordingProfile
+		{
+			IntraMpeg4,			// MPEG-4 ASP, every frame is a keyframe. Historical default, very large files.
+			LongGopMpeg4,		// MPEG-4 ASP with regular keyframes. Much smaller files, seeking decodes up to a GOP.
+			Mjpeg,				// Motion JPEG. Intra only, cheap to encode and to step through.
+			LosslessHuffyuv,	// HuffYUV. Lossless, intra only, very fast but large. (Not supported in MP4).
+			LosslessFfv1		// FFV1. Lossless, intra only, smaller than HuffYUV but slower. (Not supported in MP4).
+		};
+
+		public enum class RateControl
+		{
+			VariableBitrate,	// Target iBitrate, quantizer kept between iQMin and iQMax.
+			ConstantQuality,	// Fixed quantizer iQuality, bitrate follows the content.
+			None				// Lossless codecs.
+		};
+
+		/// <summary>
+		/// Encoding parameters of a recording or an export.
+		/// Use FromPreset to get a sensible starting point and adjust fields as needed before OpenSavingContext.
+		/// </summary>
+		public ref class EncodingProfile
+		{
+		public:
+
+			RecordingProfile eProfile;
+			String^	szEncoderName;		// libavcodec encoder name. (mpeg4, mjpeg, huffyuv, ffv1, ...)
+			int		iCodecTag;			// FourCC forced in the container, 0 for the codec default.
+			int		iGopSize;			// Frames between keyframes, 0 for intra only.
+
+			RateControl eRateControl;
+			int		iBitrate;			// bits/s. (VariableBitrate)
+			int		iQuality;			// Quantizer, 1 (best) to 31. (ConstantQuality)
+			int		iQMin;
+			int		iQMax;
+
+			int		iThreads;			// Encoder threads, 0 to let the writer decide.
+
+			/// <summary>
+			/// enum PixelFormat expected by the encoder. Values unknown to libavcodec are ignored.
+			/// </summary>
+			property int PixelFormat
+			{
+				int get(){ return m_iPixelFormat;}
+				void set(int _iPixelFormat)
+				{
+					if(avcodec_get_pix_fmt_name((enum ::PixelFormat)_iPixelFormat) == nullptr)
+					{
+						log->Error(String::Format("Unknown pixel format {0} ignored.", _iPixelFormat));
+						return;
+					}
+					m_iPixelFormat = _iPixelFormat;
+				}
+			}
+			/// <summary>
+			/// Maximum number of consecutive B-frames. Only 0 is accepted: 
+			/// the writer doesn't flush delayed frames at the end, and the player doesn't support B-frames.
+			/// </summary>
+			property int MaxBFrames
+			{
+				int get(){ return m_iMaxBFrames;}
+				void set(int _iMaxBFrames)
+				{
+					if(_iMaxBFrames != 0)
+					{
+						log->Error(String::Format("{0} B-frames refused, the writer only supports 0.", _iMaxBFrames));
+						return;
+					}
+					m_iMaxBFrames = _iMaxBFrames;
+				}
+			}
+
+			static EncodingProfile^ FromPreset(RecordingProfile _profile)
+			{
+				EncodingProfile^ profile = gcnew EncodingProfile();
+				profile->eProfile = _profile;
+				profile->iCodecTag = 0;
+				profile->PixelFormat = PIX_FMT_YUV420P;
+				profile->iGopSize = 0;
+				profile->MaxBFrames = 0;
+				profile->eRateControl = RateControl::None;
+				profile->iBitrate = 25000000;
+				profile->iQuality = 2;
+				profile->iQMin = 2;
+				profile->iQMax = 16;
+				profile->iThreads = 0;
+
+				switch(_profile)
+				{
+					case RecordingProfile::LongGopMpeg4:
+						profile->szEncoderName = "mpeg4";
+						profile->iCodecTag = ('D'<<24) + ('I'<<16) + ('V'<<8) + 'X';
+						profile->iGopSize = 50;
+						profile->eRateControl = RateControl::VariableBitrate;
+						profile->iBitrate = 8000000;
+						profile->iQMax = 31;
+						break;
+					case RecordingProfile::Mjpeg:
+						profile->szEncoderName = "mjpeg";
+						profile->PixelFormat = PIX_FMT_YUVJ420P;
+						profile->eRateControl = RateControl::ConstantQuality;
+						profile->iQuality = 3;
+						break;
+					case RecordingProfile::LosslessHuffyuv:
+						profile->szEncoderName = "huffyuv";
+						profile->PixelFormat = PIX_FMT_YUV422P;
+						break;
+					case RecordingProfile::LosslessFfv1:
+						profile->szEncoderName = "ffv1";
+						break;
+					case RecordingProfile::IntraMpeg4:
+					default:
+						// Same parameters as before profiles existed.
+						profile->szEncoderName = "mpeg4";
+						profile->iCodecTag = ('D'<<24) + ('I'<<16) + ('V'<<8) + 'X';
+						profile->eRateControl = RateControl::VariableBitrate;
+						break;
+				}
+
+				return profile;
+			}
+
+		private:
+			static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+			int m_iPixelFormat;
+			int m_iMaxBFrames;
+		};
+	}
+}
@@ -0,0 +1,78 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+#pragma once
+
+#include "VideoFile.h"
+#include "VideoFileWriter.h"
+
+namespace Kinovea
+{
+	namespace VideoFiles
+	{
+		/// <summary>
+		/// A keyframe aligned slice of the selection, exported on its own thread in parallel save.
+		/// Each chunk has its own demuxer, decoder and writer, and produces a temporary segment file.
+		/// This is a mixed type (contains unmannaged members).
+		/// </summary>
+		public ref class ExportChunk
+		{
+		public:
+
+			// Range, in input timestamps.
+			int64_t iStart;							// Keyframe where decoding starts.
+			int64_t iEnd;							// Keyframe of the next chunk. Frames from there on belong to it.
+			int64_t iSaveStart;						// First timestamp saved. (Selection start for the first chunk).
+			int64_t iSaveEnd;						// Last timestamp saved. (Selection end).
+
+			// Reading
+			AVFormatContext* pFormatContext;
+			AVCodecContext* pCodecContext;
+
+			// Conversion, owned by the chunk thread.
+			Deinterlacer^ deinterlacer;
+			BandScaler^ scaler;
+
+			// Writing
+			String^ szSegmentPath;
+			VideoFileWriter^ writer;
+			int iDuplicateFactor;
+			bool bFlushDrawings;
+			DelegateGetOutputBitmap^ delegateGetOutputBitmap;
+			DelegateHasDrawings^ delegateHasDrawings;
+			Object^ drawingLock;					// Shared by all the chunks, drawings are painted one image at a time.
+
+			// Control
+			Thread^ thread;
+			SaveResult result;
+			int iProgress;							// Timestamps done since iSaveStart.
+			bool bCancelled;						// Set by the coordinating thread.
+
+			ExportChunk::ExportChunk()
+			{
+				pFormatContext = nullptr;
+				pCodecContext = nullptr;
+				iDuplicateFactor = 1;
+				result = SaveResult::Success;
+				iProgress = 0;
+				bCancelled = false;
+			}
+		};
+	}
+}
@@ -62,6 +62,7 @@ namespace Kinovea
 				double	fDecodingStretchFactor;			// Used to set the output size of image.
 				int		iDecodingFlag;					// Quality of scaling during format conversion.
 				bool	bDeinterlaced;					// If frames should be deinterlaced, this is the setting as set by the user.
+				DeinterlaceMode eDeinterlaceMode;		// Filter used when deinterlacing.
 		};
 		
 		// Other helper classes.
@@ -71,6 +72,7 @@ namespace Kinovea
 			public:
 				AspectRatio eAspectRatio;				// Image format the user forces (auto, 4:3, 16:9).
 				bool		bDeinterlace;				// If frames should be deinterlaced.
+				DeinterlaceMode eDeinterlaceMode;		// Filter used when deinterlacing.
 		};
 		public ref class InfosThumbnail
 		{
@@ -106,5 +108,90 @@ namespace Kinovea
 				Bitmap^	BmpImage;
 				IntPtr	Hbmp;
 		};
+		/// <summary>
+		/// Time spent in each stage of the reading path, and seek counters.
+		/// Times are accumulated in Stopwatch ticks and read in milliseconds.
+		/// Conversions also count the frames decoded by exports.
+		/// </summary>
+		public ref class DecodingStats
+		{
+			public:
+				int64_t iPackets;						// Packets read from the file, all streams.
+				int64_t iFramesDecoded;
+				int64_t iFramesDiscarded;				// Decoded to reach a target but never shown.
+				int64_t iFramesConverted;
+				int64_t iSeeks;
+				int64_t iReseeks;						// Seeks that landed after the target and had to go further back.
+				int64_t iDemuxTicks;
+				int64_t iDecodeTicks;
+				int64_t iDeinterlaceTicks;
+				int64_t iScaleTicks;
+				int64_t iWrapTicks;						// Import of the converted buffer into a Bitmap.
+
+				property double DemuxTime
+				{
+					double get(){ return iDemuxTicks * 1000.0 / Stopwatch::Frequency;}
+				}
+				property double DecodeTime
+				{
+					double get(){ return iDecodeTicks * 1000.0 / Stopwatch::Frequency;}
+				}
+				property double DeinterlaceTime
+				{
+					double get(){ return iDeinterlaceTicks * 1000.0 / Stopwatch::Frequency;}
+				}
+				property double ScaleTime
+				{
+					double get(){ return iScaleTicks * 1000.0 / Stopwatch::Frequency;}
+				}
+				property double WrapTime
+				{
+					double get(){ return iWrapTicks * 1000.0 / Stopwatch::Frequency;}
+				}
+
+				DecodingStats^ Snapshot()
+				{
+					DecodingStats^ snapshot = gcnew DecodingStats();
+					snapshot->iPackets = Interlocked::Read(iPackets);
+					snapshot->iFramesDecoded = Interlocked::Read(iFramesDecoded);
+					snapshot->iFramesDiscarded = Interlocked::Read(iFramesDiscarded);
+					snapshot->iFramesConverted = Interlocked::Read(iFramesConverted);
+					snapshot->iSeeks = Interlocked::Read(iSeeks);
+					snapshot->iReseeks = Interlocked::Read(iReseeks);
+					snapshot->iDemuxTicks = Interlocked::Read(iDemuxTicks);
+					snapshot->iDecodeTicks = Interlocked::Read(iDecodeTicks);
+					snapshot->iDeinterlaceTicks = Interlocked::Read(iDeinterlaceTicks);
+					snapshot->iScaleTicks = Interlocked::Read(iScaleTicks);
+					snapshot->iWrapTicks = Interlocked::Read(iWrapTicks);
+					return snapshot;
+				}
+		};
+		/// <summary>
+		/// Bytes held by one VideoFile, or by every open instance when summed.
+		/// Decoder bytes are estimated from the pictures the codec keeps for reference.
+		/// </summary>
+		public ref class MemoryUsage
+		{
+			public:
+				int iInstances;
+				int64_t iFrameListBytes;				// Images extracted to memory.
+				int64_t iImageBufferBytes;				// Converted image of the current frame.
+				int64_t iDecoderBytes;
+				int64_t iWorkingBytes;					// Transient buffers, like those of a thumbnail extraction, and the deinterlacing and scaling buffers.
+
+				property int64_t TotalBytes
+				{
+					int64_t get(){ return iFrameListBytes + iImageBufferBytes + iDecoderBytes + iWorkingBytes;}
+				}
+
+				void Add(MemoryUsage^ _usage)
+				{
+					iInstances += _usage->iInstances;
+					iFrameListBytes += _usage->iFrameListBytes;
+					iImageBufferBytes += _usage->iImageBufferBytes;
+					iDecoderBytes += _usage->iDecoderBytes;
+					iWorkingBytes += _usage->iWorkingBytes;
+				}
+		};
 	}
 }
\ No newline at end of file
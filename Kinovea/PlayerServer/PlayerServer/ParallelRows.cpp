@@ -0,0 +1,144 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+#include "ParallelRows.h"
+
+namespace Kinovea
+{
+namespace VideoFiles
+{
+
+///<summary>
+/// ParallelRows::BandCount
+/// Number of bands to use for an image, 1 below the threshold.
+///</summary>
+int ParallelRows::BandCount(int _iWidth, int _iHeight)
+{
+	if((int64_t)_iWidth * _iHeight < m_iMinimumPixels)
+		return 1;
+
+	return m_iMaximumBands;
+}
+
+///<summary>
+/// ParallelRows::BandRows
+/// Height of the bands Run uses for these arguments, the last one may be shorter.
+///</summary>
+int ParallelRows::BandRows(int _iRows, int _iBands)
+{
+	int iBands = Math::Min(_iBands, _iRows / 2);
+	if(iBands <= 1)
+		return _iRows;
+
+	// Even band height.
+	return (((_iRows + iBands - 1) / iBands) + 1) & ~1;
+}
+
+///<summary>
+/// ParallelRows::Run
+/// Process rows [0, _iRows) in at most _iBands bands and wait for all of them.
+///</summary>
+void ParallelRows::Run(RowKernel* _pKernel, int _iRows, int _iBands)
+{
+	RunBands(_pKernel, _iRows, BandRows(_iRows, _iBands));
+}
+
+///<summary>
+/// ParallelRows::RunBands
+/// Process rows [0, _iRows) in bands of _iBandRows rows, the last one may be shorter, and wait for all of them.
+///</summary>
+void ParallelRows::RunBands(RowKernel* _pKernel, int _iRows, int _iBandRows)
+{
+	if(_iBandRows >= _iRows)
+	{
+		_pKernel->Process(0, _iRows);
+		return;
+	}
+
+	int iBands = (_iRows + _iBandRows - 1) / _iBandRows;
+
+	RowBandJob^ job = gcnew RowBandJob();
+	job->pKernel = _pKernel;
+	job->iPending = iBands - 1;
+
+	array<RowBand^>^ bands = gcnew array<RowBand^>(iBands);
+	for(int i=1;i<iBands;i++)
+	{
+		RowBand^ band = gcnew RowBand();
+		band->job = job;
+		band->iFirstRow = i * _iBandRows;
+		band->iRows = Math::Min(_iBandRows, _iRows - band->iFirstRow);
+		band->iClaimed = 0;
+		bands[i] = band;
+		ThreadPool::QueueUserWorkItem(gcnew WaitCallback(band, &RowBand::Work));
+	}
+
+	_pKernel->Process(0, _iBandRows);
+
+	// Don't wait for pool threads that may never come: do the bands still in the queue here.
+	for(int i=1;i<iBands;i++)
+	{
+		bands[i]->TryProcess();
+	}
+
+	Monitor::Enter(job);
+	try
+	{
+		while(job->iPending > 0)
+		{
+			Monitor::Wait(job);
+		}
+	}
+	finally
+	{
+		Monitor::Exit(job);
+	}
+}
+
+void RowBand::Work(Object^ _state)
+{
+	TryProcess();
+}
+
+///<summary>
+/// RowBand::TryProcess
+/// Process the band unless another thread already claimed it.
+///</summary>
+void RowBand::TryProcess()
+{
+	if(Interlocked::CompareExchange(iClaimed, 1, 0) != 0)
+		return;
+
+	try
+	{
+		job->pKernel->Process(iFirstRow, iRows);
+	}
+	finally
+	{
+		if(Interlocked::Decrement(job->iPending) == 0)
+		{
+			Monitor::Enter(job);
+			Monitor::PulseAll(job);
+			Monitor::Exit(job);
+		}
+	}
+}
+
+}
+}
@@ -0,0 +1,110 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+//-----------------------------------------------------------------------------
+// ParallelRows - Run a per-row image operation on horizontal bands, in parallel.
+//
+// The calling thread processes the first band while the thread pool takes the others.
+// It then takes the bands no pool thread has started yet, so it only waits for bands
+// that are actually running. A busy pool (parallel export) slows the call down
+// but can't block it.
+// Bands start on even rows, so 4:2:0 chroma rows are never shared between two bands.
+// Images smaller than the threshold stay on a single band,
+// handing them to other threads would cost more than it saves.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+using namespace System;
+using namespace System::Threading;
+
+#include <stdint.h>
+
+namespace Kinovea
+{
+	namespace VideoFiles
+	{
+		/// <summary>
+		/// Native operation on a range of rows. Must be safe to call concurrently on disjoint ranges.
+		/// </summary>
+		class RowKernel
+		{
+		public:
+			virtual ~RowKernel(){}
+			virtual void Process(int _iFirstRow, int _iRows) = 0;
+		};
+
+		public ref class ParallelRows abstract sealed
+		{
+		public:
+			/// <summary>
+			/// Images of at least this many pixels are split in bands. 1920x1080 by default.
+			/// </summary>
+			static property int MinimumPixels
+			{
+				int get(){ return m_iMinimumPixels;}
+				void set(int _iMinimumPixels){ m_iMinimumPixels = _iMinimumPixels;}
+			}
+			/// <summary>
+			/// Upper bound on the number of bands, the number of processors by default.
+			/// </summary>
+			static property int MaximumBands
+			{
+				int get(){ return m_iMaximumBands;}
+				void set(int _iMaximumBands){ m_iMaximumBands = Math::Max(1, _iMaximumBands);}
+			}
+
+			static int BandCount(int _iWidth, int _iHeight);
+			static int BandRows(int _iRows, int _iBands);
+
+		internal:
+			static void Run(RowKernel* _pKernel, int _iRows, int _iBands);
+			static void RunBands(RowKernel* _pKernel, int _iRows, int _iBandRows);
+
+		private:
+			static int m_iMinimumPixels = 1920 * 1080;
+			static int m_iMaximumBands = Environment::ProcessorCount;
+		};
+
+		/// <summary>
+		/// Bands of one Run call still in progress.
+		/// </summary>
+		ref class RowBandJob
+		{
+		public:
+			RowKernel* pKernel;
+			int iPending;
+		};
+
+		/// <summary>
+		/// One band handed to the thread pool. Processed by whichever thread claims it first.
+		/// </summary>
+		ref class RowBand
+		{
+		public:
+			RowBandJob^ job;
+			int iFirstRow;
+			int iRows;
+			int iClaimed;
+
+			void Work(Object^ _state);
+			void TryProcess();
+		};
+	}
+}
@@ -20,10 +20,67 @@ along with Kinovea. If not, see http://www.gnu.org/licenses/.
 
 #pragma once
 
+#include "AsyncFileOutput.h"
+#include "BandScaler.h"
+#include "EncodingProfile.h"
+
 namespace Kinovea
 {
 	namespace VideoFiles
 	{
+		/// <summary>
+		/// Time spent in each stage of the writer and volume produced, since OpenSavingContext.
+		/// Times are accumulated in Stopwatch ticks by the threads doing the work, use Snapshot to read them.
+		/// </summary>
+		public ref class EncodingStats
+		{
+		public:
+			int64_t iFrames;						// Frames given to the encoder.
+			int64_t iPackets;						// Packets given to the muxer.
+			int64_t iBytes;							// Compressed bytes given to the muxer.
+			int64_t iAllocations;					// Native buffers allocated for a single frame.
+			int64_t iConvertTicks;					// Pixel format conversion and scaling.
+			int64_t iEncodeTicks;
+			int64_t iWriteTicks;					// Muxing, and disk writes unless asynchronous.
+
+			property double ConvertTime
+			{
+				double get(){ return iConvertTicks * 1000.0 / Stopwatch::Frequency;}
+			}
+			property double EncodeTime
+			{
+				double get(){ return iEncodeTicks * 1000.0 / Stopwatch::Frequency;}
+			}
+			property double WriteTime
+			{
+				double get(){ return iWriteTicks * 1000.0 / Stopwatch::Frequency;}
+			}
+
+			EncodingStats^ Snapshot()
+			{
+				EncodingStats^ snapshot = gcnew EncodingStats();
+				snapshot->iFrames = Interlocked::Read(iFrames);
+				snapshot->iPackets = Interlocked::Read(iPackets);
+				snapshot->iBytes = Interlocked::Read(iBytes);
+				snapshot->iAllocations = Interlocked::Read(iAllocations);
+				snapshot->iConvertTicks = Interlocked::Read(iConvertTicks);
+				snapshot->iEncodeTicks = Interlocked::Read(iEncodeTicks);
+				snapshot->iWriteTicks = Interlocked::Read(iWriteTicks);
+				return snapshot;
+			}
+
+			void Add(EncodingStats^ _stats)
+			{
+				iFrames += _stats->iFrames;
+				iPackets += _stats->iPackets;
+				iBytes += _stats->iBytes;
+				iAllocations += _stats->iAllocations;
+				iConvertTicks += _stats->iConvertTicks;
+				iEncodeTicks += _stats->iEncodeTicks;
+				iWriteTicks += _stats->iWriteTicks;
+			}
+		};
+
 		/// <summary>
 		/// Encapsulate informations needed to save frames to file.
 		/// This is a mixed type (contains unmannaged members).
@@ -41,6 +98,7 @@ namespace Kinovea
 			AVStream* pOutputVideoStream;			// Ouput stream for frames.
 			AVStream* pOutputDataStream;			// Output stream for meta data.
 			AVFrame* pInputFrame;					// The current incoming frame.
+			BandScaler^ scaler;						// Conversion to the encoder format, when not pipelined.
 			
 			double fPixelAspectRatio;				// Used to adapt pixel aspect ratio.
 			bool bInputWasMpeg2;					
@@ -52,17 +110,166 @@ namespace Kinovea
 			double fFramesInterval;				
 			int iBitrate;				
 			Size outputSize;
+			EncodingProfile^ profile;				// Codec, GOP, rate control, quality and threads.
+
+			// Pipelining
+			bool bPipelined;						// Conversion, encoding and muxing run on their own threads.
+			int iEncoderThreads;					// Threads used by the encoder itself. (Profile value or writer default).
+			int iPipelineCapacity;					// Number of frames in flight between SaveFrame and the file.
+
+			// Asynchronous output
+			bool bAsyncWrite;						// Disk writes happen on their own thread.
+			int64_t iWriteBudget;					// Bytes in flight between the muxer and the disk.
+			bool bWriteError;						// A packet or a finished segment could not be written. Sticky, no more frames are accepted.
+			AsyncWriteStats^ writeStats;
+
+			// Statistics
+			EncodingStats^ stats;
+
+			// Streaming safe output
+			bool bStreamingSafe;					// Matroska, flushed regularly so the file is readable without its trailer.
+			int64_t iFlushInterval;					// Maximum length of recording kept in buffers, in microseconds.
+			int64_t iLastFlushTime;					// Position of the last flush in the current file, in microseconds.
+
+			// Stream copy
+			bool bRemux;							// Packets come already compressed from the input file, no encoder.
+			int64_t iRemuxStartTimestamp;			// Input timestamp mapped to 0 in the output.
+
+			// Smart rendering (stream copy, with the frames carrying drawings re-encoded)
+			AVCodecContext* pRenderCodecContext;	// Intra only encoder producing frames compatible with the copied ones.
+			int64_t iLastRenderPts;					// Last timestamp given to the render encoder, in its time base.
+			uint8_t* pStreamHeader;					// MPEG-4 configuration headers of the copied stream.
+			int iStreamHeaderSize;
+			bool bStreamHeaderNeeded;				// The previous packet came from the render encoder.
+
+			// Segmented recording
+			String^ szBasePath;						// Path given to OpenSavingContext, the next files are named after it.
+			int64_t iSegmentDuration;				// Length of a file in microseconds, 0 for no limit.
+			int64_t iSegmentSize;					// Size of a file in bytes, 0 for no limit.
+			int iSegmentIndex;						// Number of the file being written, 0 for the first one.
+			int64_t iSegmentStartPts;				// Stream timestamp mapped to 0 in the current file.
+			bool bRotationDue;						// A limit was reached, the next keyframe starts a new file.
+			int iKeyframeRequested;					// 1 to ask the encoder for a keyframe instead of waiting for the end of the GOP. (Interlocked).
+			AVCodecContext* pEncoderSnapshot;		// Copy of the encoder parameters taken once opened, the next files copy their stream from it.
+			String^ szMetadata;						// Written again at the start of each file.
+			AVFormatContext* pNextFormatContext;	// Muxer of the next file, opened ahead of time.
+			AVFormatContext* pRetiredFormatContext;	// Muxer of the previous file, waiting for its trailer.
+			bool bRebasePts;						// The next packet is mapped to 0 in the file.
+
+			// Pre-roll (triggered recording)
+			bool bPreRolling;						// Packets are kept in memory until Trigger opens the file.
+			int64_t iPreRollDuration;				// Minimum length kept in memory, in microseconds.
 
 			// Control
 			bool bEncoderOpened;
+			int64_t iLastPts;						// Last timestamp given to the encoder, in encoder time base.
+			int64_t iLastStreamPts;					// Last packet timestamp given to the muxer, in stream time base.
+			Dictionary<int64_t, int>^ heldFrames;	// Frames lasting more than one slot, by timestamp in encoder time base.
 
 			SavingContext::SavingContext()
 			{
+				scaler = gcnew BandScaler();
 				bInputWasMpeg2 = false;
 				fFramesInterval = 40;			// Default speed : 25 fps.
 				iBitrate = 25000000;			// Default bitrate : 25 Mb/s. (DV)
 				fPixelAspectRatio = 1.0;		// Default aspect : square pixels.
 				outputSize = Size(720, 576);
+				profile = EncodingProfile::FromPreset(RecordingProfile::IntraMpeg4);
+				bPipelined = false;
+				iEncoderThreads = 1;
+				iPipelineCapacity = 8;
+				bAsyncWrite = false;
+				iWriteBudget = 32 * 1024 * 1024;
+				bWriteError = false;
+				stats = gcnew EncodingStats();
+				bStreamingSafe = false;
+				iFlushInterval = 1000000;
+				iLastFlushTime = 0;
+				iLastPts = -1;
+				iLastStreamPts = -1;
+				heldFrames = gcnew Dictionary<int64_t, int>();
+				bRemux = false;
+				iRemuxStartTimestamp = AV_NOPTS_VALUE;
+				pRenderCodecContext = nullptr;
+				iLastRenderPts = -1;
+				pStreamHeader = nullptr;
+				iStreamHeaderSize = 0;
+				bStreamHeaderNeeded = false;
+				iSegmentDuration = 0;
+				iSegmentSize = 0;
+				iSegmentIndex = 0;
+				iSegmentStartPts = 0;
+				bRotationDue = false;
+				iKeyframeRequested = 0;
+				pEncoderSnapshot = nullptr;
+				szMetadata = nullptr;
+				pNextFormatContext = nullptr;
+				pRetiredFormatContext = nullptr;
+				bRebasePts = false;
+				bPreRolling = false;
+				iPreRollDuration = 0;
+			}
+		};
+
+		/// <summary>
+		/// A frame travelling through the encoding pipeline.
+		/// Buffers are allocated once and the object is recycled for the whole saving session.
+		/// This is a mixed type (contains unmannaged members).
+		/// </summary>
+		public ref class PipelineFrame
+		{
+		public:
+
+			// Stage 0 - Copy of the input pixels, at the input format and size.
+			// Planes are stored one after the other in the same buffer.
+			uint8_t* pSourceBuffer;
+			int iSourceBufferSize;
+			array<int>^ iSourceOffsets;				// Start of each plane in the buffer.
+			array<int>^ iSourceStrides;
+			int iSourceWidth;
+			int iSourceHeight;
+			int iSourceFormat;						// enum PixelFormat.
+			int64_t iTimestamp;						// Capture time in microseconds, negative if unknown.
+
+			// Stage 1 - Picture at the encoder format and size. pPicture->pts is set at stage 0.
+			AVFrame* pPicture;
+			uint8_t* pPictureBuffer;
+
+			// Stage 2 - Compressed data.
+			uint8_t* pPacketBuffer;
+			int iPacketBufferSize;
+			int iPacketSize;
+			int64_t iPts;
+			bool bKeyframe;
+
+			PipelineFrame::PipelineFrame()
+			{
+				iSourceOffsets = gcnew array<int>(4);
+				iSourceStrides = gcnew array<int>(4);
+			}
+		};
+
+		/// <summary>
+		/// A compressed frame kept in memory while waiting for a trigger.
+		/// The buffer is recycled when the packet leaves the pre-roll.
+		/// This is a mixed type (contains unmannaged members).
+		/// </summary>
+		public ref class PreRollPacket
+		{
+		public:
+			uint8_t* pBuffer;
+			int iBufferSize;
+			int iSize;
+			int64_t iPts;							// Encoder time base.
+			int64_t iTimestamp;						// Capture time in microseconds, negative if unknown.
+			int64_t iTime;							// Position in microseconds, used to bound the pre-roll.
+			bool bKeyframe;
+
+			PreRollPacket::PreRollPacket()
+			{
+				pBuffer = nullptr;
+				iBufferSize = 0;
+				iSize = 0;
 			}
 		};
 	}
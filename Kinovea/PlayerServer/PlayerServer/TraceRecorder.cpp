@@ -0,0 +1,214 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+#include "TraceRecorder.h"
+
+namespace Kinovea
+{
+namespace VideoFiles
+{
+
+///<summary>
+/// TraceRecorder::Start
+/// Allocate the ring and start recording. Events of a previous session are discarded.
+///</summary>
+void TraceRecorder::Start(int _iCapacity)
+{
+	Monitor::Enter(m_Locker);
+	try
+	{
+		m_Events = gcnew array<TraceEvent>(Math::Max(1, _iCapacity));
+		m_iNext = 0;
+		m_iCount = 0;
+		m_iOrigin = Stopwatch::GetTimestamp();
+		m_bEnabled = true;
+	}
+	finally
+	{
+		Monitor::Exit(m_Locker);
+	}
+
+	log->Debug(String::Format("Tracing started, {0} events.", _iCapacity));
+}
+
+///<summary>
+/// TraceRecorder::Stop
+/// Stop recording. The events are kept until the next Start or Clear.
+///</summary>
+void TraceRecorder::Stop()
+{
+	m_bEnabled = false;
+	log->Debug(String::Format("Tracing stopped, {0} events recorded.", m_iCount));
+}
+
+void TraceRecorder::Clear()
+{
+	Monitor::Enter(m_Locker);
+	try
+	{
+		m_iNext = 0;
+		m_iCount = 0;
+	}
+	finally
+	{
+		Monitor::Exit(m_Locker);
+	}
+}
+
+///<summary>
+/// TraceRecorder::Span
+/// Record a span from _iStart to now.
+///</summary>
+void TraceRecorder::Span(String^ _Name, String^ _Category, int64_t _iStart)
+{
+	if(!m_bEnabled)
+		return;
+
+	Record(_Name, _Category, false, _iStart, Stopwatch::GetTimestamp() - _iStart, nullptr, 0);
+}
+void TraceRecorder::Span(String^ _Name, String^ _Category, int64_t _iStart, String^ _Argument, int64_t _iValue)
+{
+	if(!m_bEnabled)
+		return;
+
+	Record(_Name, _Category, false, _iStart, Stopwatch::GetTimestamp() - _iStart, _Argument, _iValue);
+}
+
+///<summary>
+/// TraceRecorder::Counter
+/// Record the value of a counter at the current time, like a progress.
+///</summary>
+void TraceRecorder::Counter(String^ _Name, String^ _Argument, int64_t _iValue)
+{
+	if(!m_bEnabled)
+		return;
+
+	Record(_Name, "counter", true, Stopwatch::GetTimestamp(), 0, _Argument, _iValue);
+}
+
+///<summary>
+/// TraceRecorder::WriteChromeTrace
+/// Write the events in the ring, oldest first, as a JSON trace event file.
+///</summary>
+bool TraceRecorder::WriteChromeTrace(String^ _FilePath)
+{
+	bool bSuccess = true;
+	StreamWriter^ writer = nullptr;
+	int iProcess = Process::GetCurrentProcess()->Id;
+
+	Monitor::Enter(m_Locker);
+	try
+	{
+		writer = gcnew StreamWriter(_FilePath, false, gcnew UTF8Encoding(false));
+		writer->WriteLine("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+		if(m_Events != nullptr)
+		{
+			int iFirst = (m_iCount < m_Events->Length) ? 0 : m_iNext;
+			for(int i=0;i<m_iCount;i++)
+			{
+				TraceEvent e = m_Events[(iFirst + i) % m_Events->Length];
+				String^ szLine;
+
+				if(e.bCounter)
+				{
+					szLine = String::Format("{{\"name\":\"{0}\",\"ph\":\"C\",\"ts\":{1},\"pid\":{2},\"tid\":{3}",
+						Escape(e.szName), Microseconds(e.iStart - m_iOrigin), iProcess, e.iThread);
+				}
+				else
+				{
+					szLine = String::Format("{{\"name\":\"{0}\",\"cat\":\"{1}\",\"ph\":\"X\",\"ts\":{2},\"dur\":{3},\"pid\":{4},\"tid\":{5}",
+						Escape(e.szName), Escape(e.szCategory), Microseconds(e.iStart - m_iOrigin), Microseconds(e.iDuration), iProcess, e.iThread);
+				}
+
+				if(e.szArgument != nullptr)
+				{
+					szLine += String::Format(",\"args\":{{\"{0}\":{1}}}", Escape(e.szArgument), e.iArgument);
+				}
+
+				szLine += "}";
+				if(i < m_iCount - 1)
+				{
+					szLine += ",";
+				}
+
+				writer->WriteLine(szLine);
+			}
+		}
+
+		writer->WriteLine("]}");
+	}
+	catch(Exception^ exp)
+	{
+		log->Error("Trace not written: " + exp->Message);
+		bSuccess = false;
+	}
+	finally
+	{
+		Monitor::Exit(m_Locker);
+
+		if(writer != nullptr)
+		{
+			writer->Close();
+		}
+	}
+
+	return bSuccess;
+}
+
+void TraceRecorder::Record(String^ _Name, String^ _Category, bool _bCounter, int64_t _iStart, int64_t _iDuration, String^ _Argument, int64_t _iValue)
+{
+	Monitor::Enter(m_Locker);
+	try
+	{
+		if(m_Events != nullptr)
+		{
+			TraceEvent% e = m_Events[m_iNext];
+			e.szName = _Name;
+			e.szCategory = _Category;
+			e.bCounter = _bCounter;
+			e.iStart = _iStart;
+			e.iDuration = _iDuration;
+			e.iThread = Thread::CurrentThread->ManagedThreadId;
+			e.szArgument = _Argument;
+			e.iArgument = _iValue;
+
+			m_iNext = (m_iNext + 1) % m_Events->Length;
+			m_iCount = Math::Min(m_iCount + 1, m_Events->Length);
+		}
+	}
+	finally
+	{
+		Monitor::Exit(m_Locker);
+	}
+}
+String^ TraceRecorder::Escape(String^ _text)
+{
+	if(_text == nullptr)
+		return String::Empty;
+
+	return _text->Replace("\\", "\\\\")->Replace("\"", "\\\"");
+}
+String^ TraceRecorder::Microseconds(int64_t _iTicks)
+{
+	return ((double)_iTicks * 1000000.0 / Stopwatch::Frequency).ToString("0.###", CultureInfo::InvariantCulture);
+}
+
+}
+}
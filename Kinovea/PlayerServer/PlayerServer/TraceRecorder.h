@@ -0,0 +1,109 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+//-----------------------------------------------------------------------------
+// TraceRecorder - Opt-in timeline of the reading and writing paths.
+//
+// Spans (loading, frame reads, seeks, decoding, conversions, writer stages)
+// and counters (extraction progress) are kept in a fixed size ring,
+// the oldest events are overwritten.
+// The ring can be written in the Chrome trace event format and opened in chrome://tracing,
+// to be attached to a bug report.
+// When tracing is off, recording an event only tests a flag.
+// kinovea.exe -trace records from startup and writes "Trace - <date>.json" in the
+// Kinovea settings folder on exit, or on a crash.
+//
+// Usage:
+// TraceRecorder::Start(100000); ... TraceRecorder::WriteChromeTrace(path); TraceRecorder::Stop();
+//
+// Instrumented code takes Stopwatch::GetTimestamp() at the start of the span
+// and calls TraceRecorder::Span() at the end.
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+using namespace System;
+using namespace System::Diagnostics;
+using namespace System::Globalization;
+using namespace System::IO;
+using namespace System::Reflection;
+using namespace System::Text;
+using namespace System::Threading;
+
+#include <stdint.h>
+
+namespace Kinovea
+{
+	namespace VideoFiles
+	{
+		/// <summary>
+		/// One slot of the ring. Times are in Stopwatch ticks.
+		/// </summary>
+		public value struct TraceEvent
+		{
+			String^ szName;
+			String^ szCategory;
+			bool bCounter;							// Counter value instead of a span.
+			int64_t iStart;
+			int64_t iDuration;
+			int iThread;
+			String^ szArgument;						// Optional, null if none.
+			int64_t iArgument;
+		};
+
+		public ref class TraceRecorder abstract sealed
+		{
+		public:
+			static property bool Enabled
+			{
+				bool get(){ return m_bEnabled;}
+			}
+			/// <summary>
+			/// Number of events currently in the ring.
+			/// </summary>
+			static property int Count
+			{
+				int get(){ return m_iCount;}
+			}
+
+			static void Start(int _iCapacity);
+			static void Stop();
+			static void Clear();
+
+			static void Span(String^ _Name, String^ _Category, int64_t _iStart);
+			static void Span(String^ _Name, String^ _Category, int64_t _iStart, String^ _Argument, int64_t _iValue);
+			static void Counter(String^ _Name, String^ _Argument, int64_t _iValue);
+
+			static bool WriteChromeTrace(String^ _FilePath);
+
+		private:
+			static void Record(String^ _Name, String^ _Category, bool _bCounter, int64_t _iStart, int64_t _iDuration, String^ _Argument, int64_t _iValue);
+			static String^ Escape(String^ _text);
+			static String^ Microseconds(int64_t _iTicks);
+
+			static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+			static Object^ m_Locker = gcnew Object();
+			static array<TraceEvent>^ m_Events;
+			static int m_iNext;						// Slot of the next event.
+			static int m_iCount;
+			static bool m_bEnabled;
+			static int64_t m_iOrigin;				// Time of Start, the trace begins at 0.
+		};
+	}
+}
@@ -0,0 +1,910 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+#include "VideoBenchmark.h"
+
+// Bits of the frame number drawn at the top left of synthetic frames.
+#define FRAME_INDEX_BITS 16
+
+namespace Kinovea
+{
+namespace VideoFiles
+{
+
+VideoBenchmark::VideoBenchmark(String^ _WorkingDirectory)
+{
+	m_WorkingDirectory = _WorkingDirectory;
+	m_Clips = DefaultClips();
+	m_Results = gcnew List<BenchmarkResult^>();
+	m_Process = Process::GetCurrentProcess();
+	m_iPeakMemory = 0;
+}
+
+///<summary>
+/// VideoBenchmark::DefaultClips
+/// Intra and long GOP MPEG-4, MJPEG, HuffYUV and FFV1, at SD, 720p and 1080p. 4 seconds at 25 fps each.
+///</summary>
+List<BenchmarkClip^>^ VideoBenchmark::DefaultClips()
+{
+	List<BenchmarkClip^>^ clips = gcnew List<BenchmarkClip^>();
+
+	array<RecordingProfile>^ profiles = { RecordingProfile::IntraMpeg4, RecordingProfile::LongGopMpeg4, RecordingProfile::LongGopMpeg4, RecordingProfile::Mjpeg, 
+		RecordingProfile::LosslessHuffyuv, RecordingProfile::LosslessFfv1 };
+	array<int>^ gops = { -1, 12, 50, -1, -1, -1 };
+	array<String^>^ names = { "mpeg4-intra", "mpeg4-gop12", "mpeg4-gop50", "mjpeg", "huffyuv", "ffv1" };
+	array<Size>^ sizes = { Size(640, 480), Size(1280, 720), Size(1920, 1080) };
+
+	for(int i=0;i<profiles->Length;i++)
+	{
+		for(int j=0;j<sizes->Length;j++)
+		{
+			BenchmarkClip^ clip = gcnew BenchmarkClip();
+			clip->eProfile = profiles[i];
+			clip->iGopSize = gops[i];
+			clip->iWidth = sizes[j].Width;
+			clip->iHeight = sizes[j].Height;
+			clip->iFrames = 100;
+			clip->szName = String::Format("{0}-{1}x{2}", names[i], clip->iWidth, clip->iHeight);
+			clips->Add(clip);
+		}
+	}
+
+	return clips;
+}
+
+///<summary>
+/// VideoBenchmark::SeekClips
+/// One minute SD clips with increasingly long GOPs, so seeks have more and more frames to decode.
+///</summary>
+List<BenchmarkClip^>^ VideoBenchmark::SeekClips()
+{
+	List<BenchmarkClip^>^ clips = gcnew List<BenchmarkClip^>();
+
+	array<RecordingProfile>^ profiles = { RecordingProfile::IntraMpeg4, RecordingProfile::LongGopMpeg4, RecordingProfile::LongGopMpeg4, RecordingProfile::LongGopMpeg4, RecordingProfile::Mjpeg };
+	array<int>^ gops = { -1, 12, 50, 250, -1 };
+	array<String^>^ names = { "seek-mpeg4-intra", "seek-mpeg4-gop12", "seek-mpeg4-gop50", "seek-mpeg4-gop250", "seek-mjpeg" };
+
+	for(int i=0;i<profiles->Length;i++)
+	{
+		BenchmarkClip^ clip = gcnew BenchmarkClip();
+		clip->eProfile = profiles[i];
+		clip->iGopSize = gops[i];
+		clip->iWidth = 640;
+		clip->iHeight = 480;
+		clip->iFrames = 1500;
+		clip->szName = names[i];
+		clips->Add(clip);
+	}
+
+	return clips;
+}
+
+///<summary>
+/// VideoBenchmark::GenerateClips
+/// Encode every clip in the working directory. The content moves so inter frames are not empty.
+///</summary>
+bool VideoBenchmark::GenerateClips()
+{
+	bool bSuccess = true;
+
+	for each(BenchmarkClip^ clip in m_Clips)
+	{
+		clip->szFilePath = Path::Combine(m_WorkingDirectory, clip->szName + ".mkv");
+
+		EncodingProfile^ profile = EncodingProfile::FromPreset(clip->eProfile);
+		if(clip->iGopSize >= 0)
+		{
+			profile->iGopSize = clip->iGopSize;
+		}
+
+		InfosVideo^ infos = gcnew InfosVideo();
+		infos->iWidth = clip->iWidth;
+		infos->iHeight = clip->iHeight;
+
+		VideoFileWriter^ writer = gcnew VideoFileWriter();
+		SaveResult result = writer->OpenSavingContext(clip->szFilePath, infos, 40, false, profile);
+		if(result != SaveResult::Success)
+		{
+			log->Error(String::Format("Benchmark clip {0} not created: {1}", clip->szName, result));
+			writer->CloseSavingContext(false);
+			bSuccess = false;
+			continue;
+		}
+
+		int iStride = clip->iWidth * 4;
+		uint8_t* pBuffer = (uint8_t*)av_malloc(iStride * clip->iHeight);
+		array<IntPtr>^ planes = { IntPtr(pBuffer) };
+		array<int>^ strides = { iStride };
+
+		for(int i=0;i<clip->iFrames && result == SaveResult::Success;i++)
+		{
+			FillSyntheticFrame(pBuffer, iStride, clip->iWidth, clip->iHeight, i);
+			result = writer->SaveFrame(planes, strides, clip->iWidth, clip->iHeight, FramePixelFormat::Bgra32, -1);
+		}
+
+		av_free(pBuffer);
+		writer->CloseSavingContext(result == SaveResult::Success);
+
+		if(result != SaveResult::Success)
+		{
+			log->Error(String::Format("Benchmark clip {0} not encoded: {1}", clip->szName, result));
+			bSuccess = false;
+		}
+	}
+
+	return bSuccess;
+}
+
+///<summary>
+/// VideoBenchmark::RunDecode
+/// Time loading, sequential reading, random seeks, backward steps and extraction to memory on every clip.
+///</summary>
+void VideoBenchmark::RunDecode()
+{
+	for each(BenchmarkClip^ clip in m_Clips)
+	{
+		if(clip->szFilePath == nullptr || !File::Exists(clip->szFilePath))
+			continue;
+
+		log->Debug(String::Format("Decoding benchmark: {0}.", clip->szName));
+
+		MeasureLoad(clip);
+
+		VideoFile^ videoFile = gcnew VideoFile();
+		if(videoFile->Load(clip->szFilePath) != LoadResult::Success)
+		{
+			log->Error(String::Format("Benchmark clip {0} not loaded.", clip->szName));
+			continue;
+		}
+
+		MeasureSequential(videoFile, clip);
+		MeasureRandomSeek(videoFile, clip);
+		MeasureBackwardStep(videoFile, clip);
+
+		// Last: the file is in analysis mode afterwards.
+		MeasureExtraction(videoFile, clip);
+
+		videoFile->Unload();
+		delete videoFile;
+	}
+}
+
+///<summary>
+/// VideoBenchmark::RunEncode
+/// Push synthetic frames through the writer on every clip parameters, on a single thread and pipelined.
+///</summary>
+void VideoBenchmark::RunEncode()
+{
+	for each(BenchmarkClip^ clip in m_Clips)
+	{
+		log->Debug(String::Format("Encoding benchmark: {0}.", clip->szName));
+		MeasureEncode(clip, false);
+		MeasureEncode(clip, true);
+	}
+}
+
+///<summary>
+/// VideoBenchmark::RunExport
+/// Save every generated clip through VideoFile::Save, with drawings flushed so every frame is encoded again.
+///</summary>
+void VideoBenchmark::RunExport()
+{
+	for each(BenchmarkClip^ clip in m_Clips)
+	{
+		if(clip->szFilePath == nullptr || !File::Exists(clip->szFilePath))
+			continue;
+
+		log->Debug(String::Format("Export benchmark: {0}.", clip->szName));
+		MeasureExport(clip);
+	}
+}
+
+///<summary>
+/// VideoBenchmark::RunSeekAccuracy
+/// Seek to random targets on every clip and check the image returned against the reported position.
+/// Returns false if any frame was wrong.
+///</summary>
+bool VideoBenchmark::RunSeekAccuracy(int _iSeeks)
+{
+	bool bPassed = true;
+
+	for each(BenchmarkClip^ clip in m_Clips)
+	{
+		if(clip->szFilePath == nullptr || !File::Exists(clip->szFilePath))
+			continue;
+
+		log->Debug(String::Format("Seek accuracy: {0}.", clip->szName));
+
+		VideoFile^ videoFile = gcnew VideoFile();
+		if(videoFile->Load(clip->szFilePath) != LoadResult::Success)
+		{
+			log->Error(String::Format("Benchmark clip {0} not loaded.", clip->szName));
+			bPassed = false;
+			continue;
+		}
+
+		if(!MeasureSeekAccuracy(videoFile, clip, _iSeeks))
+		{
+			bPassed = false;
+		}
+
+		videoFile->Unload();
+		delete videoFile;
+	}
+
+	return bPassed;
+}
+
+///<summary>
+/// VideoBenchmark::WriteResults
+/// Write the results with the build and machine they come from.
+///</summary>
+void VideoBenchmark::WriteResults(String^ _FilePath)
+{
+	XmlTextWriter^ writer = gcnew XmlTextWriter(_FilePath, Encoding::UTF8);
+	writer->Formatting = System::Xml::Formatting::Indented;
+
+	try
+	{
+		writer->WriteStartDocument();
+		writer->WriteStartElement("Benchmark");
+		writer->WriteAttributeString("version", Assembly::GetExecutingAssembly()->GetName()->Version->ToString());
+		writer->WriteAttributeString("date", DateTime::Now.ToString("s"));
+		writer->WriteAttributeString("os", Environment::OSVersion->ToString());
+		writer->WriteAttributeString("processors", Environment::ProcessorCount.ToString());
+
+		for each(BenchmarkResult^ result in m_Results)
+		{
+			writer->WriteStartElement("Result");
+			writer->WriteAttributeString("clip", result->szClip);
+			writer->WriteAttributeString("operation", result->szOperation);
+			writer->WriteAttributeString("count", result->iCount.ToString());
+			writer->WriteAttributeString("fps", result->fFramesPerSecond.ToString("0.00", Globalization::CultureInfo::InvariantCulture));
+			writer->WriteAttributeString("p50", result->fMedianLatency.ToString("0.000", Globalization::CultureInfo::InvariantCulture));
+			writer->WriteAttributeString("p99", result->fP99Latency.ToString("0.000", Globalization::CultureInfo::InvariantCulture));
+			writer->WriteAttributeString("peakMemory", result->iPeakMemory.ToString());
+			writer->WriteAttributeString("collections", result->iCollections.ToString());
+			writer->WriteAttributeString("convert", result->fConvertTime.ToString("0.000", Globalization::CultureInfo::InvariantCulture));
+			writer->WriteAttributeString("encode", result->fEncodeTime.ToString("0.000", Globalization::CultureInfo::InvariantCulture));
+			writer->WriteAttributeString("write", result->fWriteTime.ToString("0.000", Globalization::CultureInfo::InvariantCulture));
+			writer->WriteAttributeString("bytesPerFrame", result->fBytesPerFrame.ToString("0", Globalization::CultureInfo::InvariantCulture));
+			writer->WriteAttributeString("allocationsPerFrame", result->fAllocationsPerFrame.ToString("0.00", Globalization::CultureInfo::InvariantCulture));
+			writer->WriteAttributeString("errors", result->iErrors.ToString());
+			writer->WriteAttributeString("missedTargets", result->iMissedTargets.ToString());
+			writer->WriteAttributeString("framesPerSeek", result->fFramesPerSeek.ToString("0.00", Globalization::CultureInfo::InvariantCulture));
+			writer->WriteAttributeString("maxFramesPerSeek", result->iMaxFramesPerSeek.ToString());
+			writer->WriteAttributeString("reseeks", result->iReseeks.ToString());
+			writer->WriteEndElement();
+		}
+
+		writer->WriteEndElement();
+		writer->WriteEndDocument();
+	}
+	finally
+	{
+		writer->Close();
+	}
+}
+
+///<summary>
+/// VideoBenchmark::DeleteClips
+/// Remove the generated files.
+///</summary>
+void VideoBenchmark::DeleteClips()
+{
+	for each(BenchmarkClip^ clip in m_Clips)
+	{
+		if(clip->szFilePath == nullptr)
+			continue;
+
+		try
+		{
+			File::Delete(clip->szFilePath);
+		}
+		catch(Exception^)
+		{
+			log->Error(String::Format("Benchmark clip not deleted: {0}", clip->szFilePath));
+		}
+	}
+}
+
+///<summary>
+/// VideoBenchmark::MeasureLoad
+/// Opening the file and probing the streams.
+///</summary>
+void VideoBenchmark::MeasureLoad(BenchmarkClip^ _clip)
+{
+	List<double>^ latencies = gcnew List<double>();
+	Stopwatch^ stopwatch = gcnew Stopwatch();
+	ResetMemory();
+
+	for(int i=0;i<5;i++)
+	{
+		VideoFile^ videoFile = gcnew VideoFile();
+
+		stopwatch->Reset();
+		stopwatch->Start();
+		LoadResult result = videoFile->Load(_clip->szFilePath);
+		stopwatch->Stop();
+		SampleMemory();
+
+		if(result == LoadResult::Success)
+		{
+			latencies->Add(stopwatch->Elapsed.TotalMilliseconds);
+			videoFile->Unload();
+		}
+
+		delete videoFile;
+	}
+
+	AddResult(_clip->szName, "Load", latencies, latencies->Count);
+}
+
+///<summary>
+/// VideoBenchmark::MeasureSequential
+/// Playback: decode every frame from the start with ReadFrame(-1, 1).
+///</summary>
+void VideoBenchmark::MeasureSequential(VideoFile^ _videoFile, BenchmarkClip^ _clip)
+{
+	List<double>^ latencies = gcnew List<double>();
+	Stopwatch^ stopwatch = gcnew Stopwatch();
+	ResetMemory();
+
+	_videoFile->ReadFrame(_videoFile->Infos->iFirstTimeStamp, 1);
+
+	for(int i=1;i<_clip->iFrames;i++)
+	{
+		stopwatch->Reset();
+		stopwatch->Start();
+		ReadResult result = _videoFile->ReadFrame(-1, 1);
+		stopwatch->Stop();
+		SampleMemory();
+
+		if(result != ReadResult::Success)
+			break;
+
+		latencies->Add(stopwatch->Elapsed.TotalMilliseconds);
+	}
+
+	AddResult(_clip->szName, "Sequential", latencies, latencies->Count);
+}
+
+///<summary>
+/// VideoBenchmark::MeasureRandomSeek
+/// Jumps to random positions with ReadFrame(ts, 0). The sequence is the same for every run.
+///</summary>
+void VideoBenchmark::MeasureRandomSeek(VideoFile^ _videoFile, BenchmarkClip^ _clip)
+{
+	List<double>^ latencies = gcnew List<double>();
+	Stopwatch^ stopwatch = gcnew Stopwatch();
+	Random^ random = gcnew Random(1234);
+	ResetMemory();
+
+	int64_t iFirst = _videoFile->Infos->iFirstTimeStamp;
+	int64_t iDuration = _videoFile->Infos->iDurationTimeStamps;
+
+	for(int i=0;i<50;i++)
+	{
+		int64_t iTarget = iFirst + (int64_t)(random->NextDouble() * iDuration);
+
+		stopwatch->Reset();
+		stopwatch->Start();
+		ReadResult result = _videoFile->ReadFrame(iTarget, 0);
+		stopwatch->Stop();
+		SampleMemory();
+
+		if(result == ReadResult::Success)
+		{
+			latencies->Add(stopwatch->Elapsed.TotalMilliseconds);
+		}
+	}
+
+	AddResult(_clip->szName, "RandomSeek", latencies, latencies->Count);
+}
+
+///<summary>
+/// VideoBenchmark::MeasureBackwardStep
+/// Stepping back one frame at a time from the end, the worst case for long GOPs.
+///</summary>
+void VideoBenchmark::MeasureBackwardStep(VideoFile^ _videoFile, BenchmarkClip^ _clip)
+{
+	List<double>^ latencies = gcnew List<double>();
+	Stopwatch^ stopwatch = gcnew Stopwatch();
+	ResetMemory();
+
+	int64_t iFirst = _videoFile->Infos->iFirstTimeStamp;
+	_videoFile->ReadFrame(iFirst + _videoFile->Infos->iDurationTimeStamps, 0);
+
+	for(int i=0;i<30;i++)
+	{
+		if(_videoFile->Selection->iCurrentTimeStamp <= iFirst)
+			break;
+
+		stopwatch->Reset();
+		stopwatch->Start();
+		ReadResult result = _videoFile->ReadFrame(-1, -1);
+		stopwatch->Stop();
+		SampleMemory();
+
+		if(result != ReadResult::Success)
+			break;
+
+		latencies->Add(stopwatch->Elapsed.TotalMilliseconds);
+	}
+
+	AddResult(_clip->szName, "BackwardStep", latencies, latencies->Count);
+}
+
+///<summary>
+/// VideoBenchmark::MeasureExtraction
+/// Switch to analysis mode: decode the whole clip to memory.
+///</summary>
+void VideoBenchmark::MeasureExtraction(VideoFile^ _videoFile, BenchmarkClip^ _clip)
+{
+	List<double>^ latencies = gcnew List<double>();
+	Stopwatch^ stopwatch = gcnew Stopwatch();
+	ResetMemory();
+
+	int64_t iFirst = _videoFile->Infos->iFirstTimeStamp;
+
+	stopwatch->Start();
+	_videoFile->ExtractToMemory(iFirst, iFirst + _videoFile->Infos->iDurationTimeStamps, true);
+	stopwatch->Stop();
+	SampleMemory();
+
+	latencies->Add(stopwatch->Elapsed.TotalMilliseconds);
+
+	// The single latency is for the whole clip, the rate is per frame.
+	AddResult(_clip->szName, "ExtractToMemory", latencies, _videoFile->FrameList->Count);
+}
+
+///<summary>
+/// VideoBenchmark::MeasureEncode
+/// Sustained rate of the writer, from the first frame to the file closed. 
+/// The frames are prepared beforehand so their generation is not counted.
+///</summary>
+void VideoBenchmark::MeasureEncode(BenchmarkClip^ _clip, bool _bPipelined)
+{
+	List<double>^ latencies = gcnew List<double>();
+	Stopwatch^ stopwatch = gcnew Stopwatch();
+	Stopwatch^ totalStopwatch = gcnew Stopwatch();
+	String^ filePath = Path::Combine(m_WorkingDirectory, _clip->szName + "-encode.mkv");
+
+	EncodingProfile^ profile = EncodingProfile::FromPreset(_clip->eProfile);
+	if(_clip->iGopSize >= 0)
+	{
+		profile->iGopSize = _clip->iGopSize;
+	}
+
+	InfosVideo^ infos = gcnew InfosVideo();
+	infos->iWidth = _clip->iWidth;
+	infos->iHeight = _clip->iHeight;
+
+	// A few different images, the encoder must not see the same one over and over.
+	const int iImages = 8;
+	int iStride = _clip->iWidth * 4;
+	array<IntPtr>^ buffers = gcnew array<IntPtr>(iImages);
+	for(int i=0;i<iImages;i++)
+	{
+		uint8_t* pBuffer = (uint8_t*)av_malloc(iStride * _clip->iHeight);
+		FillSyntheticFrame(pBuffer, iStride, _clip->iWidth, _clip->iHeight, i);
+		buffers[i] = IntPtr(pBuffer);
+	}
+
+	ResetMemory();
+
+	VideoFileWriter^ writer = gcnew VideoFileWriter();
+	writer->Pipelined = _bPipelined;
+	writer->EncoderThreads = _bPipelined ? Environment::ProcessorCount : 1;
+	writer->QueuePolicy = FullQueuePolicy::Wait;
+
+	SaveResult result = writer->OpenSavingContext(filePath, infos, 40, false, profile);
+	if(result == SaveResult::Success)
+	{
+		array<IntPtr>^ planes = gcnew array<IntPtr>(1);
+		array<int>^ strides = { iStride };
+
+		totalStopwatch->Start();
+		for(int i=0;i<_clip->iFrames && result == SaveResult::Success;i++)
+		{
+			planes[0] = buffers[i % iImages];
+
+			stopwatch->Reset();
+			stopwatch->Start();
+			result = writer->SaveFrame(planes, strides, _clip->iWidth, _clip->iHeight, FramePixelFormat::Bgra32, -1);
+			stopwatch->Stop();
+			SampleMemory();
+
+			latencies->Add(stopwatch->Elapsed.TotalMilliseconds);
+		}
+
+		// Flushing the pipeline and closing the file are part of the sustained rate.
+		writer->CloseSavingContext(result == SaveResult::Success);
+		totalStopwatch->Stop();
+	}
+	else
+	{
+		log->Error(String::Format("Encoding benchmark {0} not started: {1}", _clip->szName, result));
+		writer->CloseSavingContext(false);
+	}
+
+	for(int i=0;i<iImages;i++)
+	{
+		av_free(buffers[i].ToPointer());
+	}
+
+	if(result == SaveResult::Success)
+	{
+		BenchmarkResult^ benchmarkResult = AddResult(_clip->szName, _bPipelined ? "EncodePipelined" : "Encode", latencies, latencies->Count);
+		benchmarkResult->fFramesPerSecond = latencies->Count * 1000.0 / totalStopwatch->Elapsed.TotalMilliseconds;
+		SetWriterStats(benchmarkResult, writer->Stats);
+	}
+
+	try
+	{
+		File::Delete(filePath);
+	}
+	catch(Exception^)
+	{
+		log->Error(String::Format("Benchmark file not deleted: {0}", filePath));
+	}
+}
+
+///<summary>
+/// VideoBenchmark::MeasureExport
+/// The whole export path: decoding, copy of the image for drawings, conversion, encoding and writing.
+///</summary>
+void VideoBenchmark::MeasureExport(BenchmarkClip^ _clip)
+{
+	List<double>^ latencies = gcnew List<double>();
+	Stopwatch^ stopwatch = gcnew Stopwatch();
+	String^ filePath = Path::Combine(m_WorkingDirectory, _clip->szName + "-export.mkv");
+
+	VideoFile^ videoFile = gcnew VideoFile();
+	if(videoFile->Load(_clip->szFilePath) != LoadResult::Success)
+	{
+		log->Error(String::Format("Benchmark clip {0} not loaded.", _clip->szName));
+		return;
+	}
+
+	int64_t iFirst = videoFile->Infos->iFirstTimeStamp;
+	int64_t iLast = iFirst + videoFile->Infos->iDurationTimeStamps;
+	DelegateGetOutputBitmap^ delegateGetOutputBitmap = gcnew DelegateGetOutputBitmap(this, &VideoBenchmark::NoDrawings);
+
+	ResetMemory();
+
+	stopwatch->Start();
+	SaveResult result = videoFile->Save(filePath, videoFile->Infos->fFrameInterval, iFirst, iLast, "", true, false, false, delegateGetOutputBitmap);
+	stopwatch->Stop();
+	SampleMemory();
+
+	EncodingStats^ stats = videoFile->ExportStats;
+	if(result == SaveResult::Success && stats != nullptr && stats->iFrames > 0)
+	{
+		latencies->Add(stopwatch->Elapsed.TotalMilliseconds);
+		BenchmarkResult^ benchmarkResult = AddResult(_clip->szName, "Save", latencies, (int)stats->iFrames);
+		SetWriterStats(benchmarkResult, stats);
+	}
+	else
+	{
+		log->Error(String::Format("Export benchmark {0} failed: {1}", _clip->szName, result));
+	}
+
+	videoFile->Unload();
+	delete videoFile;
+
+	try
+	{
+		File::Delete(filePath);
+	}
+	catch(Exception^)
+	{
+		log->Error(String::Format("Benchmark file not deleted: {0}", filePath));
+	}
+}
+
+///<summary>
+/// VideoBenchmark::MeasureSeekAccuracy
+/// Each target is reached with ReadFrame(ts, 0) then followed by a single step forward.
+/// The frame number drawn in the image must match the one given by iCurrentTimeStamp after both,
+/// and the seek must land on the first frame at or after the target.
+///</summary>
+bool VideoBenchmark::MeasureSeekAccuracy(VideoFile^ _videoFile, BenchmarkClip^ _clip, int _iSeeks)
+{
+	List<double>^ latencies = gcnew List<double>();
+	Stopwatch^ stopwatch = gcnew Stopwatch();
+	Random^ random = gcnew Random(1234);
+	ResetMemory();
+
+	int64_t iFirst = _videoFile->Infos->iFirstTimeStamp;
+	int64_t iDuration = _videoFile->Infos->iDurationTimeStamps;
+	int64_t iTimeStampsPerFrame = Math::Max(_videoFile->Infos->iAverageTimeStampsPerFrame, (int64_t)1);
+	int iLastFrame = (int)(iDuration / iTimeStampsPerFrame);
+
+	int iErrors = 0;
+	int iMissedTargets = 0;
+	int64_t iFramesDecoded = 0;
+	int iMaxFramesDecoded = 0;
+	DecodingStats^ startStats = _videoFile->Stats;
+
+	for(int i=0;i<_iSeeks;i++)
+	{
+		int64_t iTarget = iFirst + (int64_t)(random->NextDouble() * iDuration);
+		int iTargetFrame = Math::Min(iLastFrame, (int)((iTarget - iFirst + iTimeStampsPerFrame - 1) / iTimeStampsPerFrame));
+
+		DecodingStats^ before = _videoFile->Stats;
+
+		stopwatch->Reset();
+		stopwatch->Start();
+		ReadResult result = _videoFile->ReadFrame(iTarget, 0);
+		stopwatch->Stop();
+		SampleMemory();
+
+		DecodingStats^ after = _videoFile->Stats;
+		int iSeekFrames = (int)(after->iFramesDecoded - before->iFramesDecoded);
+		iFramesDecoded += iSeekFrames;
+		iMaxFramesDecoded = Math::Max(iMaxFramesDecoded, iSeekFrames);
+
+		if(result != ReadResult::Success)
+		{
+			log->Error(String::Format("[Seek] {0}, target [{1}]: {2}.", _clip->szName, iTarget, result));
+			iErrors++;
+			continue;
+		}
+
+		latencies->Add(stopwatch->Elapsed.TotalMilliseconds);
+
+		int iReported = (int)Math::Round((double)(_videoFile->Selection->iCurrentTimeStamp - iFirst) / iTimeStampsPerFrame);
+		int iActual = ReadFrameIndex(_videoFile->CurrentImage);
+
+		if(iActual != iReported)
+		{
+			log->Error(String::Format("[Seek] {0}, target [{1}]: reported frame {2} at [{3}], image shows frame {4}.", 
+				_clip->szName, iTarget, iReported, _videoFile->Selection->iCurrentTimeStamp, iActual));
+			iErrors++;
+		}
+		else if(iActual != iTargetFrame)
+		{
+			log->Error(String::Format("[Seek] {0}, target [{1}]: expected frame {2}, landed on frame {3}.", 
+				_clip->szName, iTarget, iTargetFrame, iActual));
+			iMissedTargets++;
+		}
+
+		// The next frame comes from the decoder state left by the seek.
+		if(iActual >= 0 && iActual < iLastFrame && _videoFile->ReadFrame(-1, 1) == ReadResult::Success)
+		{
+			int iNextReported = (int)Math::Round((double)(_videoFile->Selection->iCurrentTimeStamp - iFirst) / iTimeStampsPerFrame);
+			int iNextActual = ReadFrameIndex(_videoFile->CurrentImage);
+
+			if(iNextActual != iActual + 1 || iNextReported != iNextActual)
+			{
+				log->Error(String::Format("[Seek] {0}, step after frame {1}: reported frame {2}, image shows frame {3}.", 
+					_clip->szName, iActual, iNextReported, iNextActual));
+				iErrors++;
+			}
+		}
+	}
+
+	BenchmarkResult^ benchmarkResult = AddResult(_clip->szName, "SeekAccuracy", latencies, latencies->Count);
+	benchmarkResult->iErrors = iErrors;
+	benchmarkResult->iMissedTargets = iMissedTargets;
+	benchmarkResult->fFramesPerSeek = (_iSeeks > 0) ? (double)iFramesDecoded / _iSeeks : 0;
+	benchmarkResult->iMaxFramesPerSeek = iMaxFramesDecoded;
+	benchmarkResult->iReseeks = (int)(_videoFile->Stats->iReseeks - startStats->iReseeks);
+
+	log->Debug(String::Format("{0} SeekAccuracy: {1} errors, {2} missed targets, {3:0.0} frames decoded per seek (max {4}), {5} re-seeks.",
+		_clip->szName, iErrors, iMissedTargets, benchmarkResult->fFramesPerSeek, iMaxFramesDecoded, benchmarkResult->iReseeks));
+
+	return iErrors == 0 && iMissedTargets == 0;
+}
+
+///<summary>
+/// VideoBenchmark::NoDrawings
+/// Stands for the drawings of the player screen. Nothing is painted.
+///</summary>
+int64_t VideoBenchmark::NoDrawings(Graphics^ _canvas, Bitmap^ _sourceImage, int64_t _iTimestamp, bool _bFlushDrawings, bool _bKeyframesOnly)
+{
+	// Distance to the closest key image, there is none.
+	return 1;
+}
+
+///<summary>
+/// VideoBenchmark::AddResult
+/// Summarize the latencies of one operation. The rate only counts the time spent in the calls.
+///</summary>
+BenchmarkResult^ VideoBenchmark::AddResult(String^ _Clip, String^ _Operation, List<double>^ _latencies, int _iFrames)
+{
+	BenchmarkResult^ result = gcnew BenchmarkResult();
+	result->szClip = _Clip;
+	result->szOperation = _Operation;
+	result->iCount = _latencies->Count;
+	result->iPeakMemory = m_iPeakMemory;
+	result->iCollections = GC::CollectionCount(0) - m_iCollections;
+
+	double fTotal = 0;
+	for each(double fLatency in _latencies)
+	{
+		fTotal += fLatency;
+	}
+
+	_latencies->Sort();
+	result->fFramesPerSecond = (fTotal > 0) ? _iFrames * 1000.0 / fTotal : 0;
+	result->fMedianLatency = Percentile(_latencies, 0.5);
+	result->fP99Latency = Percentile(_latencies, 0.99);
+
+	m_Results->Add(result);
+
+	log->Debug(String::Format("{0} {1}: {2:0.0} fps, p50:{3:0.000} ms, p99:{4:0.000} ms.",
+		_Clip, _Operation, result->fFramesPerSecond, result->fMedianLatency, result->fP99Latency));
+
+	return result;
+}
+
+///<summary>
+/// VideoBenchmark::SetWriterStats
+/// Per frame cost of each writer stage.
+///</summary>
+void VideoBenchmark::SetWriterStats(BenchmarkResult^ _result, EncodingStats^ _stats)
+{
+	if(_stats == nullptr || _stats->iFrames == 0)
+		return;
+
+	_result->fConvertTime = _stats->ConvertTime / _stats->iFrames;
+	_result->fEncodeTime = _stats->EncodeTime / _stats->iFrames;
+	_result->fWriteTime = _stats->WriteTime / _stats->iFrames;
+	_result->fBytesPerFrame = (double)_stats->iBytes / _stats->iFrames;
+	_result->fAllocationsPerFrame = (double)_stats->iAllocations / _stats->iFrames;
+}
+
+///<summary>
+/// VideoBenchmark::ResetMemory
+/// Start tracking the peak memory and the garbage collections of a new operation.
+///</summary>
+void VideoBenchmark::ResetMemory()
+{
+	m_iPeakMemory = 0;
+	m_iCollections = GC::CollectionCount(0);
+	SampleMemory();
+}
+
+///<summary>
+/// VideoBenchmark::SampleMemory
+/// Update the peak with the current private bytes. Called outside the timed sections.
+///</summary>
+void VideoBenchmark::SampleMemory()
+{
+	m_Process->Refresh();
+	m_iPeakMemory = Math::Max(m_iPeakMemory, m_Process->PrivateMemorySize64);
+}
+
+///<summary>
+/// VideoBenchmark::Percentile
+/// Nearest rank percentile of sorted values.
+///</summary>
+double VideoBenchmark::Percentile(List<double>^ _sortedValues, double _fPercentile)
+{
+	if(_sortedValues->Count == 0)
+		return 0;
+
+	int iRank = (int)Math::Ceiling(_fPercentile * _sortedValues->Count);
+	return _sortedValues[Math::Max(0, Math::Min(_sortedValues->Count - 1, iRank - 1))];
+}
+
+///<summary>
+/// VideoBenchmark::FillSyntheticFrame
+/// BGRA gradients scrolling at different speeds, with a block moving across the image.
+/// The frame number is drawn at the top left, one black or white cell per bit, least significant first.
+///</summary>
+void VideoBenchmark::FillSyntheticFrame(uint8_t* _pBuffer, int _iStride, int _iWidth, int _iHeight, int _iFrame)
+{
+	int iBlockSize = _iHeight / 8;
+	int iBlockLeft = (_iFrame * 8) % Math::Max(1, _iWidth - iBlockSize);
+	int iBlockTop = _iHeight / 2 - iBlockSize / 2;
+
+	for(int y=0;y<_iHeight;y++)
+	{
+		uint8_t* pRow = _pBuffer + y * _iStride;
+		bool bBlockRow = (y >= iBlockTop && y < iBlockTop + iBlockSize);
+
+		for(int x=0;x<_iWidth;x++)
+		{
+			uint8_t* pPixel = pRow + x * 4;
+			if(bBlockRow && x >= iBlockLeft && x < iBlockLeft + iBlockSize)
+			{
+				pPixel[0] = 255;
+				pPixel[1] = 255;
+				pPixel[2] = 255;
+			}
+			else
+			{
+				pPixel[0] = (uint8_t)(x + _iFrame * 2);
+				pPixel[1] = (uint8_t)(y + _iFrame);
+				pPixel[2] = (uint8_t)((x + y) / 2);
+			}
+			pPixel[3] = 255;
+		}
+	}
+
+	// Cells large enough to survive compression.
+	int iCellSize = FrameIndexCellSize(_iWidth);
+	if(iCellSize * FRAME_INDEX_BITS > _iWidth || iCellSize > _iHeight)
+		return;
+
+	for(int y=0;y<iCellSize;y++)
+	{
+		uint8_t* pRow = _pBuffer + y * _iStride;
+		for(int x=0;x<iCellSize * FRAME_INDEX_BITS;x++)
+		{
+			uint8_t* pPixel = pRow + x * 4;
+			uint8_t value = ((_iFrame >> (x / iCellSize)) & 1) ? 255 : 0;
+			pPixel[0] = value;
+			pPixel[1] = value;
+			pPixel[2] = value;
+		}
+	}
+}
+
+///<summary>
+/// VideoBenchmark::FrameIndexCellSize
+/// Side of one bit of the frame number, in pixels.
+///</summary>
+int VideoBenchmark::FrameIndexCellSize(int _iWidth)
+{
+	return Math::Max(8, _iWidth / 40);
+}
+
+///<summary>
+/// VideoBenchmark::ReadFrameIndex
+/// Frame number drawn by FillSyntheticFrame, from a decoded 32 bits image. -1 if it can't be read.
+/// Only the center of each cell is sampled, compression artifacts stay on the edges.
+///</summary>
+int VideoBenchmark::ReadFrameIndex(Bitmap^ _image)
+{
+	if(_image == nullptr)
+		return -1;
+
+	int iCellSize = FrameIndexCellSize(_image->Width);
+	if(iCellSize * FRAME_INDEX_BITS > _image->Width || iCellSize > _image->Height)
+		return -1;
+
+	int iIndex = 0;
+	Imaging::BitmapData^ data = _image->LockBits(Rectangle(0, 0, iCellSize * FRAME_INDEX_BITS, iCellSize), Imaging::ImageLockMode::ReadOnly, _image->PixelFormat);
+	
+	try
+	{
+		uint8_t* pRow = (uint8_t*)data->Scan0.ToPointer() + (iCellSize / 2) * data->Stride;
+		for(int i=0;i<FRAME_INDEX_BITS;i++)
+		{
+			uint8_t* pPixel = pRow + (i * iCellSize + iCellSize / 2) * 4;
+			if(pPixel[1] > 128)
+			{
+				iIndex |= (1 << i);
+			}
+		}
+	}
+	finally
+	{
+		_image->UnlockBits(data);
+	}
+
+	return iIndex;
+}
+
+}
+}
@@ -0,0 +1,157 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+*/
+
+//-----------------------------------------------------------------------------
+// VideoBenchmark - Performance measurements of PlayerServer.
+//
+// Synthetic clips are generated locally with VideoFileWriter, in several codecs,
+// GOP lengths and resolutions, then the reading paths of VideoFile are timed.
+// The writer is timed on the same parameters, directly and through VideoFile::Save.
+// The frame number is also drawn in the pixels, so seeks can be checked against the image actually returned.
+// Results are written as XML, one element per clip and operation,
+// so runs of different builds can be compared by a script.
+//
+// Run from the application with kinovea.exe -benchmark [directory], or -seekcheck [directory]
+// for the seek check alone (Root/BenchmarkRunner.cs). A failed seek check exits with a non-zero code.
+//
+// Usage:
+// VideoBenchmark^ benchmark = gcnew VideoBenchmark(workingDirectory);
+// benchmark->GenerateClips(); benchmark->RunDecode(); benchmark->RunEncode(); benchmark->RunExport();
+// benchmark->WriteResults(path); benchmark->DeleteClips();
+//
+// Seek regression check:
+// benchmark->Clips = VideoBenchmark::SeekClips(); benchmark->GenerateClips(); 
+// bool bPassed = benchmark->RunSeekAccuracy(2000);
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "VideoFileWriter.h"
+
+using namespace System::Xml;
+
+namespace Kinovea
+{
+	namespace VideoFiles
+	{
+		/// <summary>
+		/// A synthetic clip generated for the benchmarks.
+		/// </summary>
+		public ref class BenchmarkClip
+		{
+		public:
+			String^ szName;
+			RecordingProfile eProfile;
+			int iGopSize;							// Overrides the preset GOP, negative to keep it.
+			int iWidth;
+			int iHeight;
+			int iFrames;
+			String^ szFilePath;						// Set by GenerateClips.
+		};
+
+		/// <summary>
+		/// Timing of one operation on one clip. Latencies are in milliseconds, memory in bytes.
+		/// </summary>
+		public ref class BenchmarkResult
+		{
+		public:
+			String^ szClip;
+			String^ szOperation;
+			int iCount;								// Number of timed calls.
+			double fFramesPerSecond;
+			double fMedianLatency;
+			double fP99Latency;
+			int64_t iPeakMemory;					// Highest private bytes of the process seen during the operation.
+			int iCollections;						// Generation 0 garbage collections during the operation.
+
+			// Writing operations only. Times are in milliseconds per frame.
+			double fConvertTime;
+			double fEncodeTime;
+			double fWriteTime;
+			double fBytesPerFrame;
+			double fAllocationsPerFrame;			// Native buffers allocated by the writer for each frame.
+
+			// Seek accuracy only.
+			int iErrors;							// Image content not matching the reported timestamp.
+			int iMissedTargets;						// Landed on another frame than the first one at or after the target.
+			double fFramesPerSeek;					// Frames decoded to reach the target.
+			int iMaxFramesPerSeek;
+			int iReseeks;							// Seeks that had to go further back.
+		};
+
+		public ref class VideoBenchmark
+		{
+		public:
+			VideoBenchmark(String^ _WorkingDirectory);
+
+			/// <summary>
+			/// Clips used by the benchmark. DefaultClips unless changed before GenerateClips.
+			/// </summary>
+			property List<BenchmarkClip^>^ Clips
+			{
+				List<BenchmarkClip^>^ get(){ return m_Clips;}
+				void set(List<BenchmarkClip^>^ _clips){ m_Clips = _clips;}
+			}
+			property List<BenchmarkResult^>^ Results
+			{
+				List<BenchmarkResult^>^ get(){ return m_Results;}
+			}
+
+			static List<BenchmarkClip^>^ DefaultClips();
+			static List<BenchmarkClip^>^ SeekClips();
+
+			bool GenerateClips();
+			void RunDecode();
+			void RunEncode();
+			void RunExport();
+			bool RunSeekAccuracy(int _iSeeks);
+			void WriteResults(String^ _FilePath);
+			void DeleteClips();
+
+		private:
+			void MeasureLoad(BenchmarkClip^ _clip);
+			void MeasureSequential(VideoFile^ _videoFile, BenchmarkClip^ _clip);
+			void MeasureRandomSeek(VideoFile^ _videoFile, BenchmarkClip^ _clip);
+			void MeasureBackwardStep(VideoFile^ _videoFile, BenchmarkClip^ _clip);
+			void MeasureExtraction(VideoFile^ _videoFile, BenchmarkClip^ _clip);
+			void MeasureEncode(BenchmarkClip^ _clip, bool _bPipelined);
+			void MeasureExport(BenchmarkClip^ _clip);
+			bool MeasureSeekAccuracy(VideoFile^ _videoFile, BenchmarkClip^ _clip, int _iSeeks);
+
+			BenchmarkResult^ AddResult(String^ _Clip, String^ _Operation, List<double>^ _latencies, int _iFrames);
+			static void SetWriterStats(BenchmarkResult^ _result, EncodingStats^ _stats);
+			int64_t NoDrawings(Graphics^ _canvas, Bitmap^ _sourceImage, int64_t _iTimestamp, bool _bFlushDrawings, bool _bKeyframesOnly);
+			void ResetMemory();
+			void SampleMemory();
+			static double Percentile(List<double>^ _sortedValues, double _fPercentile);
+			static void FillSyntheticFrame(uint8_t* _pBuffer, int _iStride, int _iWidth, int _iHeight, int _iFrame);
+			static int FrameIndexCellSize(int _iWidth);
+			static int ReadFrameIndex(Bitmap^ _image);
+
+			static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+
+			String^ m_WorkingDirectory;
+			List<BenchmarkClip^>^ m_Clips;
+			List<BenchmarkResult^>^ m_Results;
+			Process^ m_Process;
+			int64_t m_iPeakMemory;
+			int m_iCollections;						// Collection count at the start of the operation.
+		};
+	}
+}
@@ -61,8 +61,12 @@ extern "C"
 }
 
 #include <stdio.h>
+#include "Deinterlacer.h"
 #include "InfosVideo.h"
 #include "SavingContext.h"
+#include "BandScaler.h"
+#include "ColorConversion.h"
+#include "TraceRecorder.h"
 
 namespace Kinovea
 {
@@ -71,6 +75,7 @@ namespace VideoFiles
 
 #pragma region Namespace wide delegates
 	public delegate int64_t DelegateGetOutputBitmap(Graphics^ _canvas, Bitmap^ _sourceImage, int64_t _iTimestamp, bool _bFlushDrawings, bool _bKeyframesOnly);
+	public delegate bool DelegateHasDrawings(int64_t _iTimestamp);
 #pragma endregion
 
 #pragma region Namespace wide enums
@@ -122,10 +127,16 @@ namespace VideoFiles
 
 		MovieNotLoaded,
 		TranscodeNotFinished,
-		Cancelled
+		Cancelled,
+		QueueFull,
+		InvalidInputFrame,
+		PipelineStartFailed,
+		FileNotWritten
 	};
 #pragma endregion
 
+	ref class ExportChunk;
+
 	public ref class VideoFile
 	{
 
@@ -160,11 +171,59 @@ namespace VideoFiles
 			BackgroundWorker^ get(){return m_bgWorker;}
 			void set(BackgroundWorker^ _bgWorker){m_bgWorker = _bgWorker;}
 		}
+		/// <summary>
+		/// Number of keyframe aligned chunks Save may export concurrently, each with its own decoder and encoder.
+		/// 1 keeps the sequential export.
+		/// </summary>
+		property int ExportThreads
+		{
+			int get(){ return m_iExportThreads;}
+			void set(int _iExportThreads){ m_iExportThreads = Math::Max(1, _iExportThreads);}
+		}
+		/// <summary>
+		/// Shortest selection, in frames, exported in chunks when ExportThreads is above 1.
+		/// Shorter ones don't pay back the extra decoders, encoders and the final join.
+		/// </summary>
+		property int ParallelExportMinFrames
+		{
+			int get(){ return m_iParallelExportMinFrames;}
+			void set(int _iFrames){ m_iParallelExportMinFrames = Math::Max(1, _iFrames);}
+		}
+		/// <summary>
+		/// Writer statistics of the last Save that encoded the frames, summed over the chunks for a parallel save. 
+		/// Null otherwise.
+		/// </summary>
+		property EncodingStats^ ExportStats
+		{
+			EncodingStats^ get(){ return m_ExportStats;}
+		}
+		/// <summary>
+		/// Snapshot of the reading path statistics since the file was loaded. Safe to poll from any thread.
+		/// </summary>
+		property DecodingStats^ Stats
+		{
+			DecodingStats^ get(){ return m_DecodingStats->Snapshot();}
+		}
+		/// <summary>
+		/// Bytes currently held by this instance. Safe to poll from any thread.
+		/// </summary>
+		property MemoryUsage^ Memory
+		{
+			MemoryUsage^ get(){ return GetMemoryUsage();}
+		}
+		/// <summary>
+		/// Bytes held by every VideoFile alive in the process: player screens and thumbnail readers.
+		/// </summary>
+		static property MemoryUsage^ TotalMemory
+		{
+			MemoryUsage^ get(){ return GetTotalMemoryUsage();}
+		}
 #pragma endregion
 
 #pragma region Members
 	private :
 		static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
+		static List<WeakReference^>^ m_Instances = gcnew List<WeakReference^>();	// Registry for the process wide memory usage.
 		
 		bool m_bIsLoaded;
 		String^ m_FilePath;
@@ -197,6 +256,19 @@ namespace VideoFiles
 		IntPtr							m_Hbmp;
 
 		SavingContext^ m_SavingContext;
+		int m_iExportThreads;
+		int m_iParallelExportMinFrames;
+		EncodingStats^ m_ExportStats;
+		DecodingStats^ m_DecodingStats;
+		Deinterlacer^ m_Deinterlacer;									// Reading path only, export chunks have their own.
+		BandScaler^ m_Scaler;											// Same.
+		List<ExportChunk^>^ m_ExportChunks;								// Chunks of the parallel save in progress, null otherwise.
+
+		// Memory accounting.
+		int64_t m_iFrameListBytes;
+		int64_t m_iBufferBytes;
+		int64_t m_iDecoderBytes;
+		int64_t m_iWorkingBytes;
 
 #pragma endregion
 
@@ -212,6 +284,7 @@ namespace VideoFiles
 	public:
 
 		void SetDefaultSettings(int _AspectRatio, bool _bDeinterlaceByDefault);
+		void SetDefaultSettings(int _AspectRatio, bool _bDeinterlaceByDefault, int _DeinterlaceMode);
 
 		LoadResult Load(String^ _FilePath);
 		
@@ -228,6 +301,7 @@ namespace VideoFiles
 		void	ChangeAspectRatio(AspectRatio _aspectRatio);
 
 		SaveResult Save( String^ _FilePath, double _fFramesInterval, int64_t _iSelStart, int64_t _iSelEnd, String^ _Metadata, bool _bFlushDrawings, bool _bKeyframesOnly, bool _bPausedVideo, DelegateGetOutputBitmap^ _delegateGetOutputBitmap);
+		SaveResult Save( String^ _FilePath, double _fFramesInterval, int64_t _iSelStart, int64_t _iSelEnd, String^ _Metadata, bool _bFlushDrawings, bool _bKeyframesOnly, bool _bPausedVideo, DelegateGetOutputBitmap^ _delegateGetOutputBitmap, DelegateHasDrawings^ _delegateHasDrawings);
 
 		void Unload();
 
@@ -254,11 +328,27 @@ namespace VideoFiles
 		int		EstimateNumberOfFrames( int64_t _iStartTimeStamp, int64_t _iEndTimeStamp); 
 		void	DeleteFrameList(void);
 
+		// Saving
+		Bitmap^	GetOutputImage(Bitmap^ _source, int64_t _iTimestamp, bool _bFlushDrawings, bool _bKeyframesOnly, DelegateGetOutputBitmap^ _delegateGetOutputBitmap, DelegateHasDrawings^ _delegateHasDrawings, int64_t% _iKeyImageDistance);
+		bool	CanRemux(String^ _FilePath, double _fFramesInterval, bool _bHasMetadata, bool _bFlushDrawings, bool _bKeyframesOnly, bool _bPausedVideo);
+		SaveResult Remux(String^ _FilePath, int64_t _iSelStart, int64_t _iSelEnd, String^ _Metadata);
+		bool	CanSmartRender(String^ _FilePath, double _fFramesInterval, bool _bHasMetadata, bool _bFlushDrawings, bool _bKeyframesOnly, bool _bPausedVideo, DelegateHasDrawings^ _delegateHasDrawings);
+		bool	ScanGops(int64_t _iSelStart, int64_t _iSelEnd, DelegateHasDrawings^ _delegateHasDrawings, List<int64_t>^ _gopStarts, List<bool>^ _gopRendered);
+		SaveResult SmartRender(String^ _FilePath, int64_t _iSelStart, int64_t _iSelEnd, String^ _Metadata, DelegateGetOutputBitmap^ _delegateGetOutputBitmap, DelegateHasDrawings^ _delegateHasDrawings, List<int64_t>^ _gopStarts, List<bool>^ _gopRendered);
+		SaveResult SaveParallel(String^ _FilePath, double _fFramesInterval, int _iDuplicateFactor, int64_t _iSelStart, int64_t _iSelEnd, String^ _Metadata, bool _bFlushDrawings, DelegateGetOutputBitmap^ _delegateGetOutputBitmap, DelegateHasDrawings^ _delegateHasDrawings, List<int64_t>^ _gopStarts);
+		void	ExportChunkLoop(Object^ _chunk);
+		SaveResult ConcatenateSegments(String^ _FilePath, List<String^>^ _segments, double _fFramesInterval, String^ _Metadata);
+
 		// Other utilities
-		bool	RescaleAndConvert(AVFrame* _pOutputFrame, AVFrame* _pInputFrame, int _OutputWidth, int _OutputHeight, int _OutputFmt, bool _bDeinterlace);
+		bool	RescaleAndConvert(AVFrame* _pOutputFrame, AVFrame* _pInputFrame, int _OutputWidth, int _OutputHeight, int _OutputFmt, bool _bDeinterlace, Deinterlacer^ _deinterlacer, BandScaler^ _scaler);
 		void	ResetPrimarySelection(void);
 		void	ResetInfosVideo(void);
 		void	SetImageGeometry(void);
+		MemoryUsage^ GetMemoryUsage();
+		static MemoryUsage^ GetTotalMemoryUsage();
+		static bool IsCollected(WeakReference^ _reference);
+		static int64_t BitmapBytes(Bitmap^ _bitmap);
+		static int64_t EstimateDecoderBytes(AVCodecContext* _pCodecCtx);
 
 #pragma endregion
 			
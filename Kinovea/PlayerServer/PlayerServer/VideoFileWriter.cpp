@@ -20,6 +20,7 @@ along with Kinovea. If not, see http://www.gnu.org/licenses/.
 
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include "VideoFileWriter.h"
 
 using namespace System::Diagnostics;
@@ -42,6 +43,23 @@ VideoFileWriter::VideoFileWriter()
 	avcodec_init();
 	avcodec_register_all();
 
+	m_bPipelined = false;
+	m_iEncoderThreads = 1;
+	m_iPipelineCapacity = 8;
+	m_QueuePolicy = FullQueuePolicy::Reject;
+	m_EnqueueLock = gcnew Object();
+	m_ProducersLock = gcnew Object();
+	m_bPipelineClosing = true;
+	m_iProducers = 0;
+	m_fSegmentDuration = 0;
+	m_iSegmentSize = 0;
+	m_bAsyncWrite = false;
+	m_iWriteBudget = 32 * 1024 * 1024;
+	m_bStreamingSafe = false;
+	m_fFlushInterval = 1.0;
+	m_fPreRollDuration = 0;
+	m_iPreRollBytes = 0;
+	m_PreRollLock = gcnew Object();
 }
 VideoFileWriter::~VideoFileWriter()
 {
@@ -60,6 +78,16 @@ VideoFileWriter::!VideoFileWriter()
 /// Open a saving context and configure it with default parameters.
 ///</summary>
 SaveResult VideoFileWriter::OpenSavingContext(String^ _FilePath, InfosVideo^ _infosVideo, double _fFramesInterval, bool _bHasMetadata)
+{
+	return OpenSavingContext(_FilePath, _infosVideo, _fFramesInterval, _bHasMetadata, nullptr);
+}
+
+///<summary>
+/// VideoFileWriter::OpenSavingContext
+/// Open a saving context and configure it with the given encoding profile.
+/// A null profile keeps the historical intra only MPEG-4 settings.
+///</summary>
+SaveResult VideoFileWriter::OpenSavingContext(String^ _FilePath, InfosVideo^ _infosVideo, double _fFramesInterval, bool _bHasMetadata, EncodingProfile^ _profile)
 {
 	//---------------------------------------------------------------------------------------------------
 	// Set the saving context.
@@ -81,6 +109,8 @@ SaveResult VideoFileWriter::OpenSavingContext(String^ _FilePath, InfosVideo^ _in
 	// (MPEG-4 AVC videos will always look bad when reencoded in MPEG-4 ASP at the same bitrate).
 	//
 	// Bottom line: until we have a two pass saving routine, we'll use 25 MB/s.
+	//
+	// The bitrate is now part of the encoding profile, the default profile still uses 25 MB/s.
 	//---------------------------------------------------------------------------------------------------
 
 	// todo : group parameters list by simply passing the m_SavingContext.
@@ -93,6 +123,7 @@ SaveResult VideoFileWriter::OpenSavingContext(String^ _FilePath, InfosVideo^ _in
 	m_SavingContext = gcnew SavingContext();
 
 	m_SavingContext->pFilePath = static_cast<char*>(Marshal::StringToHGlobalAnsi(_FilePath).ToPointer());
+	m_SavingContext->szBasePath = _FilePath;
 	
 	if(_infosVideo != nullptr)
 	{
@@ -106,11 +137,29 @@ SaveResult VideoFileWriter::OpenSavingContext(String^ _FilePath, InfosVideo^ _in
 	}
 	
 	if(_fFramesInterval > 0) m_SavingContext->fFramesInterval = _fFramesInterval;
+
+	if(_profile != nullptr) m_SavingContext->profile = _profile;
+	m_SavingContext->iBitrate = m_SavingContext->profile->iBitrate;
+
+	m_SavingContext->bPipelined = m_bPipelined;
+	m_SavingContext->iEncoderThreads = (m_SavingContext->profile->iThreads > 0) ? m_SavingContext->profile->iThreads : m_iEncoderThreads;
+	m_SavingContext->iPipelineCapacity = m_iPipelineCapacity;
+	m_SavingContext->bAsyncWrite = m_bAsyncWrite;
+	m_SavingContext->iWriteBudget = m_iWriteBudget;
+	if(m_bAsyncWrite) m_SavingContext->writeStats = gcnew AsyncWriteStats();
+	m_SavingContext->bStreamingSafe = m_bStreamingSafe;
+	m_SavingContext->iFlushInterval = (int64_t)(m_fFlushInterval * 1000000);
+	m_SavingContext->iSegmentDuration = (int64_t)(m_fSegmentDuration * 1000000);
+	m_SavingContext->iSegmentSize = m_iSegmentSize;
+	m_SavingContext->iPreRollDuration = (int64_t)(m_fPreRollDuration * 1000000);
+	m_SavingContext->bPreRolling = m_SavingContext->iPreRollDuration > 0;
 	
 	do
 	{
 		// 1. Muxer selection.
-		if ((m_SavingContext->pOutputFormat = VideoFileWriter::GuessOutputFormat(_FilePath, _bHasMetadata)) == nullptr) 
+		// Streaming safe mode forces Matroska like metadata does: its clusters stay readable without the trailer. 
+		// (MP4 needs its index at the end, and this version of the muxer can't write fragments).
+		if ((m_SavingContext->pOutputFormat = VideoFileWriter::GuessOutputFormat(_FilePath, _bHasMetadata || m_SavingContext->bStreamingSafe)) == nullptr) 
 		{
 			result = SaveResult::MuxerNotFound;
 			log->Error("Muxer not found");
@@ -142,10 +191,18 @@ SaveResult VideoFileWriter::OpenSavingContext(String^ _FilePath, InfosVideo^ _in
 		}
 
 		// 5. Encoder selection
-		if ((m_SavingContext->pOutputCodec = avcodec_find_encoder(CODEC_ID_MPEG4)) == nullptr)
+		if ((m_SavingContext->pOutputCodec = FindEncoder(m_SavingContext->profile->szEncoderName)) == nullptr)
+		{
+			result = SaveResult::EncoderNotFound;
+			log->Error(String::Format("Encoder not found: {0}", m_SavingContext->profile->szEncoderName));
+			break;
+		}
+
+		if(!IsCodecSupportedByMuxer(m_SavingContext->pOutputFormat, m_SavingContext->pOutputCodec->id))
 		{
 			result = SaveResult::EncoderNotFound;
-			log->Error("Encoder not found");
+			log->Error(String::Format("Encoder {0} not supported by the {1} muxer", 
+				m_SavingContext->profile->szEncoderName, gcnew String(m_SavingContext->pOutputFormat->name)));
 			break;
 		}
 
@@ -178,649 +235,2726 @@ SaveResult VideoFileWriter::OpenSavingContext(String^ _FilePath, InfosVideo^ _in
 		// 9. Associate encoder to stream.
 		m_SavingContext->pOutputVideoStream->codec = m_SavingContext->pOutputCodecContext;
 
-		
-		if(_bHasMetadata)
+		// The streams of the next files can't copy the encoder while it runs, they copy its parameters as they are now.
+		if(m_SavingContext->iSegmentDuration > 0 || m_SavingContext->iSegmentSize > 0)
 		{
-			log->Debug("Muxing metadata into a subtitle stream.");
-
-			// Create metadata stream.
-			if ((m_SavingContext->pOutputDataStream = av_new_stream(m_SavingContext->pOutputFormatContext, 1)) == nullptr) 
+			m_SavingContext->pEncoderSnapshot = avcodec_alloc_context();
+			if(m_SavingContext->pEncoderSnapshot == nullptr || avcodec_copy_context(m_SavingContext->pEncoderSnapshot, m_SavingContext->pOutputCodecContext) < 0)
 			{
-				result = SaveResult::MetadataStreamNotCreated;
-				log->Error("metadata stream not created");
+				result = SaveResult::EncoderParametersNotAllocated;
+				log->Error("Encoder parameters snapshot not allocated");
 				break;
 			}
-
-			// Get default configuration for subtitle streams.
-			// (Will allocate pointed CodecCtx)
-			avcodec_get_context_defaults2(m_SavingContext->pOutputDataStream->codec, AVMEDIA_TYPE_SUBTITLE);
-			
-			// Identify codec. Will show as "S_TEXT/UTF8" for Matroska.
-			m_SavingContext->pOutputDataStream->codec->codec_id = CODEC_ID_TEXT;
-
-			// ISO 639 code for subtitle language. ( -> en.wikipedia.org/wiki/List_of_ISO_639-3_codes)	 
-			// => "Malaysian Sign Language" code is "XML" :-)
-			av_metadata_set2(&m_SavingContext->pOutputDataStream->metadata, "language", "XML", 0);
+			m_SavingContext->pEncoderSnapshot->coded_frame = nullptr;
 		}
 
-		int iFFMpegResult;
-
-		// 10. Open the file.
-		if ((iFFMpegResult = url_fopen(&(m_SavingContext->pOutputFormatContext)->pb, m_SavingContext->pFilePath, URL_WRONLY)) < 0) 
+		
+		if(_bHasMetadata && !SetupMetadataStream(m_SavingContext))
 		{
-			result = SaveResult::FileNotOpened;
-			log->Error(String::Format("File not opened, AVERROR:{0}", iFFMpegResult));
+			result = SaveResult::MetadataStreamNotCreated;
+			log->Error("metadata stream not created");
 			break;
 		}
 
-		// 11. Write file header.
-		SanityCheck(m_SavingContext->pOutputFormatContext);
-		if((iFFMpegResult = av_write_header(m_SavingContext->pOutputFormatContext)) < 0)
+		// 10. Open the file and write its header. 
+		// In pre-roll mode this waits for the trigger, the compressed frames are kept in memory meanwhile.
+		if(m_SavingContext->bPreRolling)
+		{
+			m_PreRollPackets = gcnew List<PreRollPacket^>();
+			m_FreePreRollPackets = gcnew Stack<PreRollPacket^>();
+			m_iPreRollBytes = 0;
+		}
+		else if((result = OpenOutputFile(m_SavingContext)) != SaveResult::Success)
 		{
-			result = SaveResult::FileHeaderNotWritten;
-			log->Error(String::Format("File header not written, AVERROR:{0}", iFFMpegResult));
 			break;
 		}
 
-		// 12. Allocate memory for the current incoming frame holder. (will be reused for each frame). 
+		// 11. Allocate memory for the current incoming frame holder. (will be reused for each frame). 
 		if ((m_SavingContext->pInputFrame = avcodec_alloc_frame()) == nullptr) 
 		{
 			result = SaveResult::InputFrameNotAllocated;
 			log->Error("input frame not allocated");
 			break;
 		}
-	}
-	while(false);
 
-	return result;
-}
-void VideoFileWriter::SanityCheck(AVFormatContext* s)
-{
-	// Taken/Adapted from the real sanity check from utils.c av_write_header.
-
-	if (s->nb_streams == 0) 
-	{
-		log->Error("VideoFileWriter sanity check failed:no streams.");
-    }
-
-	AVStream *st;
-    for(unsigned int i=0;i < s->nb_streams;i++) 
-	{
-        st = s->streams[i];
-
-        switch (st->codec->codec_type) 
+		// 12. Start the conversion, encoding and muxing threads.
+		if(m_SavingContext->bPipelined && !StartPipeline(m_SavingContext))
 		{
-			case AVMEDIA_TYPE_VIDEO:
-				if(st->codec->time_base.num <= 0 || st->codec->time_base.den <= 0)
-				{ 
-					log->Error("VideoFileWriter sanity check failed: time base not set.");
-				}
-				if(st->codec->width <= 0 || st->codec->height <= 0)
-				{
-					log->Error("VideoFileWriter sanity check failed: dimensions not set.");
-				}
-				if(av_cmp_q(st->sample_aspect_ratio, st->codec->sample_aspect_ratio))
-				{
-					log->Error("VideoFileWriter sanity check failed: Aspect ratio mismatch between encoder and muxer layer.");
-					log->Debug(String::Format("stream SAR={0}:{1}, codec SAR:{2}:{3}", 
-						st->sample_aspect_ratio.num, st->sample_aspect_ratio.den, st->codec->sample_aspect_ratio.num, st->codec->sample_aspect_ratio.den));
-				}
-				break;
+			result = SaveResult::PipelineStartFailed;
+			log->Error("encoding pipeline not started");
+			break;
 		}
 
-        if(s->oformat->flags & AVFMT_GLOBALHEADER && !(st->codec->flags & CODEC_FLAG_GLOBAL_HEADER))
+		// 13. Open the second file in the background, so it is ready when the first one is full.
+		if(!m_SavingContext->bPreRolling && (m_SavingContext->iSegmentDuration > 0 || m_SavingContext->iSegmentSize > 0))
 		{
-			log->Debug("VideoFileWriter sanity check warning: Codec does not use global headers but container format requires global headers");
+			StartSegmentThread();
 		}
-    }
+	}
+	while(false);
+
+	return result;
 }
 
 ///<summary>
-/// VideoFileWriter::CloseSavingContext
-/// Close the saving context and free any allocated resources.
+/// VideoFileWriter::OpenOutputFile
+/// Create the file and write its header. The muxer and the streams must be configured.
 ///</summary>
-SaveResult VideoFileWriter::CloseSavingContext(bool _bEncodingSuccess)
+SaveResult VideoFileWriter::OpenOutputFile(SavingContext^ _SavingContext)
 {
-	log->Debug("Closing the saving context.");
-
-	SaveResult result = SaveResult::Success;
+	int iFFMpegResult;
 
-	if(_bEncodingSuccess)
+	if ((iFFMpegResult = OpenOutputIO(_SavingContext, _SavingContext->pOutputFormatContext, _SavingContext->pFilePath)) < 0) 
 	{
-		// Write file trailer.		
-		av_write_trailer(m_SavingContext->pOutputFormatContext);
+		log->Error(String::Format("File not opened, AVERROR:{0}", iFFMpegResult));
+		return SaveResult::FileNotOpened;
 	}
 
-	if(m_SavingContext->bEncoderOpened)
+	SanityCheck(_SavingContext->pOutputFormatContext);
+	if((iFFMpegResult = av_write_header(_SavingContext->pOutputFormatContext)) < 0)
 	{
-		avcodec_close(m_SavingContext->pOutputVideoStream->codec);
-	
-		// Free the InputFrame holder
-		av_free(m_SavingContext->pInputFrame);
+		log->Error(String::Format("File header not written, AVERROR:{0}", iFFMpegResult));
+		return SaveResult::FileHeaderNotWritten;
 	}
-		
-	Marshal::FreeHGlobal(safe_cast<IntPtr>(m_SavingContext->pFilePath));
-	
-	// Stream release (equivalent to freeing pOutputCodec + pOutputVideoStream)
-	for(int i = 0; i < (int)m_SavingContext->pOutputFormatContext->nb_streams; i++) 
+
+	// Readers can open the file right away.
+	if(_SavingContext->bStreamingSafe)
 	{
-		av_freep(&(m_SavingContext->pOutputFormatContext)->streams[i]->codec);
-		av_freep(&(m_SavingContext->pOutputFormatContext)->streams[i]);
+		avio_flush(_SavingContext->pOutputFormatContext->pb);
 	}
 
-	// Close file.
-	url_fclose(m_SavingContext->pOutputFormatContext->pb);
-
-	// Release muxer parameter object.
-	av_free(m_SavingContext->pOutputFormatContext);
-
-	// release pOutputFormat ?
-
-	log->Debug("Saving video completed.");
-
-	return result;
+	return SaveResult::Success;
 }
 
-
 ///<summary>
-/// VideoFileWriter::SaveFrame
-/// Save a single bitmap in the file opened in a previous call to OpenSaving context.
+/// VideoFileWriter::OpenOutputIO
+/// Create the file of a muxer, written directly or through the asynchronous output. 
+/// Returns a negative AVERROR on failure, like url_fopen.
 ///</summary>
-SaveResult VideoFileWriter::SaveFrame(Bitmap^ _image)
+int VideoFileWriter::OpenOutputIO(SavingContext^ _SavingContext, AVFormatContext* _pFormatContext, char* _pFilePath)
 {
-	SaveResult result = SaveResult::Success;
+	if(!_SavingContext->bAsyncWrite)
+		return url_fopen(&_pFormatContext->pb, _pFilePath, URL_WRONLY);
 
-	if(!EncodeAndWriteVideoFrame(m_SavingContext, _image))
-	{
-		log->Error("error while writing output frame");
-		result = SaveResult::UnknownError;
-	}
+	// 1 MB blocks: large sequential writes are what network drives and spinning disks handle best.
+	AsyncFileOutput^ output = gcnew AsyncFileOutput(1024 * 1024, _SavingContext->iWriteBudget, _SavingContext->writeStats);
+	if(!output->Open(gcnew String(_pFilePath)))
+		return AVERROR(EIO);
 
-	return result;
+	_pFormatContext->pb = output->Context;
+	return 0;
 }
 
 ///<summary>
-/// VideoFileWriter::SaveMetadata
-/// Save an xml string in the file opened in a previous call to OpenSaving context.
+/// VideoFileWriter::CloseOutputIO
+/// Close the file of a muxer. In asynchronous mode, waits for the pending writes.
+/// Returns false if some of the data didn't reach the file.
 ///</summary>
-SaveResult VideoFileWriter::SaveMetadata(String^ _Metadata)
+bool VideoFileWriter::CloseOutputIO(AVFormatContext* _pFormatContext)
 {
-	log->Debug("Saving metadata to file.");
-	SaveResult result = SaveResult::Success;
+	if(_pFormatContext->pb == nullptr)
+		return true;
 
-	if(!WriteMetadata(m_SavingContext, _Metadata))
+	bool bWritten = true;
+	AsyncFileOutput^ output = AsyncFileOutput::FromContext(_pFormatContext->pb);
+	if(output != nullptr)
 	{
-		log->Error("metadata not written");
-		result = SaveResult::MetadataNotWritten;
+		bWritten = output->Close();
+	}
+	else
+	{
+		url_fclose(_pFormatContext->pb);
 	}
 	
-	return result;
+	_pFormatContext->pb = nullptr;
+	return bWritten;
 }
 
 ///<summary>
-/// VideoFileWriter::GuessOutputFormat
-/// Return the AVOutputFormat corresponding to a specific filename.
-/// Forces to Matroska if Metadata must be saved.
+/// VideoFileWriter::Trigger
+/// Pre-roll mode. Create the file, write the frames kept in memory and continue with the live frames.
+/// The file starts on the oldest keyframe kept. Calling it again has no effect.
 ///</summary>
-AVOutputFormat* VideoFileWriter::GuessOutputFormat(String^ _FilePath, bool _bHasMetadata)
+SaveResult VideoFileWriter::Trigger()
 {
-	//---------------------------------------------------------------
-	// Hint:
-	// To find a particular format name for ffmpeg,
-	// search for the AVOutputFormat struct in source code for the format.
-	// generally at the end of the file.
-	//---------------------------------------------------------------
-
-	AVOutputFormat*		pOutputFormat;
+	if(m_SavingContext == nullptr || !m_SavingContext->bPreRolling)
+		return SaveResult::Success;
 
-	String^ Filepath = gcnew String(_FilePath->ToLower());
+	SaveResult result = SaveResult::Success;
 
-	if(Filepath->EndsWith("mkv") || _bHasMetadata)
-	{
-		pOutputFormat = av_guess_format("matroska", nullptr, nullptr);
-	}
-	else if(Filepath->EndsWith("mp4")) 
+	// Frames encoded meanwhile wait for the pre-roll to be written.
+	Monitor::Enter(m_PreRollLock);
+	try
 	{
-		pOutputFormat = av_guess_format("mp4", nullptr, nullptr);
+		if(m_SavingContext->bPreRolling)
+		{
+			log->Debug(String::Format("Recording triggered. Pre-roll: {0} frames, {1} bytes.", m_PreRollPackets->Count, m_iPreRollBytes));
+
+			result = OpenOutputFile(m_SavingContext);
+			if(result == SaveResult::Success)
+			{
+				m_SavingContext->bRebasePts = true;
+
+				for each(PreRollPacket^ packet in m_PreRollPackets)
+				{
+					if(!MuxFrame(packet->iSize, m_SavingContext, packet->pBuffer, packet->iPts, packet->iTimestamp, packet->bKeyframe))
+					{
+						result = SaveResult::FileNotWritten;
+						break;
+					}
+				}
+
+				FreePreRoll();
+
+				// Only now live packets go to the file, after the whole pre-roll.
+				m_SavingContext->bPreRolling = false;
+
+				if(m_SavingContext->iSegmentDuration > 0 || m_SavingContext->iSegmentSize > 0)
+				{
+					StartSegmentThread();
+				}
+			}
+		}
 	}
-	else
+	finally
 	{
-		pOutputFormat = av_guess_format("avi", nullptr, nullptr);
+		Monitor::Exit(m_PreRollLock);
 	}
 
-	return pOutputFormat;
+	return result;
 }
 
 ///<summary>
-/// VideoFileWriter::SetupMuxer
-/// Configure the Muxer with default parameters.
+/// VideoFileWriter::OpenRemuxContext
+/// Open a saving context that stores already compressed packets, without encoder.
+/// The output video stream takes the parameters of the input stream. Packets are then pushed with WritePacket.
 ///</summary>
-bool VideoFileWriter::SetupMuxer(SavingContext^ _SavingContext)
+SaveResult VideoFileWriter::OpenRemuxContext(String^ _FilePath, AVStream* _pInputStream, bool _bHasMetadata)
 {
-	bool bResult = true;
+	log->Debug("Opening the saving context for stream copy.");
+
+	SaveResult result = SaveResult::Success;
 
-	_SavingContext->pOutputFormatContext->oformat = _SavingContext->pOutputFormat;
+	if(m_SavingContext != nullptr) delete m_SavingContext;
 	
-	av_strlcpy(_SavingContext->pOutputFormatContext->filename, _SavingContext->pFilePath, sizeof(_SavingContext->pOutputFormatContext->filename));
-		
-	_SavingContext->pOutputFormatContext->timestamp = 0;
-		
-	_SavingContext->pOutputFormatContext->bit_rate = _SavingContext->iBitrate;
+	m_SavingContext = gcnew SavingContext();
+	m_SavingContext->pFilePath = static_cast<char*>(Marshal::StringToHGlobalAnsi(_FilePath).ToPointer());
+	m_SavingContext->bRemux = true;
+	m_SavingContext->iBitrate = _pInputStream->codec->bit_rate;
+	m_SavingContext->outputSize = Size(_pInputStream->codec->width, _pInputStream->codec->height);
 
-		
-	// Paramtres (par dfaut ?) du muxeur
-	AVFormatParameters	fpOutFile;
-	memset(&fpOutFile, 0, sizeof(AVFormatParameters));
-	if (av_set_parameters(_SavingContext->pOutputFormatContext, &fpOutFile) < 0)
+	do
 	{
-		log->Error("muxer parameters not set");
-		return false;
-	}
+		// 1. Muxer selection.
+		if ((m_SavingContext->pOutputFormat = VideoFileWriter::GuessOutputFormat(_FilePath, _bHasMetadata)) == nullptr) 
+		{
+			result = SaveResult::MuxerNotFound;
+			log->Error("Muxer not found");
+			break;
+		}
 
-	// ?
-	_SavingContext->pOutputFormatContext->preload   = (int)(0.5 * AV_TIME_BASE);
-	_SavingContext->pOutputFormatContext->max_delay = (int)(0.7 * AV_TIME_BASE); 
+		// 2. Allocate muxer parameters object.
+		if ((m_SavingContext->pOutputFormatContext = avformat_alloc_context()) == nullptr) 
+		{
+			result = SaveResult::MuxerParametersNotAllocated;
+			log->Error("Muxer parameters object not allocated");
+			break;
+		}
+		
+		// 3. Configure muxer.
+		if(!SetupMuxer(m_SavingContext))
+		{
+			result = SaveResult::MuxerParametersNotSet;
+			log->Error("Muxer parameters not set");
+			break;
+		}
 
-	return bResult;
-}
+		// 4. Create video stream.
+		if ((m_SavingContext->pOutputVideoStream = av_new_stream(m_SavingContext->pOutputFormatContext, 0)) == nullptr) 
+		{
+			result = SaveResult::VideoStreamNotCreated;
+			log->Error("Video stream not created");
+			break;
+		}
 
-///<summary>
-/// VideoFileWriter::SetupEncoder
-/// Configure the codec with default parameters.
-///</summary>
-bool VideoFileWriter::SetupEncoder(SavingContext^ _SavingContext)
-{
-	//----------------------------------------
-	// Parameters for encoding.
-	// some tweaked, some taken from Mencoder.
-	// Not all clear...
-	//----------------------------------------
+		// 5. Copy the codec parameters of the input stream. (-vcodec copy)
+		AVCodecContext* pCodecContext = m_SavingContext->pOutputVideoStream->codec;
+		if(avcodec_copy_context(pCodecContext, _pInputStream->codec) < 0)
+		{
+			result = SaveResult::EncoderParametersNotSet;
+			log->Error("Codec parameters not copied");
+			break;
+		}
 
-	// TODO:
-	// Implement from ref: http://www.mplayerhq.hu/DOCS/HTML/en/menc-feat-dvd-mpeg4.html
+		m_SavingContext->pOutputCodecContext = pCodecContext;
+		pCodecContext->coded_frame = nullptr;
 
+		// Keep the input fourcc only if the output container maps it to the same codec. 
+		AVOutputFormat* pOutputFormat = m_SavingContext->pOutputFormat;
+		if(pOutputFormat->codec_tag != nullptr && av_codec_get_id(pOutputFormat->codec_tag, pCodecContext->codec_tag) != pCodecContext->codec_id)
+		{
+			pCodecContext->codec_tag = 0;
+		}
 
-	log->Debug("Setting up the encoder.");
+		// The frame rate of the input stream is more reliable than its codec time base. (Which may be a field rate).
+		if(_pInputStream->r_frame_rate.num > 0 && _pInputStream->r_frame_rate.den > 0)
+		{
+			pCodecContext->time_base = av_inv_q(_pInputStream->r_frame_rate);
+		}
 
-	// Codec.
-	// Equivalent to : -vcodec mpeg4
-	_SavingContext->pOutputCodecContext->codec_id = _SavingContext->pOutputCodec->id;
-	_SavingContext->pOutputCodecContext->codec_type = AVMEDIA_TYPE_VIDEO;
+		if(_pInputStream->sample_aspect_ratio.num > 0)
+		{
+			pCodecContext->sample_aspect_ratio = _pInputStream->sample_aspect_ratio;
+		}
+		m_SavingContext->pOutputVideoStream->sample_aspect_ratio = pCodecContext->sample_aspect_ratio;
 
-	// By default the fourcc is 'FMP4' but Windows Media Player doesn't recognize it.
-	// We'll force to 'XVID' fourcc. (similar as -vtag XVID) even if it wasn't the XviD codec that encoded the video :-(
-	_SavingContext->pOutputCodecContext->codec_tag = ('D'<<24) + ('I'<<16) + ('V'<<8) + 'X';
+		if(pOutputFormat->flags & AVFMT_GLOBALHEADER)
+		{
+			pCodecContext->flags |= CODEC_FLAG_GLOBAL_HEADER;
+		}
 
-	// The average bitrate (unused for constant quantizer encoding.)
-	// Source: statically fixed to 25Mb/s for now. 
-	_SavingContext->pOutputCodecContext->bit_rate = _SavingContext->iBitrate;
+		// 6. Metadata.
+		if(_bHasMetadata && !SetupMetadataStream(m_SavingContext))
+		{
+			result = SaveResult::MetadataStreamNotCreated;
+			log->Error("metadata stream not created");
+			break;
+		}
 
-	// Number of bits the bitstream is allowed to diverge from the reference.
-    // the reference can be CBR (for CBR pass1) or VBR (for pass2)
-	// Source: Avidemux.
-	_SavingContext->pOutputCodecContext->bit_rate_tolerance = 8000000;
+		int iFFMpegResult;
 
-	// Motion estimation algorithm used for video coding. 
-	// src: MEncoder.
-	_SavingContext->pOutputCodecContext->me_method = ME_EPZS;
+		// 7. Open the file.
+		if ((iFFMpegResult = url_fopen(&(m_SavingContext->pOutputFormatContext)->pb, m_SavingContext->pFilePath, URL_WRONLY)) < 0) 
+		{
+			result = SaveResult::FileNotOpened;
+			log->Error(String::Format("File not opened, AVERROR:{0}", iFFMpegResult));
+			break;
+		}
 
-	// Framerate - timebase.
-	// Certains codecs (MPEG1/2) ne supportent qu'un certain nombre restreints de framerates.
-	// src [kinovea]
-	if(_SavingContext->fFramesInterval == 0)
-		_SavingContext->fFramesInterval = 40;
+		// 8. Write file header.
+		SanityCheck(m_SavingContext->pOutputFormatContext);
+		if((iFFMpegResult = av_write_header(m_SavingContext->pOutputFormatContext)) < 0)
+		{
+			result = SaveResult::FileHeaderNotWritten;
+			log->Error(String::Format("File header not written, AVERROR:{0}", iFFMpegResult));
+			break;
+		}
+	}
+	while(false);
 
-	int iTimebase = (int)Math::Round(1000000.0f / _SavingContext->fFramesInterval);
+	return result;
+}
 
-	// Examples : 25000, 30000, 29970.
-	// Treat some special cases and use rounding for the others.
-	if(iTimebase == 29970)
+///<summary>
+/// VideoFileWriter::CanRemux
+/// Check whether packets of the input stream can be copied as is into the file.
+///</summary>
+bool VideoFileWriter::CanRemux(String^ _FilePath, AVCodecContext* _pInputCodecContext, bool _bHasMetadata)
+{
+	av_register_all();
+
+	AVOutputFormat* pOutputFormat = GuessOutputFormat(_FilePath, _bHasMetadata);
+	if(pOutputFormat == nullptr || _pInputCodecContext->codec_id == CODEC_ID_NONE)
+		return false;
+
+	if(!IsCodecSupportedByMuxer(pOutputFormat, _pInputCodecContext->codec_id))
 	{
-		log->Debug(String::Format("Pushing special timebase: 30000:1001"));
-		_SavingContext->pOutputCodecContext->time_base.den			= 30000;
-		_SavingContext->pOutputCodecContext->time_base.num			= 1001;
+		log->Debug(String::Format("Stream copy not possible, codec not supported by the {0} muxer.", gcnew String(pOutputFormat->name)));
+		return false;
 	}
-	else if(iTimebase == 24975)
+
+	// H.264 from MPEG-TS or AVI carries its parameter sets in-band, 
+	// MKV and MP4 need them in the global header and we have no bitstream filter in this path.
+	if((pOutputFormat->flags & AVFMT_GLOBALHEADER) && _pInputCodecContext->codec_id == CODEC_ID_H264 && _pInputCodecContext->extradata_size == 0)
 	{
-		log->Debug(String::Format("Pushing special timebase: 25000:1001"));
-		_SavingContext->pOutputCodecContext->time_base.den			= 25000;
-		_SavingContext->pOutputCodecContext->time_base.num			= 1001;
+		log->Debug("Stream copy not possible, H.264 stream without global header.");
+		return false;
 	}
-	else
+
+	return true;
+}
+
+///<summary>
+/// VideoFileWriter::WritePacket
+/// Stream copy mode. Commit an already compressed packet from the input file.
+/// Timestamps are shifted so the output starts at 0, and rescaled to the output stream time base.
+///</summary>
+SaveResult VideoFileWriter::WritePacket(AVPacket* _pPacket, AVRational _timeBase)
+{
+	bool bSpliceHeader = false;
+
+	if(m_SavingContext->pRenderCodecContext != nullptr && m_SavingContext->pOutputCodecContext->codec_id == CODEC_ID_MPEG4 && (_pPacket->flags & AV_PKT_FLAG_KEY))
 	{
-		iTimebase = (int)Math::Round((double)iTimebase / 1000);
-		log->Debug(String::Format("Pushing timebase: {0}:1", iTimebase));
-		_SavingContext->pOutputCodecContext->time_base.den			= iTimebase;
-		_SavingContext->pOutputCodecContext->time_base.num			= 1;
+		int iHeaderSize = GetMpeg4HeaderSize(_pPacket->data, _pPacket->size);
+
+		// Keep the configuration of the copied stream, from the global header or from its first keyframe.
+		if(m_SavingContext->pStreamHeader == nullptr)
+		{
+			AVCodecContext* pCodecContext = m_SavingContext->pOutputCodecContext;
+			uint8_t* pHeader = (pCodecContext->extradata_size > 0) ? pCodecContext->extradata : _pPacket->data;
+			int iSize = (pCodecContext->extradata_size > 0) ? pCodecContext->extradata_size : iHeaderSize;
+			if(iSize > 0 && IsMpeg4Header(pHeader, iSize))
+			{
+				m_SavingContext->pStreamHeader = (uint8_t*)av_malloc(iSize);
+				memcpy(m_SavingContext->pStreamHeader, pHeader, iSize);
+				m_SavingContext->iStreamHeaderSize = iSize;
+			}
+		}
+
+		// The re-encoded frames carried their own configuration, the decoder must be switched back.
+		bSpliceHeader = m_SavingContext->bStreamHeaderNeeded && iHeaderSize == 0 && m_SavingContext->iStreamHeaderSize > 0;
+	}
+
+	m_SavingContext->bStreamHeaderNeeded = false;
+
+	if(!bSpliceHeader)
+		return MuxPacket(_pPacket, _timeBase);
+	
+	int iHeaderSize = m_SavingContext->iStreamHeaderSize;
+	uint8_t* pSplicedData = (uint8_t*)av_malloc(iHeaderSize + _pPacket->size + FF_INPUT_BUFFER_PADDING_SIZE);
+	memcpy(pSplicedData, m_SavingContext->pStreamHeader, iHeaderSize);
+	memcpy(pSplicedData + iHeaderSize, _pPacket->data, _pPacket->size);
+	memset(pSplicedData + iHeaderSize + _pPacket->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+
+	AVPacket SplicedPacket = *_pPacket;
+	SplicedPacket.data = pSplicedData;
+	SplicedPacket.size = iHeaderSize + _pPacket->size;
+	
+	SaveResult result = MuxPacket(&SplicedPacket, _timeBase);
+	av_free(pSplicedData);
+	return result;
+}
+
+///<summary>
+/// VideoFileWriter::MuxPacket
+/// Common part of stream copy and smart rendering. Rebase the timestamps and hand the packet to the muxer.
+///</summary>
+SaveResult VideoFileWriter::MuxPacket(AVPacket* _pPacket, AVRational _timeBase)
+{
+	if(m_SavingContext->iRemuxStartTimestamp == AV_NOPTS_VALUE)
+	{
+		int64_t iStart = (_pPacket->dts != AV_NOPTS_VALUE) ? _pPacket->dts : _pPacket->pts;
+		m_SavingContext->iRemuxStartTimestamp = (iStart != AV_NOPTS_VALUE) ? iStart : 0;
 	}
+
+	int64_t iStart = m_SavingContext->iRemuxStartTimestamp;
+	AVRational outputTimeBase = m_SavingContext->pOutputVideoStream->time_base;
+
+	// Shallow copy, the data still belongs to the input packet.
+	AVPacket OutputPacket = *_pPacket;
+	OutputPacket.stream_index = m_SavingContext->pOutputVideoStream->index;
+	OutputPacket.pos = -1;
+
+	if(_pPacket->pts != AV_NOPTS_VALUE)
+		OutputPacket.pts = av_rescale_q(_pPacket->pts - iStart, _timeBase, outputTimeBase);
 	
-	// Picture width / height.
-	// If we are transcoding from a video, this will be the same as the input size.
-	// (not the decoding size).
-	// src: [kinovea]
-	_SavingContext->pOutputCodecContext->width				= _SavingContext->outputSize.Width;
-	_SavingContext->pOutputCodecContext->height				= _SavingContext->outputSize.Height;
+	if(_pPacket->dts != AV_NOPTS_VALUE)
+		OutputPacket.dts = av_rescale_q(_pPacket->dts - iStart, _timeBase, outputTimeBase);
 	
+	OutputPacket.duration = (int)av_rescale_q(_pPacket->duration, _timeBase, outputTimeBase);
+
+	int64_t iWriteStart = Stopwatch::GetTimestamp();
+	int iWriteRes = av_write_frame(m_SavingContext->pOutputFormatContext, &OutputPacket);
+	Interlocked::Add(m_SavingContext->stats->iWriteTicks, Stopwatch::GetTimestamp() - iWriteStart);
+	TraceRecorder::Span("Write", "VideoFileWriter", iWriteStart);
+	Interlocked::Increment(m_SavingContext->stats->iPackets);
+	Interlocked::Add(m_SavingContext->stats->iBytes, _pPacket->size);
+	if(iWriteRes < 0)
+	{
+		log->Error(String::Format("Packet not written, AVERROR:{0}", iWriteRes));
+		return SaveResult::UnknownError;
+	}
 
-	//-------------------------------------------------------------------------------------------
-	// Mode d'encodage (i, b, p frames)
-	//
-	// gop_size		: the number of pictures in a group of pictures, or 0 for intra_only. (default : 12)
-	// max_b_frames	: maximum number of B-frames between non-B-frames (default : 0)
-	//				  Note: The output will be delayed by max_b_frames+1 relative to the input.
-	//
-	// [kinovea]	: Intra only so we can always access prev frame right away in the Player.
-	// [kinovea]	: Player doesn't support B-frames.
-	//-------------------------------------------------------------------------------------------
-	_SavingContext->pOutputCodecContext->gop_size				= 0;	
-	_SavingContext->pOutputCodecContext->max_b_frames			= 0;								
+	return SaveResult::Success;
+}
 
-	// Pixel format
-	// src:ffmpeg.
-	_SavingContext->pOutputCodecContext->pix_fmt = PIX_FMT_YUV420P; 	
+///<summary>
+/// VideoFileWriter::CanSmartRender
+/// Check whether frames of the input stream can be replaced by re-encoded ones while the others are copied.
+/// Must be called after CanRemux.
+///</summary>
+bool VideoFileWriter::CanSmartRender(AVCodecContext* _pInputCodecContext)
+{
+	// Re-encoded frames are all intra, they can only be spliced between copied frames if nothing 
+	// references across them. Without B-frames, a GOP only depends on itself.
+	if(_pInputCodecContext->has_b_frames > 0)
+	{
+		log->Debug("Smart rendering not possible, stream has B-frames.");
+		return false;
+	}
 
+	// Codecs for which our encoder produces a stream the input decoder configuration can switch to and back.
+	if(_pInputCodecContext->codec_id != CODEC_ID_MPEG4 && _pInputCodecContext->codec_id != CODEC_ID_MJPEG)
+	{
+		log->Debug("Smart rendering not possible, codec not supported.");
+		return false;
+	}
 
-	// Frame rate emulation. If not zero, the lower layer (i.e. format handler) has to read frames at native frame rate.
-	// src: ?
-	// ->rate_emu
+	// The global header is spliced back in front of the copied keyframes after rendered ones.
+	if(_pInputCodecContext->codec_id == CODEC_ID_MPEG4 && _pInputCodecContext->extradata_size > 0 && 
+		!IsMpeg4Header(_pInputCodecContext->extradata, _pInputCodecContext->extradata_size))
+	{
+		log->Debug("Smart rendering not possible, MPEG-4 global header not recognized.");
+		return false;
+	}
 
+	AVCodec* pCodec = avcodec_find_encoder(_pInputCodecContext->codec_id);
+	if(pCodec == nullptr)
+		return false;
 
-	// Quality/Technique of encoding.
-	//_pOutputCodecContext->flags |= ;			// CODEC_FLAG_QSCALE : Constant Quantization = Best quality but innacceptably high file sizes.
-	_SavingContext->pOutputCodecContext->qcompress = 0.5;		// amount of qscale change between easy & hard scenes (0.0-1.0) 
-    _SavingContext->pOutputCodecContext->qblur = 0.5;			// amount of qscale smoothing over time (0.0-1.0)
-	_SavingContext->pOutputCodecContext->qmin = 2;				// minimum quantizer (def:2)
-	_SavingContext->pOutputCodecContext->qmax = 16;			// maximum quantizer (def:31)
-	_SavingContext->pOutputCodecContext->max_qdiff = 3;		// maximum quantizer difference between frames (def:3)
-	_SavingContext->pOutputCodecContext->mpeg_quant = 0;		// 0 -> h263 quant, 1 -> mpeg quant. (def:0)
-	//_pOutputCodecContext->b_quant_factor (qscale factor between IP and B-frames)
+	if(pCodec->pix_fmts != nullptr)
+	{
+		for(const enum PixelFormat* p = pCodec->pix_fmts; *p != PIX_FMT_NONE; p++)
+		{
+			if(*p == _pInputCodecContext->pix_fmt)
+				return true;
+		}
+
+		log->Debug("Smart rendering not possible, pixel format not supported by the encoder.");
+		return false;
+	}
+
+	return true;
+}
+
+///<summary>
+/// VideoFileWriter::OpenRenderEncoder
+/// Smart rendering. Open an intra only encoder matching the stream opened by OpenRemuxContext.
+/// Rendered frames are then pushed with RenderPacket, in between the packets pushed with WritePacket.
+///</summary>
+SaveResult VideoFileWriter::OpenRenderEncoder()
+{
+	AVCodecContext* pStreamContext = m_SavingContext->pOutputCodecContext;
+	
+	AVCodec* pCodec = avcodec_find_encoder(pStreamContext->codec_id);
+	if(pCodec == nullptr)
+	{
+		log->Error("Render encoder not found");
+		return SaveResult::EncoderNotFound;
+	}
+
+	AVCodecContext* pCodecContext = avcodec_alloc_context();
+	if(pCodecContext == nullptr)
+	{
+		log->Error("Render encoder parameters object not allocated");
+		return SaveResult::EncoderParametersNotAllocated;
+	}
+
+	pCodecContext->codec_id = pStreamContext->codec_id;
+	pCodecContext->codec_type = AVMEDIA_TYPE_VIDEO;
+	pCodecContext->width = pStreamContext->width;
+	pCodecContext->height = pStreamContext->height;
+	pCodecContext->pix_fmt = pStreamContext->pix_fmt;
+	pCodecContext->sample_aspect_ratio = pStreamContext->sample_aspect_ratio;
+
+	// MPEG-4 can't code time bases with a denominator above 16 bits.
+	pCodecContext->time_base = pStreamContext->time_base;
+	av_reduce(&pCodecContext->time_base.num, &pCodecContext->time_base.den, pCodecContext->time_base.num, pCodecContext->time_base.den, 65535);
+
+	// Intra only at high constant quality, these frames stand in for originals.
+	// No global header: the file header holds the configuration of the copied stream, 
+	// so each rendered keyframe must carry its own.
+	pCodecContext->gop_size = 0;
+	pCodecContext->max_b_frames = 0;
+	pCodecContext->flags |= CODEC_FLAG_QSCALE;
+	pCodecContext->global_quality = FF_QP2LAMBDA * 2;
+	pCodecContext->qmin = 2;
+	pCodecContext->qmax = 31;
+	pCodecContext->strict_std_compliance = -1;
+	pCodecContext->thread_count = GetEncoderThreads(pCodecContext, m_iEncoderThreads);
+
+	if(avcodec_open(pCodecContext, pCodec) < 0)
+	{
+		log->Error("Render encoder not opened");
+		av_free(pCodecContext);
+		return SaveResult::EncoderNotOpened;
+	}
+
+	m_SavingContext->pRenderCodecContext = pCodecContext;
+	return SaveResult::Success;
+}
+
+///<summary>
+/// VideoFileWriter::RenderPacket
+/// Smart rendering. Encode an image as a keyframe and commit it at the place of an input packet.
+/// The timestamp and duration are those of the replaced packet, in the input stream time base.
+///</summary>
+SaveResult VideoFileWriter::RenderPacket(Bitmap^ _image, int64_t _iTimestamp, int _iDuration, AVRational _timeBase)
+{
+	AVCodecContext* pCodecContext = m_SavingContext->pRenderCodecContext;
+	if(pCodecContext == nullptr)
+		return SaveResult::EncoderNotOpened;
+
+	SaveResult result = SaveResult::Success;
+	AVFrame* pFrame = nullptr;
+	uint8_t* pFrameBuffer = nullptr;
+	uint8_t* pOutputBuffer = nullptr;
+
+	enum PixelFormat pixelFormatFFmpeg = GetBitmapPixelFormat(_image->PixelFormat);
+	if(pixelFormatFFmpeg == PIX_FMT_NONE)
+	{
+		log->Error(String::Format("unsupported bitmap pixel format: {0}", _image->PixelFormat));
+		return SaveResult::InvalidInputFrame;
+	}
+
+	Rectangle rect = Rectangle(0, 0, _image->Width, _image->Height);
+	System::Drawing::Imaging::BitmapData^ InputDataBitmap = _image->LockBits(rect, Imaging::ImageLockMode::ReadOnly, _image->PixelFormat);
+
+	do
+	{
+		if((pFrame = avcodec_alloc_frame()) == nullptr)
+		{
+			result = SaveResult::InputFrameNotAllocated;
+			break;
+		}
+
+		int iFrameBufferSize = avpicture_get_size(pCodecContext->pix_fmt, pCodecContext->width, pCodecContext->height);
+		if((pFrameBuffer = (uint8_t*)av_malloc(iFrameBufferSize)) == nullptr)
+		{
+			result = SaveResult::InputFrameNotAllocated;
+			break;
+		}
+		Interlocked::Add(m_SavingContext->stats->iAllocations, 2);
+		
+		avpicture_fill((AVPicture *)pFrame, pFrameBuffer, pCodecContext->pix_fmt, pCodecContext->width, pCodecContext->height);
+
+		// Back to the coded size and pixel format. (The image is at decoding size.)
+		uint8_t* pPlanes[4] = { (uint8_t*)InputDataBitmap->Scan0.ToPointer(), nullptr, nullptr, nullptr };
+		int iStrides[4] = { InputDataBitmap->Stride, 0, 0, 0 };
+		int64_t iConvertStart = Stopwatch::GetTimestamp();
+		// The scaling contexts are kept from one rendered frame to the next.
+		if(!RepackPicture(pPlanes, iStrides, _image->Width, _image->Height, pixelFormatFFmpeg, pFrame, pCodecContext->width, pCodecContext->height, pCodecContext->pix_fmt) &&
+			!m_SavingContext->scaler->Scale(pPlanes, iStrides, _image->Width, _image->Height, pixelFormatFFmpeg, 
+				pFrame->data, pFrame->linesize, pCodecContext->width, pCodecContext->height, pCodecContext->pix_fmt, SWS_BICUBIC))
+		{
+			log->Error("scaling failed");
+			result = SaveResult::InvalidInputFrame;
+			break;
+		}
+		Interlocked::Add(m_SavingContext->stats->iConvertTicks, Stopwatch::GetTimestamp() - iConvertStart);
+		TraceRecorder::Span("Convert", "VideoFileWriter", iConvertStart);
+
+		// The encoder requires strictly increasing timestamps.
+		if(m_SavingContext->iRemuxStartTimestamp == AV_NOPTS_VALUE)
+		{
+			m_SavingContext->iRemuxStartTimestamp = _iTimestamp;
+		}
+		int64_t iPts = av_rescale_q(_iTimestamp - m_SavingContext->iRemuxStartTimestamp, _timeBase, pCodecContext->time_base);
+		iPts = Math::Max(iPts, m_SavingContext->iLastRenderPts + 1);
+		m_SavingContext->iLastRenderPts = iPts;
+
+		pFrame->pts = iPts;
+		pFrame->pict_type = FF_I_TYPE;
+		pFrame->quality = pCodecContext->global_quality;
+
+		int iOutputBufferSize = 4 * pCodecContext->width * pCodecContext->height;
+		if((pOutputBuffer = (uint8_t*)av_malloc(iOutputBufferSize)) == nullptr)
+		{
+			log->Error("output video buffer not allocated");
+			result = SaveResult::UnknownError;
+			break;
+		}
+		Interlocked::Increment(m_SavingContext->stats->iAllocations);
+
+		int64_t iEncodeStart = Stopwatch::GetTimestamp();
+		int iEncodedSize = avcodec_encode_video(pCodecContext, pOutputBuffer, iOutputBufferSize, pFrame);
+		Interlocked::Add(m_SavingContext->stats->iEncodeTicks, Stopwatch::GetTimestamp() - iEncodeStart);
+		TraceRecorder::Span("Encode", "VideoFileWriter", iEncodeStart);
+		Interlocked::Increment(m_SavingContext->stats->iFrames);
+		if(iEncodedSize <= 0)
+		{
+			log->Error("Rendered frame not encoded");
+			result = SaveResult::UnknownError;
+			break;
+		}
+
+		AVPacket RenderedPacket;
+		av_init_packet(&RenderedPacket);
+		RenderedPacket.data = pOutputBuffer;
+		RenderedPacket.size = iEncodedSize;
+		RenderedPacket.pts = _iTimestamp;
+		RenderedPacket.dts = _iTimestamp;
+		RenderedPacket.duration = _iDuration;
+		RenderedPacket.flags |= AV_PKT_FLAG_KEY;
+
+		result = MuxPacket(&RenderedPacket, _timeBase);
+		m_SavingContext->bStreamHeaderNeeded = true;
+	}
+	while(false);
+
+	_image->UnlockBits(InputDataBitmap);
+
+	if(pOutputBuffer != nullptr) av_free(pOutputBuffer);
+	if(pFrameBuffer != nullptr) av_free(pFrameBuffer);
+	if(pFrame != nullptr) av_free(pFrame);
+
+	return result;
+}
+
+///<summary>
+/// VideoFileWriter::GetMpeg4HeaderSize
+/// Size of the configuration headers (VOS, VO, VOL, GOV) at the start of an MPEG-4 packet, 0 if there are none.
+///</summary>
+int VideoFileWriter::GetMpeg4HeaderSize(uint8_t* _pData, int _iSize)
+{
+	// The picture itself starts with the VOP start code.
+	for(int i = 0; i + 3 < _iSize; i++)
+	{
+		if(_pData[i] == 0x00 && _pData[i+1] == 0x00 && _pData[i+2] == 0x01 && _pData[i+3] == 0xB6)
+		{
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+///<summary>
+/// VideoFileWriter::IsMpeg4Header
+/// Whether the data starts with a configuration start code: VOS (0xB0), VO (0x00-0x1F) or VOL (0x20-0x2F).
+///</summary>
+bool VideoFileWriter::IsMpeg4Header(uint8_t* _pData, int _iSize)
+{
+	if(_iSize < 4 || _pData[0] != 0x00 || _pData[1] != 0x00 || _pData[2] != 0x01)
+		return false;
+
+	return _pData[3] == 0xB0 || _pData[3] <= 0x2F;
+}
+
+///<summary>
+/// VideoFileWriter::SetupMetadataStream
+/// Create the subtitle stream that will hold the xml metadata.
+///</summary>
+bool VideoFileWriter::SetupMetadataStream(SavingContext^ _SavingContext)
+{
+	log->Debug("Muxing metadata into a subtitle stream.");
+
+	// Create metadata stream.
+	if ((_SavingContext->pOutputDataStream = av_new_stream(_SavingContext->pOutputFormatContext, 1)) == nullptr) 
+	{
+		return false;
+	}
+
+	// Get default configuration for subtitle streams.
+	// (Will allocate pointed CodecCtx)
+	avcodec_get_context_defaults2(_SavingContext->pOutputDataStream->codec, AVMEDIA_TYPE_SUBTITLE);
+	
+	// Identify codec. Will show as "S_TEXT/UTF8" for Matroska.
+	_SavingContext->pOutputDataStream->codec->codec_id = CODEC_ID_TEXT;
+
+	// ISO 639 code for subtitle language. ( -> en.wikipedia.org/wiki/List_of_ISO_639-3_codes)	 
+	// => "Malaysian Sign Language" code is "XML" :-)
+	av_metadata_set2(&_SavingContext->pOutputDataStream->metadata, "language", "XML", 0);
+
+	return true;
+}
+
+void VideoFileWriter::SanityCheck(AVFormatContext* s)
+{
+	// Taken/Adapted from the real sanity check from utils.c av_write_header.
+
+	if (s->nb_streams == 0) 
+	{
+		log->Error("VideoFileWriter sanity check failed:no streams.");
+    }
+
+	AVStream *st;
+    for(unsigned int i=0;i < s->nb_streams;i++) 
+	{
+        st = s->streams[i];
+
+        switch (st->codec->codec_type) 
+		{
+			case AVMEDIA_TYPE_VIDEO:
+				if(st->codec->time_base.num <= 0 || st->codec->time_base.den <= 0)
+				{ 
+					log->Error("VideoFileWriter sanity check failed: time base not set.");
+				}
+				if(st->codec->width <= 0 || st->codec->height <= 0)
+				{
+					log->Error("VideoFileWriter sanity check failed: dimensions not set.");
+				}
+				if(av_cmp_q(st->sample_aspect_ratio, st->codec->sample_aspect_ratio))
+				{
+					log->Error("VideoFileWriter sanity check failed: Aspect ratio mismatch between encoder and muxer layer.");
+					log->Debug(String::Format("stream SAR={0}:{1}, codec SAR:{2}:{3}", 
+						st->sample_aspect_ratio.num, st->sample_aspect_ratio.den, st->codec->sample_aspect_ratio.num, st->codec->sample_aspect_ratio.den));
+				}
+				break;
+		}
 
+        if(s->oformat->flags & AVFMT_GLOBALHEADER && !(st->codec->flags & CODEC_FLAG_GLOBAL_HEADER))
+		{
+			log->Debug("VideoFileWriter sanity check warning: Codec does not use global headers but container format requires global headers");
+		}
+    }
+}
+
+///<summary>
+/// VideoFileWriter::CloseSavingContext
+/// Close the saving context and free any allocated resources.
+///</summary>
+SaveResult VideoFileWriter::CloseSavingContext(bool _bEncodingSuccess)
+{
+	log->Debug("Closing the saving context.");
+
+	SaveResult result = SaveResult::Success;
+
+	// Let the frames already accepted reach the file.
+	StopPipeline();
+
+	// Segmented recording: wait for the previous file to be finalized and drop the one opened in advance.
+	if(m_SegmentThread != nullptr)
+	{
+		m_SegmentThread->Join();
+		m_SegmentThread = nullptr;
+	}
+
+	if(m_SavingContext->pNextFormatContext != nullptr)
+	{
+		String^ nextPath = gcnew String(m_SavingContext->pNextFormatContext->filename);
+		CloseSegmentFile(m_SavingContext->pNextFormatContext, m_SavingContext->pOutputCodecContext, true);
+		m_SavingContext->pNextFormatContext = nullptr;
+		
+		try
+		{
+			File::Delete(nextPath);
+		}
+		catch(Exception^)
+		{
+			log->Error(String::Format("Unused segment not deleted: {0}", nextPath));
+		}
+	}
+
+	// Pre-roll never triggered: there is no file.
+	if(_bEncodingSuccess && !m_SavingContext->bPreRolling)
+	{
+		// Write file trailer.		
+		av_write_trailer(m_SavingContext->pOutputFormatContext);
+	}
+
+	FreePreRoll();
+
+	if(m_SavingContext->bEncoderOpened)
+	{
+		avcodec_close(m_SavingContext->pOutputCodecContext);
+	
+		// Free the InputFrame holder
+		av_free(m_SavingContext->pInputFrame);
+	}
+
+	FreePipeline();
+
+	m_SavingContext->scaler->Release();
+
+	// Smart rendering.
+	if(m_SavingContext->pRenderCodecContext != nullptr)
+	{
+		avcodec_close(m_SavingContext->pRenderCodecContext);
+		av_free(m_SavingContext->pRenderCodecContext);
+		m_SavingContext->pRenderCodecContext = nullptr;
+	}
+
+	if(m_SavingContext->pStreamHeader != nullptr)
+	{
+		av_free(m_SavingContext->pStreamHeader);
+		m_SavingContext->pStreamHeader = nullptr;
+	}
+		
+	Marshal::FreeHGlobal(safe_cast<IntPtr>(m_SavingContext->pFilePath));
+
+	// Stream copy: the codec parameters were deep copied from the input.
+	if(m_SavingContext->bRemux && m_SavingContext->pOutputVideoStream != nullptr)
+	{
+		FreeCodecCopy(m_SavingContext->pOutputVideoStream->codec);
+	}
+
+	if(m_SavingContext->pEncoderSnapshot != nullptr)
+	{
+		FreeCodecCopy(m_SavingContext->pEncoderSnapshot);
+		av_free(m_SavingContext->pEncoderSnapshot);
+		m_SavingContext->pEncoderSnapshot = nullptr;
+	}
+	
+	// Stream release (equivalent to freeing pOutputCodec + pOutputVideoStream)
+	// After a rotation the streams hold copies of the encoder parameters and the encoder is released on its own.
+	for(int i = 0; i < (int)m_SavingContext->pOutputFormatContext->nb_streams; i++) 
+	{
+		if(m_SavingContext->iSegmentIndex > 0)
+		{
+			FreeCodecCopy(m_SavingContext->pOutputFormatContext->streams[i]->codec);
+		}
+
+		av_freep(&(m_SavingContext->pOutputFormatContext)->streams[i]->codec);
+		av_freep(&(m_SavingContext->pOutputFormatContext)->streams[i]);
+	}
+
+	if(m_SavingContext->iSegmentIndex > 0)
+	{
+		av_free(m_SavingContext->pOutputCodecContext);
+		m_SavingContext->pOutputCodecContext = nullptr;
+	}
+
+	// Close file.
+	if(!CloseOutputIO(m_SavingContext->pOutputFormatContext) || m_SavingContext->bWriteError)
+	{
+		log->Error("The file was not completely written.");
+		result = SaveResult::FileNotWritten;
+	}
+
+	// Release muxer parameter object.
+	av_free(m_SavingContext->pOutputFormatContext);
+
+	// release pOutputFormat ?
+
+	log->Debug("Saving video completed.");
+
+	return result;
+}
+
+
+///<summary>
+/// VideoFileWriter::SaveFrame
+/// Save a single bitmap in the file opened in a previous call to OpenSaving context.
+/// The frame is placed in the next frame slot.
+///</summary>
+SaveResult VideoFileWriter::SaveFrame(Bitmap^ _image)
+{
+	return SaveFrame(_image, -1);
+}
+
+///<summary>
+/// VideoFileWriter::SaveFrame
+/// Save a single bitmap at the given capture time, in microseconds since the start of the recording.
+/// Late frames keep their real position in the file instead of compressing the timeline.
+///</summary>
+SaveResult VideoFileWriter::SaveFrame(Bitmap^ _image, int64_t _iTimestamp)
+{
+	return SaveFrame(_image, _iTimestamp, 1);
+}
+
+///<summary>
+/// VideoFileWriter::SaveFrame
+/// Save a bitmap that stays on screen for _iDuration frame slots (slow motion, paused key images).
+/// The image is converted and encoded once, the following frames continue after it.
+///</summary>
+SaveResult VideoFileWriter::SaveFrame(Bitmap^ _image, int64_t _iTimestamp, int _iDuration)
+{
+	enum PixelFormat pixelFormatFFmpeg = GetBitmapPixelFormat(_image->PixelFormat);
+	if(pixelFormatFFmpeg == PIX_FMT_NONE)
+	{
+		log->Error(String::Format("unsupported bitmap pixel format: {0}", _image->PixelFormat));
+		return SaveResult::InvalidInputFrame;
+	}
+
+	Rectangle rect = Rectangle(0, 0, _image->Width, _image->Height);
+	System::Drawing::Imaging::BitmapData^ InputDataBitmap = _image->LockBits(rect, Imaging::ImageLockMode::ReadOnly, _image->PixelFormat);
+	
+	// Scan0 is the top row. The stride includes the padding, and is negative for bottom-up bitmaps.
+	uint8_t* pPlanes[4] = { (uint8_t*)InputDataBitmap->Scan0.ToPointer(), nullptr, nullptr, nullptr };
+	int iStrides[4] = { InputDataBitmap->Stride, 0, 0, 0 };
+
+	SaveResult result = SaveFrame(pPlanes, iStrides, _image->Width, _image->Height, pixelFormatFFmpeg, _iTimestamp, _iDuration);
+
+	_image->UnlockBits(InputDataBitmap);
+
+	if(!m_SavingContext->bPipelined)
+	{
+		// (Temporary) fix to OOM error that sometimes happen with very large image size.
+		GC::Collect();
+	}
+
+	return result;
+}
+
+///<summary>
+/// VideoFileWriter::GetBitmapPixelFormat
+/// FFmpeg layout of the bitmap formats we can read directly, PIX_FMT_NONE for the others.
+/// The fourth byte of 32 bit formats is ignored by the encoding.
+///</summary>
+enum PixelFormat VideoFileWriter::GetBitmapPixelFormat(Imaging::PixelFormat _format)
+{
+	switch(_format)
+	{
+		case Imaging::PixelFormat::Format24bppRgb:
+			return PIX_FMT_BGR24;
+		case Imaging::PixelFormat::Format32bppRgb:
+		case Imaging::PixelFormat::Format32bppArgb:
+		case Imaging::PixelFormat::Format32bppPArgb:
+			return PIX_FMT_BGRA;
+		default:
+			return PIX_FMT_NONE;
+	}
+}
+
+///<summary>
+/// VideoFileWriter::SaveFrame
+/// Save a single frame given as raw planes, without going through a Bitmap.
+/// Strides are in bytes. The timestamp is in microseconds since the start of the recording, negative to use the next frame slot.
+/// The buffers are only read during the call.
+///</summary>
+SaveResult VideoFileWriter::SaveFrame(array<IntPtr>^ _planes, array<int>^ _strides, int _iWidth, int _iHeight, FramePixelFormat _format, int64_t _iTimestamp)
+{
+	return SaveFrame(_planes, _strides, _iWidth, _iHeight, _format, _iTimestamp, 1);
+}
+
+///<summary>
+/// VideoFileWriter::SaveFrame
+/// Raw planes variant of the held frame. The frame is encoded once and lasts _iDuration frame slots.
+///</summary>
+SaveResult VideoFileWriter::SaveFrame(array<IntPtr>^ _planes, array<int>^ _strides, int _iWidth, int _iHeight, FramePixelFormat _format, int64_t _iTimestamp, int _iDuration)
+{
+	enum PixelFormat pixelFormatFFmpeg;
+	switch(_format)
+	{
+		case FramePixelFormat::Bgra32:	pixelFormatFFmpeg = PIX_FMT_BGRA; break;
+		case FramePixelFormat::Bgr24:	pixelFormatFFmpeg = PIX_FMT_BGR24; break;
+		case FramePixelFormat::Gray8:	pixelFormatFFmpeg = PIX_FMT_GRAY8; break;
+		case FramePixelFormat::Yuv420p:	pixelFormatFFmpeg = PIX_FMT_YUV420P; break;
+		case FramePixelFormat::Nv12:	pixelFormatFFmpeg = PIX_FMT_NV12; break;
+		case FramePixelFormat::Yuyv422:	pixelFormatFFmpeg = PIX_FMT_YUYV422; break;
+		case FramePixelFormat::Uyvy422:	pixelFormatFFmpeg = PIX_FMT_UYVY422; break;
+		default:
+			log->Error("unsupported input pixel format");
+			return SaveResult::InvalidInputFrame;
+	}
+
+	int iPlaneHeights[4];
+	int iPlanes = GetPlaneHeights(pixelFormatFFmpeg, _iHeight, iPlaneHeights);
+
+	if(_planes == nullptr || _strides == nullptr || _planes->Length < iPlanes || _strides->Length < iPlanes || _iWidth <= 0 || _iHeight <= 0 || _iDuration < 1)
+	{
+		log->Error("invalid input frame");
+		return SaveResult::InvalidInputFrame;
+	}
+
+	uint8_t* pPlanes[4] = { nullptr, nullptr, nullptr, nullptr };
+	int iStrides[4] = { 0, 0, 0, 0 };
+	for(int i=0;i<iPlanes;i++)
+	{
+		pPlanes[i] = (uint8_t*)_planes[i].ToPointer();
+		iStrides[i] = _strides[i];
+
+		if(pPlanes[i] == nullptr || iStrides[i] <= 0)
+		{
+			log->Error("invalid input frame");
+			return SaveResult::InvalidInputFrame;
+		}
+	}
+
+	return SaveFrame(pPlanes, iStrides, _iWidth, _iHeight, pixelFormatFFmpeg, _iTimestamp, _iDuration);
+}
+
+///<summary>
+/// VideoFileWriter::SaveFrame
+/// Common entry point of the Bitmap and raw buffer variants.
+///</summary>
+SaveResult VideoFileWriter::SaveFrame(uint8_t** _pPlanes, int* _pStrides, int _iWidth, int _iHeight, enum PixelFormat _pixelFormat, int64_t _iTimestamp, int _iDuration)
+{
+	if(_iDuration < 1)
+	{
+		log->Error("invalid frame duration");
+		return SaveResult::InvalidInputFrame;
+	}
+
+	if(m_SavingContext->bPipelined)
+	{
+		return EnqueueFrame(_pPlanes, _pStrides, _iWidth, _iHeight, _pixelFormat, _iTimestamp, _iDuration);
+	}
+
+	SaveResult result = SaveResult::Success;
+
+	if(m_SavingContext->bWriteError)
+	{
+		result = SaveResult::FileNotWritten;
+	}
+	else if(!EncodeAndWriteVideoFrame(m_SavingContext, _pPlanes, _pStrides, _iWidth, _iHeight, _pixelFormat, _iTimestamp, _iDuration))
+	{
+		log->Error("error while writing output frame");
+		result = m_SavingContext->bWriteError ? SaveResult::FileNotWritten : SaveResult::UnknownError;
+	}
+
+	return result;
+}
+
+///<summary>
+/// VideoFileWriter::NextPts
+/// Compute the timestamp of the next frame, in encoder time base.
+/// A frame lasting several slots pushes the next one further and is remembered until its packet is written.
+///</summary>
+int64_t VideoFileWriter::NextPts(SavingContext^ _SavingContext, int64_t _iTimestamp, int _iDuration)
+{
+	// Without a timestamp, the frame takes the next slot.
+	int64_t iPts = _SavingContext->iLastPts + 1;
+
+	if(_iTimestamp >= 0)
+	{
+		// The encoder requires strictly increasing timestamps. 
+		// A frame arriving less than one time base unit after the previous one is pushed to the next slot.
+		AVRational microseconds = {1, 1000000};
+		iPts = Math::Max(iPts, av_rescale_q(_iTimestamp, microseconds, _SavingContext->pOutputCodecContext->time_base));
+	}
+
+	_SavingContext->iLastPts = iPts + _iDuration - 1;
+
+	if(_iDuration > 1)
+	{
+		Monitor::Enter(_SavingContext->heldFrames);
+		_SavingContext->heldFrames[iPts] = _iDuration;
+		Monitor::Exit(_SavingContext->heldFrames);
+	}
+
+	return iPts;
+}
+
+///<summary>
+/// VideoFileWriter::GetPlaneHeights
+/// Number of planes used by a pixel format and the number of rows in each.
+///</summary>
+int VideoFileWriter::GetPlaneHeights(enum PixelFormat _pixelFormat, int _iHeight, int* _pHeights)
+{
+	int iChromaHeight = (_iHeight + 1) / 2;
+	
+	switch(_pixelFormat)
+	{
+		case PIX_FMT_YUV420P:
+		case PIX_FMT_YUVJ420P:
+			_pHeights[0] = _iHeight;
+			_pHeights[1] = iChromaHeight;
+			_pHeights[2] = iChromaHeight;
+			return 3;
+		case PIX_FMT_NV12:
+			_pHeights[0] = _iHeight;
+			_pHeights[1] = iChromaHeight;
+			return 2;
+		default:
+			// Packed formats.
+			_pHeights[0] = _iHeight;
+			return 1;
+	}
+}
+
+///<summary>
+/// VideoFileWriter::RepackPicture
+/// Fill a 4:2:0 picture from YUV, luma or BGR input at the same size, without going through swscale.
+/// Returns false if the combination is not handled here, the caller then does a full conversion.
+///</summary>
+bool VideoFileWriter::RepackPicture(uint8_t** _pPlanes, int* _pStrides, int _iWidth, int _iHeight, enum PixelFormat _pixelFormat, AVFrame* _pPicture, int _iOutputWidth, int _iOutputHeight, enum PixelFormat _outputFormat)
+{
+	if(_iWidth != _iOutputWidth || _iHeight != _iOutputHeight)
+		return false;
+
+	// Bitmaps.
+	if(ColorConversion::CanConvertToYuv420p(_pixelFormat, _outputFormat))
+	{
+		ColorConversion::ToYuv420p(_pPlanes[0], _pStrides[0], _pixelFormat, _iWidth, _iHeight, _pPicture->data, _pPicture->linesize, _outputFormat);
+		return true;
+	}
+
+	// Capture devices give video range YUV, it can't go as is into a full range (JPEG) picture.
+	bool bIdentical = (_pixelFormat == _outputFormat);
+	bool bVideoRange = (_outputFormat == PIX_FMT_YUV420P);
+	bool bFullRange = (_outputFormat == PIX_FMT_YUVJ420P);
+
+	if(!bIdentical && !bVideoRange && !(_pixelFormat == PIX_FMT_GRAY8 && bFullRange))
+		return false;
+
+	int iChromaWidth = (_iWidth + 1) / 2;
+	int iChromaHeight = (_iHeight + 1) / 2;
+
+	uint8_t* pY = _pPicture->data[0];
+	uint8_t* pU = _pPicture->data[1];
+	uint8_t* pV = _pPicture->data[2];
+	int iStrideY = _pPicture->linesize[0];
+	int iStrideU = _pPicture->linesize[1];
+	int iStrideV = _pPicture->linesize[2];
+
+	if(bIdentical)
+	{
+		int iHeights[4];
+		int iPlanes = GetPlaneHeights(_pixelFormat, _iHeight, iHeights);
+		if(iPlanes != 3)
+			return false;
+
+		int iWidths[3] = { _iWidth, iChromaWidth, iChromaWidth };
+		for(int i=0;i<iPlanes;i++)
+		{
+			for(int y=0;y<iHeights[i];y++)
+			{
+				memcpy(_pPicture->data[i] + y * _pPicture->linesize[i], _pPlanes[i] + y * _pStrides[i], iWidths[i]);
+			}
+		}
+		return true;
+	}
+
+	switch(_pixelFormat)
+	{
+		case PIX_FMT_GRAY8:
+		{
+			// Luma only. Video range output gets the luma rescaled to 16..235.
+			uint8_t lut[256];
+			for(int i=0;i<256;i++)
+			{
+				lut[i] = bFullRange ? (uint8_t)i : (uint8_t)(16 + (i * 219 + 127) / 255);
+			}
+
+			for(int y=0;y<_iHeight;y++)
+			{
+				uint8_t* pSource = _pPlanes[0] + y * _pStrides[0];
+				uint8_t* pDest = pY + y * iStrideY;
+				if(bFullRange)
+				{
+					memcpy(pDest, pSource, _iWidth);
+				}
+				else
+				{
+					for(int x=0;x<_iWidth;x++)
+						pDest[x] = lut[pSource[x]];
+				}
+			}
+
+			for(int y=0;y<iChromaHeight;y++)
+			{
+				memset(pU + y * iStrideU, 128, iChromaWidth);
+				memset(pV + y * iStrideV, 128, iChromaWidth);
+			}
+			return true;
+		}
+		case PIX_FMT_NV12:
+		{
+			// Same sampling, the chroma plane just needs to be split.
+			for(int y=0;y<_iHeight;y++)
+			{
+				memcpy(pY + y * iStrideY, _pPlanes[0] + y * _pStrides[0], _iWidth);
+			}
+
+			for(int y=0;y<iChromaHeight;y++)
+			{
+				uint8_t* pSource = _pPlanes[1] + y * _pStrides[1];
+				uint8_t* pDestU = pU + y * iStrideU;
+				uint8_t* pDestV = pV + y * iStrideV;
+				for(int x=0;x<iChromaWidth;x++)
+				{
+					pDestU[x] = pSource[2*x];
+					pDestV[x] = pSource[2*x + 1];
+				}
+			}
+			return true;
+		}
+		case PIX_FMT_YUYV422:
+		case PIX_FMT_UYVY422:
+		{
+			// 4:2:2 packed. Luma is extracted, chroma of each pair of rows is averaged.
+			if(_iWidth % 2 != 0)
+				return false;
+
+			int iLumaOffset = (_pixelFormat == PIX_FMT_YUYV422) ? 0 : 1;
+			int iChromaOffset = 1 - iLumaOffset;
+
+			for(int y=0;y<_iHeight;y++)
+			{
+				uint8_t* pSource = _pPlanes[0] + y * _pStrides[0] + iLumaOffset;
+				uint8_t* pDest = pY + y * iStrideY;
+				for(int x=0;x<_iWidth;x++)
+				{
+					pDest[x] = pSource[2*x];
+				}
+			}
+
+			for(int y=0;y<iChromaHeight;y++)
+			{
+				// Last row of an odd height picture has no pair.
+				uint8_t* pTop = _pPlanes[0] + (2*y) * _pStrides[0] + iChromaOffset;
+				uint8_t* pBottom = (2*y + 1 < _iHeight) ? pTop + _pStrides[0] : pTop;
+				uint8_t* pDestU = pU + y * iStrideU;
+				uint8_t* pDestV = pV + y * iStrideV;
+				for(int x=0;x<iChromaWidth;x++)
+				{
+					pDestU[x] = (uint8_t)((pTop[4*x] + pBottom[4*x] + 1) >> 1);
+					pDestV[x] = (uint8_t)((pTop[4*x + 2] + pBottom[4*x + 2] + 1) >> 1);
+				}
+			}
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+///<summary>
+/// VideoFileWriter::SaveMetadata
+/// Save an xml string in the file opened in a previous call to OpenSaving context.
+///</summary>
+SaveResult VideoFileWriter::SaveMetadata(String^ _Metadata)
+{
+	log->Debug("Saving metadata to file.");
+	SaveResult result = SaveResult::Success;
+
+	// Kept for the next files of a segmented recording.
+	m_SavingContext->szMetadata = _Metadata;
+
+	if(!WriteMetadata(m_SavingContext, _Metadata))
+	{
+		log->Error("metadata not written");
+		result = SaveResult::MetadataNotWritten;
+	}
+	
+	return result;
+}
+
+///<summary>
+/// VideoFileWriter::GetSupportedEncoders
+/// List the names of the video encoders available in the linked FFmpeg.
+/// These are the values accepted in EncodingProfile::szEncoderName.
+///</summary>
+List<String^>^ VideoFileWriter::GetSupportedEncoders()
+{
+	av_register_all();
+	avcodec_register_all();
+
+	List<String^>^ encoders = gcnew List<String^>();
+	
+	AVCodec* pCodec = nullptr;
+	while((pCodec = av_codec_next(pCodec)) != nullptr)
+	{
+		if(pCodec->type == AVMEDIA_TYPE_VIDEO && pCodec->encode != nullptr)
+		{
+			encoders->Add(gcnew String(pCodec->name));
+		}
+	}
+
+	return encoders;
+}
+
+///<summary>
+/// VideoFileWriter::IsEncoderSupported
+/// Check whether the linked FFmpeg can encode with the given encoder name.
+///</summary>
+bool VideoFileWriter::IsEncoderSupported(String^ _EncoderName)
+{
+	return FindEncoder(_EncoderName) != nullptr;
+}
+
+///<summary>
+/// VideoFileWriter::FindEncoder
+/// Return the video encoder with the given libavcodec name, or null.
+///</summary>
+AVCodec* VideoFileWriter::FindEncoder(String^ _EncoderName)
+{
+	if(String::IsNullOrEmpty(_EncoderName))
+		return nullptr;
+
+	av_register_all();
+	avcodec_register_all();
+
+	char* pEncoderName = static_cast<char*>(Marshal::StringToHGlobalAnsi(_EncoderName).ToPointer());
+	AVCodec* pCodec = avcodec_find_encoder_by_name(pEncoderName);
+	Marshal::FreeHGlobal(safe_cast<IntPtr>(pEncoderName));
+
+	if(pCodec != nullptr && pCodec->type != AVMEDIA_TYPE_VIDEO)
+		pCodec = nullptr;
+
+	return pCodec;
+}
+
+///<summary>
+/// VideoFileWriter::IsCodecSupportedByMuxer
+/// Check whether the container can store the codec. (ex: HuffYUV can't go in MP4).
+///</summary>
+bool VideoFileWriter::IsCodecSupportedByMuxer(AVOutputFormat* _pOutputFormat, enum CodecID _codecId)
+{
+	// Muxers without a tag table accept anything.
+	if(_pOutputFormat->codec_tag == nullptr)
+		return true;
+
+	return av_codec_get_tag(_pOutputFormat->codec_tag, _codecId) != 0;
+}
+
+///<summary>
+/// VideoFileWriter::GuessOutputFormat
+/// Return the AVOutputFormat corresponding to a specific filename.
+/// Forces to Matroska if Metadata must be saved.
+///</summary>
+AVOutputFormat* VideoFileWriter::GuessOutputFormat(String^ _FilePath, bool _bHasMetadata)
+{
+	//---------------------------------------------------------------
+	// Hint:
+	// To find a particular format name for ffmpeg,
+	// search for the AVOutputFormat struct in source code for the format.
+	// generally at the end of the file.
+	//---------------------------------------------------------------
+
+	AVOutputFormat*		pOutputFormat;
+
+	String^ Filepath = gcnew String(_FilePath->ToLower());
+
+	if(Filepath->EndsWith("mkv") || _bHasMetadata)
+	{
+		pOutputFormat = av_guess_format("matroska", nullptr, nullptr);
+	}
+	else if(Filepath->EndsWith("mp4")) 
+	{
+		pOutputFormat = av_guess_format("mp4", nullptr, nullptr);
+	}
+	else
+	{
+		pOutputFormat = av_guess_format("avi", nullptr, nullptr);
+	}
+
+	return pOutputFormat;
+}
+
+///<summary>
+/// VideoFileWriter::SetupMuxer
+/// Configure the Muxer with default parameters.
+///</summary>
+bool VideoFileWriter::SetupMuxer(SavingContext^ _SavingContext)
+{
+	return SetupMuxer(_SavingContext->pOutputFormatContext, _SavingContext->pFilePath, _SavingContext);
+}
+
+///<summary>
+/// VideoFileWriter::SetupMuxer
+/// Configure a muxer for the given file. Also used for the next files of a segmented recording.
+///</summary>
+bool VideoFileWriter::SetupMuxer(AVFormatContext* _pFormatContext, char* _pFilePath, SavingContext^ _SavingContext)
+{
+	bool bResult = true;
+
+	_pFormatContext->oformat = _SavingContext->pOutputFormat;
+	
+	av_strlcpy(_pFormatContext->filename, _pFilePath, sizeof(_pFormatContext->filename));
+		
+	_pFormatContext->timestamp = 0;
+		
+	_pFormatContext->bit_rate = _SavingContext->iBitrate;
+
+		
+	// Paramtres (par dfaut ?) du muxeur
+	AVFormatParameters	fpOutFile;
+	memset(&fpOutFile, 0, sizeof(AVFormatParameters));
+	if (av_set_parameters(_pFormatContext, &fpOutFile) < 0)
+	{
+		log->Error("muxer parameters not set");
+		return false;
+	}
+
+	// ?
+	_pFormatContext->preload   = (int)(0.5 * AV_TIME_BASE);
+	_pFormatContext->max_delay = (int)(0.7 * AV_TIME_BASE); 
+
+	return bResult;
+}
+
+///<summary>
+/// VideoFileWriter::SetupEncoder
+/// Configure the codec with default parameters.
+///</summary>
+bool VideoFileWriter::SetupEncoder(SavingContext^ _SavingContext)
+{
+	//----------------------------------------
+	// Parameters for encoding.
+	// some tweaked, some taken from Mencoder.
+	// Not all clear...
+	//----------------------------------------
+
+	// TODO:
+	// Implement from ref: http://www.mplayerhq.hu/DOCS/HTML/en/menc-feat-dvd-mpeg4.html
+
+
+	log->Debug("Setting up the encoder.");
+
+	EncodingProfile^ profile = _SavingContext->profile;
+
+	log->Debug(String::Format("Encoding profile: {0}, encoder:{1}, gop:{2}, rate control:{3}.", 
+		profile->eProfile, profile->szEncoderName, profile->iGopSize, profile->eRateControl));
+
+	// Codec.
+	// Equivalent to : -vcodec mpeg4
+	_SavingContext->pOutputCodecContext->codec_id = _SavingContext->pOutputCodec->id;
+	_SavingContext->pOutputCodecContext->codec_type = AVMEDIA_TYPE_VIDEO;
+
+	// By default the fourcc for MPEG-4 is 'FMP4' but Windows Media Player doesn't recognize it.
+	// The MPEG-4 profiles force to 'DIVX' fourcc. (similar as -vtag DIVX) even if it wasn't the DivX codec that encoded the video :-(
+	// Other profiles use the codec default.
+	if(profile->iCodecTag != 0)
+	{
+		_SavingContext->pOutputCodecContext->codec_tag = profile->iCodecTag;
+	}
+
+	// The average bitrate (unused for constant quantizer encoding.)
+	// Source: statically fixed to 25Mb/s for now. 
+	_SavingContext->pOutputCodecContext->bit_rate = _SavingContext->iBitrate;
+
+	// Number of bits the bitstream is allowed to diverge from the reference.
+    // the reference can be CBR (for CBR pass1) or VBR (for pass2)
+	// Source: Avidemux.
+	_SavingContext->pOutputCodecContext->bit_rate_tolerance = 8000000;
+
+	// Motion estimation algorithm used for video coding. 
+	// src: MEncoder.
+	_SavingContext->pOutputCodecContext->me_method = ME_EPZS;
+
+	// Framerate - timebase.
+	// Certains codecs (MPEG1/2) ne supportent qu'un certain nombre restreints de framerates.
+	// src [kinovea]
+	if(_SavingContext->fFramesInterval == 0)
+		_SavingContext->fFramesInterval = 40;
+
+	int iTimebase = (int)Math::Round(1000000.0f / _SavingContext->fFramesInterval);
+
+	// Examples : 25000, 30000, 29970.
+	// Treat some special cases and use rounding for the others.
+	if(iTimebase == 29970)
+	{
+		log->Debug(String::Format("Pushing special timebase: 30000:1001"));
+		_SavingContext->pOutputCodecContext->time_base.den			= 30000;
+		_SavingContext->pOutputCodecContext->time_base.num			= 1001;
+	}
+	else if(iTimebase == 24975)
+	{
+		log->Debug(String::Format("Pushing special timebase: 25000:1001"));
+		_SavingContext->pOutputCodecContext->time_base.den			= 25000;
+		_SavingContext->pOutputCodecContext->time_base.num			= 1001;
+	}
+	else
+	{
+		iTimebase = (int)Math::Round((double)iTimebase / 1000);
+		log->Debug(String::Format("Pushing timebase: {0}:1", iTimebase));
+		_SavingContext->pOutputCodecContext->time_base.den			= iTimebase;
+		_SavingContext->pOutputCodecContext->time_base.num			= 1;
+	}
+	
+	// Picture width / height.
+	// If we are transcoding from a video, this will be the same as the input size.
+	// (not the decoding size).
+	// src: [kinovea]
+	_SavingContext->pOutputCodecContext->width				= _SavingContext->outputSize.Width;
+	_SavingContext->pOutputCodecContext->height				= _SavingContext->outputSize.Height;
+	
+
+	//-------------------------------------------------------------------------------------------
+	// Mode d'encodage (i, b, p frames)
+	//
+	// gop_size		: the number of pictures in a group of pictures, or 0 for intra_only. (default : 12)
+	// max_b_frames	: maximum number of B-frames between non-B-frames (default : 0)
+	//				  Note: The output will be delayed by max_b_frames+1 relative to the input.
+	//
+	// [kinovea]	: Intra only by default so we can always access prev frame right away in the Player.
+	//				  The long GOP profile trades this for much smaller files.
+	// [kinovea]	: Player doesn't support B-frames.
+	//-------------------------------------------------------------------------------------------
+	_SavingContext->pOutputCodecContext->gop_size				= profile->iGopSize;	
+	_SavingContext->pOutputCodecContext->max_b_frames			= profile->MaxBFrames;								
+
+	// Pixel format
+	// Use the profile format if the encoder accepts it, otherwise the first format it supports.
+	// src:ffmpeg.
+	_SavingContext->pOutputCodecContext->pix_fmt = (enum PixelFormat)profile->PixelFormat;
+	const enum PixelFormat* pSupportedFormats = _SavingContext->pOutputCodec->pix_fmts;
+	if(pSupportedFormats != nullptr)
+	{
+		bool bSupported = false;
+		for(const enum PixelFormat* p = pSupportedFormats; *p != PIX_FMT_NONE; p++)
+		{
+			if(*p == _SavingContext->pOutputCodecContext->pix_fmt)
+			{
+				bSupported = true;
+				break;
+			}
+		}
+
+		if(!bSupported)
+		{
+			log->Debug(String::Format("Pixel format {0} not supported by the encoder, using {1}.", profile->PixelFormat, (int)pSupportedFormats[0]));
+			_SavingContext->pOutputCodecContext->pix_fmt = pSupportedFormats[0];
+		}
+	}
+
+
+	// Frame rate emulation. If not zero, the lower layer (i.e. format handler) has to read frames at native frame rate.
+	// src: ?
+	// ->rate_emu
+
+
+	// Quality/Technique of encoding.
+	// CODEC_FLAG_QSCALE : Constant Quantization. Each frame must then carry the quality too (see encoding functions).
+	if(profile->eRateControl == RateControl::ConstantQuality)
+	{
+		_SavingContext->pOutputCodecContext->flags |= CODEC_FLAG_QSCALE;
+		_SavingContext->pOutputCodecContext->global_quality = FF_QP2LAMBDA * profile->iQuality;
+	}
+	_SavingContext->pOutputCodecContext->qcompress = 0.5;		// amount of qscale change between easy & hard scenes (0.0-1.0) 
+    _SavingContext->pOutputCodecContext->qblur = 0.5;			// amount of qscale smoothing over time (0.0-1.0)
+	_SavingContext->pOutputCodecContext->qmin = profile->iQMin;	// minimum quantizer (def:2)
+	_SavingContext->pOutputCodecContext->qmax = profile->iQMax;	// maximum quantizer (def:31)
+	_SavingContext->pOutputCodecContext->max_qdiff = 3;		// maximum quantizer difference between frames (def:3)
+	_SavingContext->pOutputCodecContext->mpeg_quant = 0;		// 0 -> h263 quant, 1 -> mpeg quant. (def:0)
+	//_pOutputCodecContext->b_quant_factor (qscale factor between IP and B-frames)
+
+
+	// Sample Aspect Ratio.
+	
+	// Assume PAR=1:1 (square pixels).
+	_SavingContext->pOutputCodecContext->sample_aspect_ratio.num = 1;
+	_SavingContext->pOutputCodecContext->sample_aspect_ratio.den = 1;
+
+	if(_SavingContext->fPixelAspectRatio != 1.0)
+	{
+		// -> Anamorphic video, non square pixels.
+		// We also output an anamorphic video.
+
+		if(_SavingContext->bInputWasMpeg2)
+		{
+			// If MPEG, sample_aspect_ratio is actually the DAR...
+			// Reference for weird decision tree: mpeg12.c at mpeg_decode_postinit().
+			double fDisplayAspectRatio	= (double)m_SavingContext->iSampleAspectRatioNumerator / (double)m_SavingContext->iSampleAspectRatioDenominator;
+			double fPixelAspectRatio	= ((double)_SavingContext->outputSize.Height * fDisplayAspectRatio) / (double)_SavingContext->outputSize.Width;
+
+			if(fPixelAspectRatio > 1.0f)
+			{
+				// In this case the input sample aspect ratio was actually the display aspect ratio.
+				// We will recompute the aspect ratio.
+				int gcd = GreatestCommonDenominator((int)((double)_SavingContext->outputSize.Width * fPixelAspectRatio), _SavingContext->outputSize.Width);
+				_SavingContext->pOutputCodecContext->sample_aspect_ratio.num = (int)(((double)_SavingContext->outputSize.Width * fPixelAspectRatio)/gcd);
+				_SavingContext->pOutputCodecContext->sample_aspect_ratio.den = _SavingContext->outputSize.Width / gcd;
+			}
+			else
+			{
+				_SavingContext->pOutputCodecContext->sample_aspect_ratio.num = m_SavingContext->iSampleAspectRatioNumerator;
+				_SavingContext->pOutputCodecContext->sample_aspect_ratio.den = m_SavingContext->iSampleAspectRatioDenominator;
+			}
+		}
+		else
+		{
+			_SavingContext->pOutputCodecContext->sample_aspect_ratio.num = m_SavingContext->iSampleAspectRatioNumerator;
+			_SavingContext->pOutputCodecContext->sample_aspect_ratio.den = m_SavingContext->iSampleAspectRatioDenominator;
+		}
+	}
+
+	// Ensure the container stream uses the same aspect ratio.
+	_SavingContext->pOutputVideoStream->sample_aspect_ratio.num = _SavingContext->pOutputCodecContext->sample_aspect_ratio.num;
+	_SavingContext->pOutputVideoStream->sample_aspect_ratio.den = _SavingContext->pOutputCodecContext->sample_aspect_ratio.den;
+
+	
+	//-----------------------------------
+	// h. Other settings. (From MEncoder) 
+	//-----------------------------------
+	_SavingContext->pOutputCodecContext->strict_std_compliance= -1;		// strictly follow the standard (MPEG4, ...)
+	_SavingContext->pOutputCodecContext->luma_elim_threshold = 0;		// luma single coefficient elimination threshold
+	_SavingContext->pOutputCodecContext->chroma_elim_threshold = 0;		// chroma single coeff elimination threshold
+	_SavingContext->pOutputCodecContext->lumi_masking = 0.0;;
+	_SavingContext->pOutputCodecContext->dark_masking = 0.0;
+	// codecContext->codec_tag							// 4CC : if not set then the default based on codec_id will be used.
+	// pre_me (prepass for motion estimation)
+	// sample_rate
+	// codecContext->channels = 2;
+	// codecContext->mb_decision = 0;
+
+	// Multithreading inside the encoder. Must be set before avcodec_open, after the size and flags.
+	// src: [kinovea]
+	_SavingContext->pOutputCodecContext->thread_count = GetEncoderThreads(_SavingContext->pOutputCodecContext, _SavingContext->iEncoderThreads);
+
+	return true;
+
+}
+
+///<summary>
+/// VideoFileWriter::GetEncoderThreads
+/// Number of encoder threads avcodec_open accepts for this codec context.
+/// The MPEG video encoders refuse threads except for MPEG-1/2/4 and H.263+ with slices,
+/// and split the picture in at most one slice per macroblock row and 16 threads.
+///</summary>
+int VideoFileWriter::GetEncoderThreads(AVCodecContext* _pCodecContext, int _iThreads)
+{
+	bool bThreaded = _pCodecContext->codec_id == CODEC_ID_MPEG1VIDEO || 
+		_pCodecContext->codec_id == CODEC_ID_MPEG2VIDEO ||
+		_pCodecContext->codec_id == CODEC_ID_MPEG4 ||
+		(_pCodecContext->codec_id == CODEC_ID_H263P && (_pCodecContext->flags & CODEC_FLAG_H263P_SLICE_STRUCT) != 0);
+	
+	if(!bThreaded)
+		return 1;
+
+	int iMacroblockRows = (_pCodecContext->height + 15) / 16;
+	return Math::Max(1, Math::Min(_iThreads, Math::Min(16, iMacroblockRows)));
+}
+///<summary>
+/// VideoFileWriter::WriteMetadata
+/// Save the xml data in the video file.
+///</summary>
+bool VideoFileWriter::WriteMetadata(SavingContext^ _SavingContext, String^ _Metadata)
+{
+	// Create packet.
+	AVPacket OutputPacket;
+	av_init_packet(&OutputPacket);					
+	
+	// Packet position. (No coded frame in stream copy mode).
+	AVFrame* pCodedFrame = _SavingContext->pOutputCodecContext->coded_frame;
+	int64_t iPts = (pCodedFrame != nullptr && pCodedFrame->pts != AV_NOPTS_VALUE) ? pCodedFrame->pts : 0;
+	OutputPacket.pts = av_rescale_q(iPts, _SavingContext->pOutputCodecContext->time_base, _SavingContext->pOutputVideoStream->time_base);
+	OutputPacket.pts = Math::Max((int64_t)0, OutputPacket.pts - _SavingContext->iSegmentStartPts);
+
+	// Associate packet to subtitle stream.
+	OutputPacket.stream_index = _SavingContext->pOutputDataStream->index;
+
+	char* pMetadata	= static_cast<char*>(Marshal::StringToHGlobalAnsi(_Metadata).ToPointer());
+
+	OutputPacket.data = (uint8_t*)pMetadata;
+	OutputPacket.size = _Metadata->Length;
+	
+	// Write to output file.
+	int iWriteRes = av_write_frame(_SavingContext->pOutputFormatContext, &OutputPacket);
+	
+	Marshal::FreeHGlobal(safe_cast<IntPtr>(pMetadata));
+
+	return (iWriteRes == 0);
+}
+///<summary>
+/// VideoFileWriter::EncodeAndWriteVideoFrame
+/// Save a single frame in the video file. Takes raw planes at any size and pixel format as input.
+///</summary>
+bool VideoFileWriter::EncodeAndWriteVideoFrame(SavingContext^ _SavingContext, uint8_t** _pPlanes, int* _pStrides, int _iWidth, int _iHeight, enum PixelFormat _pixelFormat, int64_t _iTimestamp, int _iDuration)
+{
+	bool bWritten = false;
+	bool bOutputFrameAllocated = false;
+	
+	AVFrame* pOutputFrame;
+	uint8_t* pOutputFrameBuffer;
+	
+	//------------------------------------------------------------------------------------------
+	// -> _pPlanes holds a non compressed image, at the input PIX_FMT (BGRA for Bitmaps, or YUV from capture devices)
+	// This image is still at the decoding size.
+	//------------------------------------------------------------------------------------------
+
+	do
+	{
+		// f. L'objet frame receptacle de sortie.
+		if ((pOutputFrame = avcodec_alloc_frame()) == nullptr) 
+		{
+			log->Error("output frame not allocated");
+			break;
+		}
+		
+		// g. Le poids d'une image selon le PIX_FMT de sortie et la taille donne. 
+		int iSizeOutputFrameBuffer = avpicture_get_size(_SavingContext->pOutputCodecContext->pix_fmt, _SavingContext->outputSize.Width, _SavingContext->outputSize.Height);
+		
+		// h. Allouer le buffer contenant les donnes relles de la frame.
+		pOutputFrameBuffer = (uint8_t*)av_malloc(iSizeOutputFrameBuffer);
+		if (pOutputFrameBuffer == nullptr) 
+		{
+			log->Error("output frame buffer not allocated");
+			av_free(pOutputFrame);
+			break;
+		}
+
+		bOutputFrameAllocated = true;
+		Interlocked::Add(_SavingContext->stats->iAllocations, 2);
+
+		// i. Mise en place de pointeurs internes reliant certaines adresses  d'autres.
+		avpicture_fill((AVPicture *)pOutputFrame, pOutputFrameBuffer, _SavingContext->pOutputCodecContext->pix_fmt, _SavingContext->outputSize.Width, _SavingContext->outputSize.Height);
+		
+		// j. YUV from capture devices at the output size only needs its samples moved around.
+		int64_t iConvertStart = Stopwatch::GetTimestamp();
+		if(!RepackPicture(_pPlanes, _pStrides, _iWidth, _iHeight, _pixelFormat, pOutputFrame, _SavingContext->outputSize.Width, _SavingContext->outputSize.Height, _SavingContext->pOutputCodecContext->pix_fmt))
+		{
+			// k. Convertir l'image de son format de pixels d'origine vers le format de pixels de sortie.
+			// Scaling contexts are kept as long as the input geometry doesn't change.
+			if (!_SavingContext->scaler->Scale(_pPlanes, _pStrides, _iWidth, _iHeight, _pixelFormat, 
+				pOutputFrame->data, pOutputFrame->linesize, _SavingContext->outputSize.Width, _SavingContext->outputSize.Height, _SavingContext->pOutputCodecContext->pix_fmt, SWS_BICUBIC)) 
+			{
+				log->Error("scaling failed");
+				break;
+			}
+		}
+		Interlocked::Add(_SavingContext->stats->iConvertTicks, Stopwatch::GetTimestamp() - iConvertStart);
+		TraceRecorder::Span("Convert", "VideoFileWriter", iConvertStart);
+
+
+		//------------------------------------------------------------------------------------------
+		// -> Ici, pOutputFrame contient une bitmap non compresse, au nouveau PIX_FMT. (=> YUV420P)
+		//------------------------------------------------------------------------------------------
+
+
+		// f. allouer le buffer pour les donnes de la frame aprs compression. ( -> valeur tire de ffmpeg.c)
+		int iSizeOutputVideoBuffer = 4 *  _SavingContext->outputSize.Width *  _SavingContext->outputSize.Height;		
+		uint8_t* pOutputVideoBuffer = (uint8_t*)av_malloc(iSizeOutputVideoBuffer);
+		if (pOutputVideoBuffer == nullptr) 
+		{
+			log->Error("output video buffer not allocated");
+			break;
+		}
+		Interlocked::Increment(_SavingContext->stats->iAllocations);
+		
+		// g. encodage vido.
+		// AccessViolationException ? => problme de memalign. Recompiler libavc avec le bon gcc.
+		pOutputFrame->pts = NextPts(_SavingContext, _iTimestamp, _iDuration);
+		pOutputFrame->quality = _SavingContext->pOutputCodecContext->global_quality;
+		if(Interlocked::Exchange(_SavingContext->iKeyframeRequested, 0) == 1)
+		{
+			pOutputFrame->pict_type = FF_I_TYPE;
+		}
+		int64_t iEncodeStart = Stopwatch::GetTimestamp();
+		int iEncodedSize = avcodec_encode_video(_SavingContext->pOutputCodecContext, pOutputVideoBuffer, iSizeOutputVideoBuffer, pOutputFrame);
+		Interlocked::Add(_SavingContext->stats->iEncodeTicks, Stopwatch::GetTimestamp() - iEncodeStart);
+		TraceRecorder::Span("Encode", "VideoFileWriter", iEncodeStart);
+		Interlocked::Increment(_SavingContext->stats->iFrames);
+		
+		// Ecriture du packet vido dans le fichier. (Keyframes depend on the profile GOP).
+		bool bMuxed = WriteFrame(iEncodedSize, _SavingContext, pOutputVideoBuffer, _SavingContext->pOutputCodecContext->coded_frame->pts, _iTimestamp, _SavingContext->pOutputCodecContext->coded_frame->key_frame != 0);
+		
+		av_free(pOutputVideoBuffer);
+
+		if(!bMuxed)
+		{
+			log->Error("problem while writing frame to file");
+			break;
+		}
+
+		bWritten = true;
+	}
+	while(false);
+
+	// Cleanup
+	if(bOutputFrameAllocated)
+	{
+		av_free(pOutputFrameBuffer);
+		av_free(pOutputFrame);
+	}
+
+	return bWritten;
+}
+
+///<summary>
+/// VideoFileWriter::WriteFrame
+/// Commit a single frame in the video file.
+///</summary>
+bool VideoFileWriter::WriteFrame(int _iEncodedSize, SavingContext^ _SavingContext, uint8_t* _pOutputVideoBuffer, int64_t _iPts, int64_t _iTimestamp, bool _bKeyframe)
+{
+	// _iPts is expressed in the encoder time base. 
+	// It is passed explicitly because in pipelined mode the encoder may already be working on a later frame.
+	//
+	// _iTimestamp is the capture time in microseconds, or negative. 
+	// The encoder time base is the nominal frame interval (the rate control depends on it), 
+	// but the stream time base set by the muxer is usually much finer (1/1000 for MKV, timescale for MP4). 
+	// When we have the real capture time, we use it directly so the file keeps the actual timing of frames.
+	// For AVI the stream time base is the frame interval and the muxer pads the gaps left by dropped frames.
+
+	if (_iEncodedSize <= 0) 
+	{
+		log->Error("encoded size not positive");
+		return true;
+	}
+
+	// The flag and the muxer are only used under the pre-roll lock, 
+	// so live packets can't get in the file while Trigger is still writing the pre-roll.
+	bool bWritten = true;
+	Monitor::Enter(m_PreRollLock);
+	try
+	{
+		// Pre-roll: until the trigger the packet only goes to memory.
+		if(_SavingContext->bPreRolling)
+		{
+			StorePreRollPacket(_SavingContext, _pOutputVideoBuffer, _iEncodedSize, _iPts, _iTimestamp, _bKeyframe);
+		}
+		else
+		{
+			bWritten = MuxFrame(_iEncodedSize, _SavingContext, _pOutputVideoBuffer, _iPts, _iTimestamp, _bKeyframe);
+		}
+	}
+	finally
+	{
+		Monitor::Exit(m_PreRollLock);
+	}
+
+	return bWritten;
+}
+
+///<summary>
+/// VideoFileWriter::MuxFrame
+/// Give a compressed frame to the muxer. Called under the pre-roll lock.
+/// A failed write, including a disk error reported by the asynchronous output, is kept in bWriteError.
+///</summary>
+bool VideoFileWriter::MuxFrame(int _iEncodedSize, SavingContext^ _SavingContext, uint8_t* _pOutputVideoBuffer, int64_t _iPts, int64_t _iTimestamp, bool _bKeyframe)
+{
+	AVPacket OutputPacket;
+	av_init_packet(&OutputPacket);
+
+	AVRational microseconds = {1, 1000000};
+	AVStream* pStream = _SavingContext->pOutputVideoStream;
+
+	// Compute packet position.
+	if(_iTimestamp >= 0)
+	{
+		OutputPacket.pts = av_rescale_q(_iTimestamp, microseconds, pStream->time_base);
+	}
+	else
+	{
+		OutputPacket.pts = av_rescale_q(_iPts, _SavingContext->pOutputCodecContext->time_base, pStream->time_base);
+	}
+
+	// Timestamps must be strictly increasing in the stream. 
+	// Two frames closer than the stream resolution are pushed apart.
+	if(OutputPacket.pts <= _SavingContext->iLastStreamPts)
+	{
+		OutputPacket.pts = _SavingContext->iLastStreamPts + 1;
+	}
+	_SavingContext->iLastStreamPts = OutputPacket.pts;
+
+	// First packet of a triggered recording.
+	if(_SavingContext->bRebasePts)
+	{
+		_SavingContext->iSegmentStartPts = OutputPacket.pts;
+		_SavingContext->bRebasePts = false;
+	}
+
+	// Segmented recording. Each file starts at 0.
+	if(_SavingContext->iSegmentDuration > 0 || _SavingContext->iSegmentSize > 0)
+	{
+		UpdateSegment(_SavingContext, OutputPacket.pts, _bKeyframe);
+		pStream = _SavingContext->pOutputVideoStream;
+	}
+	OutputPacket.pts -= _SavingContext->iSegmentStartPts;
+
+	// Nominal duration of one frame, or more for held frames. 
+	// (The AVI muxer doesn't store durations, it pads the gap up to the next frame with empty packets that repeat this one.)
+	int iDuration = 1;
+	Monitor::Enter(_SavingContext->heldFrames);
+	if(_SavingContext->heldFrames->TryGetValue(_iPts, iDuration))
+	{
+		_SavingContext->heldFrames->Remove(_iPts);
+	}
+	else
+	{
+		iDuration = 1;
+	}
+	Monitor::Exit(_SavingContext->heldFrames);
+
+	OutputPacket.duration = (int)av_rescale_q(iDuration, _SavingContext->pOutputCodecContext->time_base, pStream->time_base);
+
+	// Flag Keyframes as such.
+	if(_bKeyframe)
+	{
+		OutputPacket.flags |= AV_PKT_FLAG_KEY;
+	}
+
+	// Associate various buffers before the commit.
+	OutputPacket.stream_index = _SavingContext->pOutputVideoStream->index;
+	OutputPacket.data= _pOutputVideoBuffer;
+	OutputPacket.size= _iEncodedSize;
+
+	// Commit the packet to the file.
+	int64_t iWriteStart = Stopwatch::GetTimestamp();
+	int iWriteRes = av_write_frame(_SavingContext->pOutputFormatContext, &OutputPacket);
+	Interlocked::Add(_SavingContext->stats->iWriteTicks, Stopwatch::GetTimestamp() - iWriteStart);
+	TraceRecorder::Span("Write", "VideoFileWriter", iWriteStart);
+	Interlocked::Increment(_SavingContext->stats->iPackets);
+	Interlocked::Add(_SavingContext->stats->iBytes, _iEncodedSize);
+	if(iWriteRes < 0)
+	{
+		log->Error(String::Format("Packet not written, AVERROR:{0}", iWriteRes));
+		_SavingContext->bWriteError = true;
+		return false;
+	}
+
+	// Streaming safe: push the buffered bytes regularly, a crash then loses at most the last interval.
+	// The Matroska muxer writes the segment and cluster sizes as unknown until they are closed, 
+	// so what is in the file is readable as is.
+	if(_SavingContext->bStreamingSafe)
+	{
+		int64_t iTime = av_rescale_q(OutputPacket.pts, pStream->time_base, microseconds);
+		if(iTime < _SavingContext->iLastFlushTime || iTime - _SavingContext->iLastFlushTime >= _SavingContext->iFlushInterval)
+		{
+			avio_flush(_SavingContext->pOutputFormatContext->pb);
+			_SavingContext->iLastFlushTime = iTime;
+		}
+	}
+
+	if(_SavingContext->pOutputFormatContext->pb->error < 0)
+	{
+		log->Error(String::Format("Output not written, AVERROR:{0}", _SavingContext->pOutputFormatContext->pb->error));
+		_SavingContext->bWriteError = true;
+		return false;
+	}
+
+	return true;
+}
+
+
+
+///<summary>
+/// VideoFileWriter::UpdateSegment
+/// Segmented recording. Check the limits of the current file and switch to the next one on a keyframe.
+/// _iPts is the position of the packet about to be written, in stream time base.
+///</summary>
+void VideoFileWriter::UpdateSegment(SavingContext^ _SavingContext, int64_t _iPts, bool _bKeyframe)
+{
+	if(!_SavingContext->bRotationDue)
+	{
+		AVRational microseconds = {1, 1000000};
+		int64_t iElapsed = av_rescale_q(_iPts - _SavingContext->iSegmentStartPts, _SavingContext->pOutputVideoStream->time_base, microseconds);
+		int64_t iSize = url_ftell(_SavingContext->pOutputFormatContext->pb);
+
+		bool bDurationReached = _SavingContext->iSegmentDuration > 0 && iElapsed >= _SavingContext->iSegmentDuration;
+		bool bSizeReached = _SavingContext->iSegmentSize > 0 && iSize >= _SavingContext->iSegmentSize;
+		_SavingContext->bRotationDue = bDurationReached || bSizeReached;
+	}
+
+	if(!_SavingContext->bRotationDue)
+		return;
+
+	if(_bKeyframe)
+	{
+		RotateSegment(_SavingContext, _iPts);
+	}
+	else
+	{
+		// Long GOP: the next file must start on a keyframe, ask for one rather than waiting for the end of the GOP. 
+		// In pipelined mode the frames already encoded are still written to the current file.
+		Interlocked::Exchange(_SavingContext->iKeyframeRequested, 1);
+	}
+}
+
+///<summary>
+/// VideoFileWriter::RotateSegment
+/// Segmented recording. Make the file opened in advance the current one, the keyframe at _iPts will be its first packet.
+/// The previous file is finalized in the background.
+///</summary>
+void VideoFileWriter::RotateSegment(SavingContext^ _SavingContext, int64_t _iPts)
+{
+	// The next file is normally ready long before the current one is full.
+	if(m_SegmentThread != nullptr)
+	{
+		m_SegmentThread->Join();
+		m_SegmentThread = nullptr;
+	}
+
+	AVFormatContext* pNextFormatContext = _SavingContext->pNextFormatContext;
+	if(pNextFormatContext == nullptr)
+	{
+		// Keep recording in the current file rather than losing frames.
+		log->Error("Next segment not available, recording continues in the current file.");
+		_SavingContext->iSegmentDuration = 0;
+		_SavingContext->iSegmentSize = 0;
+		_SavingContext->bRotationDue = false;
+		return;
+	}
+
+	// Streams of the next file were created in the same order as the current ones.
+	_SavingContext->pRetiredFormatContext = _SavingContext->pOutputFormatContext;
+	_SavingContext->pOutputFormatContext = pNextFormatContext;
+	_SavingContext->pNextFormatContext = nullptr;
+	_SavingContext->pOutputVideoStream = pNextFormatContext->streams[_SavingContext->pOutputVideoStream->index];
+	if(_SavingContext->pOutputDataStream != nullptr)
+	{
+		_SavingContext->pOutputDataStream = pNextFormatContext->streams[_SavingContext->pOutputDataStream->index];
+	}
+
+	_SavingContext->iSegmentIndex++;
+	_SavingContext->iSegmentStartPts = _iPts;
+	_SavingContext->bRotationDue = false;
+	Interlocked::Exchange(_SavingContext->iKeyframeRequested, 0);
+
+	log->Debug(String::Format("Recording continues in segment {0}: {1}", _SavingContext->iSegmentIndex, gcnew String(pNextFormatContext->filename)));
+
+	// Each file must reopen with the key images, the metadata goes before the first frame.
+	if(_SavingContext->szMetadata != nullptr && _SavingContext->pOutputDataStream != nullptr && !WriteMetadata(_SavingContext, _SavingContext->szMetadata))
+	{
+		log->Error("metadata not written in the segment");
+	}
+
+	StartSegmentThread();
+}
+
+///<summary>
+/// VideoFileWriter::StartSegmentThread
+/// Finalize the previous file and open the next one without blocking the writing of frames.
+///</summary>
+void VideoFileWriter::StartSegmentThread()
+{
+	m_SegmentThread = gcnew Thread(gcnew ThreadStart(this, &VideoFileWriter::PrepareNextSegment));
+	m_SegmentThread->Name = "Writer - Segment";
+	m_SegmentThread->IsBackground = true;
+	m_SegmentThread->Start();
+}
+
+///<summary>
+/// VideoFileWriter::PrepareNextSegment
+/// Segment thread. Write the trailer of the previous file and open the file following the current one.
+///</summary>
+void VideoFileWriter::PrepareNextSegment()
+{
+	if(m_SavingContext->pRetiredFormatContext != nullptr)
+	{
+		if(!CloseSegmentFile(m_SavingContext->pRetiredFormatContext, m_SavingContext->pOutputCodecContext, true))
+		{
+			log->Error("Previous segment not completely written.");
+			m_SavingContext->bWriteError = true;
+		}
+		m_SavingContext->pRetiredFormatContext = nullptr;
+	}
+
+	m_SavingContext->pNextFormatContext = OpenSegmentFile(m_SavingContext, m_SavingContext->iSegmentIndex + 1);
+}
+
+///<summary>
+/// VideoFileWriter::OpenSegmentFile
+/// Create the muxer of a segment, with the same streams as the current file, and write its header.
+/// Returns null on failure.
+///</summary>
+AVFormatContext* VideoFileWriter::OpenSegmentFile(SavingContext^ _SavingContext, int _iIndex)
+{
+	String^ segmentPath = GetSegmentPath(_SavingContext->szBasePath, _iIndex);
+	char* pFilePath = static_cast<char*>(Marshal::StringToHGlobalAnsi(segmentPath).ToPointer());
+
+	AVFormatContext* pCurrentFormatContext = _SavingContext->pOutputFormatContext;
+	AVFormatContext* pFormatContext = nullptr;
+	bool bOpened = false;
+
+	do
+	{
+		if ((pFormatContext = avformat_alloc_context()) == nullptr) 
+		{
+			log->Error("Segment muxer parameters object not allocated");
+			break;
+		}
+
+		if(!SetupMuxer(pFormatContext, pFilePath, _SavingContext))
+		{
+			log->Error("Segment muxer parameters not set");
+			break;
+		}
+
+		// The encoder keeps running across files, the streams take a copy of its parameters. 
+		// The encoder is in use on another thread, the video stream is copied from the snapshot taken when it was opened.
+		bool bStreamsCreated = true;
+		for(int i = 0; i < (int)pCurrentFormatContext->nb_streams; i++)
+		{
+			AVStream* pSourceStream = pCurrentFormatContext->streams[i];
+			AVCodecContext* pSourceCodec = (i == _SavingContext->pOutputVideoStream->index) ? _SavingContext->pEncoderSnapshot : pSourceStream->codec;
+			AVStream* pStream = av_new_stream(pFormatContext, pSourceStream->id);
+			if(pStream == nullptr || pSourceCodec == nullptr || avcodec_copy_context(pStream->codec, pSourceCodec) < 0)
+			{
+				bStreamsCreated = false;
+				break;
+			}
+
+			pStream->codec->coded_frame = nullptr;
+			pStream->sample_aspect_ratio = pSourceStream->sample_aspect_ratio;
+		}
+
+		if(!bStreamsCreated)
+		{
+			log->Error("Segment streams not created");
+			break;
+		}
+
+		int iFFMpegResult;
+		if ((iFFMpegResult = OpenOutputIO(_SavingContext, pFormatContext, pFilePath)) < 0) 
+		{
+			log->Error(String::Format("Segment file not opened, AVERROR:{0}", iFFMpegResult));
+			break;
+		}
+
+		if((iFFMpegResult = av_write_header(pFormatContext)) < 0)
+		{
+			log->Error(String::Format("Segment file header not written, AVERROR:{0}", iFFMpegResult));
+			break;
+		}
+
+		bOpened = true;
+	}
+	while(false);
+
+	Marshal::FreeHGlobal(safe_cast<IntPtr>(pFilePath));
+
+	if(!bOpened && pFormatContext != nullptr)
+	{
+		CloseSegmentFile(pFormatContext, nullptr, false);
+		pFormatContext = nullptr;
+	}
+
+	return pFormatContext;
+}
+
+///<summary>
+/// VideoFileWriter::CloseSegmentFile
+/// Finalize a segment and release its muxer. 
+/// Stream parameters are released unless they are the encoder itself, which lives until CloseSavingContext.
+/// Returns false if some of the data didn't reach the file.
+///</summary>
+bool VideoFileWriter::CloseSegmentFile(AVFormatContext* _pFormatContext, AVCodecContext* _pEncoderContext, bool _bWriteTrailer)
+{
+	if(_bWriteTrailer)
+	{
+		av_write_trailer(_pFormatContext);
+	}
+
+	for(int i = 0; i < (int)_pFormatContext->nb_streams; i++) 
+	{
+		if(_pFormatContext->streams[i]->codec != _pEncoderContext)
+		{
+			FreeCodecCopy(_pFormatContext->streams[i]->codec);
+			av_freep(&_pFormatContext->streams[i]->codec);
+		}
+
+		av_freep(&_pFormatContext->streams[i]);
+	}
+
+	bool bWritten = CloseOutputIO(_pFormatContext);
+
+	av_free(_pFormatContext);
+
+	return bWritten;
+}
+
+///<summary>
+/// VideoFileWriter::FreeCodecCopy
+/// Release the buffers duplicated by avcodec_copy_context. The context itself is not freed.
+///</summary>
+void VideoFileWriter::FreeCodecCopy(AVCodecContext* _pCodecContext)
+{
+	if(_pCodecContext == nullptr)
+		return;
+
+	av_freep(&_pCodecContext->extradata);
+	av_freep(&_pCodecContext->intra_matrix);
+	av_freep(&_pCodecContext->inter_matrix);
+	av_freep(&_pCodecContext->rc_override);
+	av_freep(&_pCodecContext->rc_eq);
+}
+
+///<summary>
+/// VideoFileWriter::GetSegmentPath
+/// Path of a file of a segmented recording. 
+/// The first file keeps the requested name, the next ones are numbered: video.mkv, video-001.mkv, video-002.mkv, ...
+///</summary>
+String^ VideoFileWriter::GetSegmentPath(String^ _FilePath, int _iIndex)
+{
+	if(_iIndex <= 0)
+		return _FilePath;
+
+	String^ fileName = String::Format("{0}-{1:000}{2}", Path::GetFileNameWithoutExtension(_FilePath), _iIndex, Path::GetExtension(_FilePath));
+	return Path::Combine(Path::GetDirectoryName(_FilePath), fileName);
+}
+
+///<summary>
+/// VideoFileWriter::StorePreRollPacket
+/// Pre-roll. Keep a copy of the packet and forget the GOPs older than the pre-roll duration.
+/// Called under the pre-roll lock.
+///</summary>
+void VideoFileWriter::StorePreRollPacket(SavingContext^ _SavingContext, uint8_t* _pData, int _iSize, int64_t _iPts, int64_t _iTimestamp, bool _bKeyframe)
+{
+	Monitor::Enter(m_PreRollLock);
+	try
+	{
+		// The pre-roll always starts on a keyframe.
+		if(m_PreRollPackets->Count == 0 && !_bKeyframe)
+			return;
+
+		PreRollPacket^ packet = (m_FreePreRollPackets->Count > 0) ? m_FreePreRollPackets->Pop() : gcnew PreRollPacket();
+		if(packet->iBufferSize < _iSize)
+		{
+			av_free(packet->pBuffer);
+			packet->pBuffer = (uint8_t*)av_malloc(_iSize);
+			packet->iBufferSize = (packet->pBuffer == nullptr) ? 0 : _iSize;
+		}
 
-	// Sample Aspect Ratio.
-	
-	// Assume PAR=1:1 (square pixels).
-	_SavingContext->pOutputCodecContext->sample_aspect_ratio.num = 1;
-	_SavingContext->pOutputCodecContext->sample_aspect_ratio.den = 1;
+		if(packet->pBuffer == nullptr)
+		{
+			log->Error("pre-roll packet not allocated");
+			m_FreePreRollPackets->Push(packet);
+			return;
+		}
 
-	if(_SavingContext->fPixelAspectRatio != 1.0)
-	{
-		// -> Anamorphic video, non square pixels.
-		// We also output an anamorphic video.
+		AVRational microseconds = {1, 1000000};
+		memcpy(packet->pBuffer, _pData, _iSize);
+		packet->iSize = _iSize;
+		packet->iPts = _iPts;
+		packet->iTimestamp = _iTimestamp;
+		packet->iTime = (_iTimestamp >= 0) ? _iTimestamp : av_rescale_q(_iPts, _SavingContext->pOutputCodecContext->time_base, microseconds);
+		packet->bKeyframe = _bKeyframe;
+		
+		m_PreRollPackets->Add(packet);
+		m_iPreRollBytes += packet->iSize;
 
-		if(_SavingContext->bInputWasMpeg2)
+		// Start at the most recent keyframe that still covers the whole duration, and recycle everything before it.
+		int64_t iLimit = packet->iTime - _SavingContext->iPreRollDuration;
+		int iFirst = 0;
+		for(int i = 1; i < m_PreRollPackets->Count; i++)
 		{
-			// If MPEG, sample_aspect_ratio is actually the DAR...
-			// Reference for weird decision tree: mpeg12.c at mpeg_decode_postinit().
-			double fDisplayAspectRatio	= (double)m_SavingContext->iSampleAspectRatioNumerator / (double)m_SavingContext->iSampleAspectRatioDenominator;
-			double fPixelAspectRatio	= ((double)_SavingContext->outputSize.Height * fDisplayAspectRatio) / (double)_SavingContext->outputSize.Width;
+			if(m_PreRollPackets[i]->iTime > iLimit)
+				break;
 
-			if(fPixelAspectRatio > 1.0f)
-			{
-				// In this case the input sample aspect ratio was actually the display aspect ratio.
-				// We will recompute the aspect ratio.
-				int gcd = GreatestCommonDenominator((int)((double)_SavingContext->outputSize.Width * fPixelAspectRatio), _SavingContext->outputSize.Width);
-				_SavingContext->pOutputCodecContext->sample_aspect_ratio.num = (int)(((double)_SavingContext->outputSize.Width * fPixelAspectRatio)/gcd);
-				_SavingContext->pOutputCodecContext->sample_aspect_ratio.den = _SavingContext->outputSize.Width / gcd;
-			}
-			else
-			{
-				_SavingContext->pOutputCodecContext->sample_aspect_ratio.num = m_SavingContext->iSampleAspectRatioNumerator;
-				_SavingContext->pOutputCodecContext->sample_aspect_ratio.den = m_SavingContext->iSampleAspectRatioDenominator;
-			}
+			if(m_PreRollPackets[i]->bKeyframe)
+				iFirst = i;
 		}
-		else
+
+		for(int i = 0; i < iFirst; i++)
 		{
-			_SavingContext->pOutputCodecContext->sample_aspect_ratio.num = m_SavingContext->iSampleAspectRatioNumerator;
-			_SavingContext->pOutputCodecContext->sample_aspect_ratio.den = m_SavingContext->iSampleAspectRatioDenominator;
+			m_iPreRollBytes -= m_PreRollPackets[i]->iSize;
+			m_FreePreRollPackets->Push(m_PreRollPackets[i]);
 		}
+		m_PreRollPackets->RemoveRange(0, iFirst);
+	}
+	finally
+	{
+		Monitor::Exit(m_PreRollLock);
 	}
+}
 
-	// Ensure the container stream uses the same aspect ratio.
-	_SavingContext->pOutputVideoStream->sample_aspect_ratio.num = _SavingContext->pOutputCodecContext->sample_aspect_ratio.num;
-	_SavingContext->pOutputVideoStream->sample_aspect_ratio.den = _SavingContext->pOutputCodecContext->sample_aspect_ratio.den;
+///<summary>
+/// VideoFileWriter::FreePreRoll
+/// Release the buffers of the packets kept in memory.
+///</summary>
+void VideoFileWriter::FreePreRoll()
+{
+	if(m_PreRollPackets == nullptr)
+		return;
 
+	for each(PreRollPacket^ packet in m_PreRollPackets)
+	{
+		av_free(packet->pBuffer);
+	}
 	
-	//-----------------------------------
-	// h. Other settings. (From MEncoder) 
-	//-----------------------------------
-	_SavingContext->pOutputCodecContext->strict_std_compliance= -1;		// strictly follow the standard (MPEG4, ...)
-	_SavingContext->pOutputCodecContext->luma_elim_threshold = 0;		// luma single coefficient elimination threshold
-	_SavingContext->pOutputCodecContext->chroma_elim_threshold = 0;		// chroma single coeff elimination threshold
-	_SavingContext->pOutputCodecContext->lumi_masking = 0.0;;
-	_SavingContext->pOutputCodecContext->dark_masking = 0.0;
-	// codecContext->codec_tag							// 4CC : if not set then the default based on codec_id will be used.
-	// pre_me (prepass for motion estimation)
-	// sample_rate
-	// codecContext->channels = 2;
-	// codecContext->mb_decision = 0;
-
-	return true;
+	for each(PreRollPacket^ packet in m_FreePreRollPackets)
+	{
+		av_free(packet->pBuffer);
+	}
 
+	m_PreRollPackets = nullptr;
+	m_FreePreRollPackets = nullptr;
+	m_iPreRollBytes = 0;
 }
+
 ///<summary>
-/// VideoFileWriter::WriteMetadata
-/// Save the xml data in the video file.
+/// VideoFileWriter::StartPipeline
+/// Allocate the recycled frames and start the conversion, encoding and muxing threads.
 ///</summary>
-bool VideoFileWriter::WriteMetadata(SavingContext^ _SavingContext, String^ _Metadata)
+bool VideoFileWriter::StartPipeline(SavingContext^ _SavingContext)
 {
-	// Create packet.
-	AVPacket OutputPacket;
-	av_init_packet(&OutputPacket);					
-	
-	// Packet position.
-	OutputPacket.pts = av_rescale_q(_SavingContext->pOutputCodecContext->coded_frame->pts, _SavingContext->pOutputCodecContext->time_base, _SavingContext->pOutputVideoStream->time_base);
+	//---------------------------------------------------------------------------------------------
+	// The pipeline is made of three stages connected by bounded queues:
+	// SaveFrame (copy) -> Convert (BGRA -> YUV) -> Encode -> Mux (write to file).
+	// The number of frames in flight is fixed. Frames are handed back to the free list once written. 
+	// When the free list is empty, SaveFrame returns QueueFull and the caller decides what to do.
+	//---------------------------------------------------------------------------------------------
+
+	log->Debug(String::Format("Starting encoding pipeline. Capacity:{0} frames, encoder threads:{1}.", _SavingContext->iPipelineCapacity, _SavingContext->iEncoderThreads));
+
+	int iCapacity = _SavingContext->iPipelineCapacity;
+	int iWidth = _SavingContext->outputSize.Width;
+	int iHeight = _SavingContext->outputSize.Height;
+	enum PixelFormat pixelFormat = _SavingContext->pOutputCodecContext->pix_fmt;
+
+	m_bPipelineError = false;
+	m_bPipelineClosing = false;
+	m_iProducers = 0;
+	m_iFramesAccepted = 0;
+	m_iFramesDropped = 0;
+	m_iFramesRejected = 0;
+	m_iMaxPendingFrames = 0;
+	m_PipelineFrames = gcnew List<PipelineFrame^>();
+	m_FreeFrames = gcnew BoundedQueue<PipelineFrame^>(iCapacity);
+	m_ConvertQueue = gcnew BoundedQueue<PipelineFrame^>(iCapacity);
+	m_EncodeQueue = gcnew BoundedQueue<PipelineFrame^>(iCapacity);
+	m_MuxQueue = gcnew BoundedQueue<PipelineFrame^>(iCapacity);
+
+	for(int i=0;i<iCapacity;i++)
+	{
+		PipelineFrame^ frame = gcnew PipelineFrame();
+		m_PipelineFrames->Add(frame);
 
-	// Associate packet to subtitle stream.
-	OutputPacket.stream_index = _SavingContext->pOutputDataStream->index;
+		// The source buffer is allocated on first use, when we know the input size.
+		frame->pPicture = avcodec_alloc_frame();
+		frame->pPictureBuffer = (uint8_t*)av_malloc(avpicture_get_size(pixelFormat, iWidth, iHeight));
+		frame->iPacketBufferSize = 4 * iWidth * iHeight;
+		frame->pPacketBuffer = (uint8_t*)av_malloc(frame->iPacketBufferSize);
 
-	char* pMetadata	= static_cast<char*>(Marshal::StringToHGlobalAnsi(_Metadata).ToPointer());
+		if(frame->pPicture == nullptr || frame->pPictureBuffer == nullptr || frame->pPacketBuffer == nullptr)
+		{
+			log->Error("pipeline frame not allocated");
+			return false;
+		}
 
-	OutputPacket.data = (uint8_t*)pMetadata;
-	OutputPacket.size = _Metadata->Length;
-	
-	// Write to output file.
-	int iWriteRes = av_write_frame(_SavingContext->pOutputFormatContext, &OutputPacket);
+		avpicture_fill((AVPicture *)frame->pPicture, frame->pPictureBuffer, pixelFormat, iWidth, iHeight);
+		m_FreeFrames->Enqueue(frame);
+	}
+
+	m_ConvertThread = gcnew Thread(gcnew ThreadStart(this, &VideoFileWriter::ConvertLoop));
+	m_ConvertThread->Name = "Writer - Convert";
+	m_ConvertThread->IsBackground = true;
 	
-	Marshal::FreeHGlobal(safe_cast<IntPtr>(pMetadata));
+	m_EncodeThread = gcnew Thread(gcnew ThreadStart(this, &VideoFileWriter::EncodeLoop));
+	m_EncodeThread->Name = "Writer - Encode";
+	m_EncodeThread->IsBackground = true;
 
-	return (iWriteRes == 0);
+	m_MuxThread = gcnew Thread(gcnew ThreadStart(this, &VideoFileWriter::MuxLoop));
+	m_MuxThread->Name = "Writer - Mux";
+	m_MuxThread->IsBackground = true;
+
+	m_ConvertThread->Start();
+	m_EncodeThread->Start();
+	m_MuxThread->Start();
+
+	return true;
 }
+
 ///<summary>
-/// VideoFileWriter::EncodeAndWriteVideoFrame
-/// Save a single frame in the video file. Takes a Bitmap as input.
+/// VideoFileWriter::StopPipeline
+/// Drain the stages in order and wait for the threads to finish.
 ///</summary>
-bool VideoFileWriter::EncodeAndWriteVideoFrame(SavingContext^ _SavingContext, Bitmap^ _InputBitmap)
+void VideoFileWriter::StopPipeline()
 {
-	bool bWritten = false;
-	bool bInputFrameAllocated = false;
-	bool bOutputFrameAllocated = false;
-	bool bBitmapLocked = false;
-	
-	AVFrame* pInputFrame;
-	uint8_t* pInputFrameBuffer;
-	AVFrame* pOutputFrame;
-	uint8_t* pOutputFrameBuffer;
-	System::Drawing::Imaging::BitmapData^ InputDataBitmap;
-	enum PixelFormat pixelFormatFFmpeg;
+	if(m_ConvertQueue == nullptr)
+		return;
+
+	log->Debug("Stopping encoding pipeline.");
 
-	if(_InputBitmap->PixelFormat == Imaging::PixelFormat::Format32bppPArgb)
+	// Refuse new frames, wake up the producers waiting for a free frame and wait for the calls in progress, 
+	// they may still be copying into a frame or pushing it.
+	Monitor::Enter(m_ProducersLock);
+	try
 	{
-		pixelFormatFFmpeg = PIX_FMT_BGRA;	
+		m_bPipelineClosing = true;
+		m_FreeFrames->Close();
+		while(m_iProducers > 0)
+		{
+			Monitor::Wait(m_ProducersLock);
+		}
 	}
-	else
+	finally
 	{
-		pixelFormatFFmpeg = PIX_FMT_BGR24;
+		Monitor::Exit(m_ProducersLock);
 	}
 
-	do
+	// Each stage ends when its input queue is closed and empty, 
+	// so closing them in order flushes every frame already accepted.
+	m_ConvertQueue->Close();
+	if(m_ConvertThread != nullptr) m_ConvertThread->Join();
+	m_EncodeQueue->Close();
+	if(m_EncodeThread != nullptr) m_EncodeThread->Join();
+	m_MuxQueue->Close();
+	if(m_MuxThread != nullptr) m_MuxThread->Join();
+
+	m_ConvertThread = nullptr;
+	m_EncodeThread = nullptr;
+	m_MuxThread = nullptr;
+}
+
+///<summary>
+/// VideoFileWriter::FreePipeline
+/// Release the buffers of the recycled frames.
+///</summary>
+void VideoFileWriter::FreePipeline()
+{
+	if(m_PipelineFrames == nullptr)
+		return;
+
+	for each(PipelineFrame^ frame in m_PipelineFrames)
+	{
+		av_free(frame->pSourceBuffer);
+		av_free(frame->pPictureBuffer);
+		av_free(frame->pPacketBuffer);
+		av_free(frame->pPicture);
+	}
+
+	m_PipelineFrames = nullptr;
+	m_FreeFrames = nullptr;
+	m_ConvertQueue = nullptr;
+	m_EncodeQueue = nullptr;
+	m_MuxQueue = nullptr;
+}
+
+///<summary>
+/// VideoFileWriter::EnqueueFrame
+/// Pipelined mode entry point. Copy the input planes into a free frame and push it to the conversion stage.
+/// The caller may reuse the buffers as soon as we return. May be called from several threads.
+/// Closing the writer waits for the calls in progress, calls made after that are refused.
+///</summary>
+SaveResult VideoFileWriter::EnqueueFrame(uint8_t** _pPlanes, int* _pStrides, int _iWidth, int _iHeight, enum PixelFormat _pixelFormat, int64_t _iTimestamp, int _iDuration)
+{
+	Monitor::Enter(m_ProducersLock);
+	try
 	{
-		// Allocate the input frame that we will fill up with the bitmap.
-		if ((pInputFrame = avcodec_alloc_frame()) == nullptr) 
+		if(m_bPipelineClosing)
 		{
-			log->Error("input frame not allocated");
-			break;
-		}	
-		
-		// Allocate the buffer holding actual frame data.
-		int iSizeInputFrameBuffer = avpicture_get_size(pixelFormatFFmpeg, _InputBitmap->Width, _InputBitmap->Height);
-		pInputFrameBuffer = (uint8_t*)av_malloc(iSizeInputFrameBuffer);
-		if (pInputFrameBuffer == nullptr) 
+			log->Error("frame received after the writer was closed");
+			return SaveResult::UnknownError;
+		}
+		m_iProducers++;
+	}
+	finally
+	{
+		Monitor::Exit(m_ProducersLock);
+	}
+
+	SaveResult result = SaveResult::UnknownError;
+	try
+	{
+		result = PushFrame(_pPlanes, _pStrides, _iWidth, _iHeight, _pixelFormat, _iTimestamp, _iDuration);
+	}
+	finally
+	{
+		Monitor::Enter(m_ProducersLock);
+		if(--m_iProducers == 0)
 		{
-			log->Error("input frame buffer not allocated");
-			av_free(pInputFrame);
-			break;
+			Monitor::PulseAll(m_ProducersLock);
 		}
+		Monitor::Exit(m_ProducersLock);
+	}
 
-		bInputFrameAllocated = true;
-		
-		// Setting up various pointers between the buffers.
-		avpicture_fill((AVPicture *)pInputFrame, pInputFrameBuffer, pixelFormatFFmpeg, _InputBitmap->Width, _InputBitmap->Height);
-		
-		// Associate the Bitmap to the AVFrame
-		Rectangle rect = Rectangle(0, 0, _InputBitmap->Width, _InputBitmap->Height);
-		InputDataBitmap = _InputBitmap->LockBits(rect, Imaging::ImageLockMode::ReadOnly, _InputBitmap->PixelFormat);
-		bBitmapLocked = true;
-		// todo : pin_ptr ?
-		uint8_t* data = (uint8_t*)InputDataBitmap->Scan0.ToPointer();
-		pInputFrame->data[0] = data;
-		pInputFrame->linesize[0] = InputDataBitmap->Stride;
-			
+	return result;
+}
 
-		//------------------------------------------------------------------------------------------
-		// -> At that point, pInputFrame holds a non compressed bitmap, at the .NET PIX_FMT (BGRA)
-		// This bitmap is still at the decoding size.
-		//------------------------------------------------------------------------------------------
+///<summary>
+/// VideoFileWriter::PushFrame
+/// Body of EnqueueFrame, runs while the pipeline is known to be open.
+///</summary>
+SaveResult VideoFileWriter::PushFrame(uint8_t** _pPlanes, int* _pStrides, int _iWidth, int _iHeight, enum PixelFormat _pixelFormat, int64_t _iTimestamp, int _iDuration)
+{
+	// Errors of the stages are sticky, the recording stops at the first one.
+	if(m_bPipelineError || m_SavingContext->bWriteError)
+	{
+		log->Error("error while writing output frame");
+		return m_SavingContext->bWriteError ? SaveResult::FileNotWritten : SaveResult::UnknownError;
+	}
 
-		// f. L'objet frame receptacle de sortie.
-		if ((pOutputFrame = avcodec_alloc_frame()) == nullptr) 
+	PipelineFrame^ frame = nullptr;
+	if(!m_FreeFrames->TryDequeue(frame))
+	{
+		// Back-pressure: every frame is still being processed.
+		bool bGotFrame = false;
+		switch(m_QueuePolicy)
 		{
-			log->Error("output frame not allocated");
-			break;
+			case FullQueuePolicy::DropOldest:
+				// Take back a frame waiting for conversion. If the conversion stage is empty, the new frame is rejected.
+				bGotFrame = m_ConvertQueue->TryDequeue(frame);
+				break;
+			case FullQueuePolicy::Wait:
+				bGotFrame = m_FreeFrames->Dequeue(frame);
+				break;
+			default:
+				break;
 		}
-		
-		// g. Le poids d'une image selon le PIX_FMT de sortie et la taille donne. 
-		int iSizeOutputFrameBuffer = avpicture_get_size(_SavingContext->pOutputCodecContext->pix_fmt, _SavingContext->outputSize.Width, _SavingContext->outputSize.Height);
-		
-		// h. Allouer le buffer contenant les donnes relles de la frame.
-		pOutputFrameBuffer = (uint8_t*)av_malloc(iSizeOutputFrameBuffer);
-		if (pOutputFrameBuffer == nullptr) 
+
+		if(!bGotFrame)
 		{
-			log->Error("output frame buffer not allocated");
-			av_free(pOutputFrame);
-			break;
+			if(m_QueuePolicy != FullQueuePolicy::Wait)
+			{
+				Interlocked::Increment(m_iFramesRejected);
+			}
+			return SaveResult::QueueFull;
 		}
 
-		bOutputFrameAllocated = true;
-
-		// i. Mise en place de pointeurs internes reliant certaines adresses  d'autres.
-		avpicture_fill((AVPicture *)pOutputFrame, pOutputFrameBuffer, _SavingContext->pOutputCodecContext->pix_fmt, _SavingContext->outputSize.Width, _SavingContext->outputSize.Height);
-		
-		// j. Nouveau scaling context
-		SwsContext* scalingContext = sws_getContext(_InputBitmap->Width, _InputBitmap->Height, pixelFormatFFmpeg, _SavingContext->outputSize.Width, _SavingContext->outputSize.Height, _SavingContext->pOutputCodecContext->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL); 
-
-		// k. Convertir l'image de son format de pixels d'origine vers le format de pixels de sortie.
-		if (sws_scale(scalingContext, pInputFrame->data, pInputFrame->linesize, 0, _InputBitmap->Height, pOutputFrame->data, pOutputFrame->linesize) < 0) 
+		if(m_QueuePolicy == FullQueuePolicy::DropOldest)
 		{
-			log->Error("scaling failed");
-			sws_freeContext(scalingContext);
-			break;
+			// The replaced frame will never reach the muxer, forget its duration too.
+			Interlocked::Increment(m_iFramesDropped);
+			Monitor::Enter(m_SavingContext->heldFrames);
+			m_SavingContext->heldFrames->Remove(frame->pPicture->pts);
+			Monitor::Exit(m_SavingContext->heldFrames);
 		}
+	}
 
-		sws_freeContext(scalingContext);
-
+	int iPlaneHeights[4];
+	int iPlanes = GetPlaneHeights(_pixelFormat, _iHeight, iPlaneHeights);
+	
+	int iSize = 0;
+	for(int i=0;i<iPlanes;i++)
+	{
+		iSize += Math::Abs(_pStrides[i]) * iPlaneHeights[i];
+	}
 
-		//------------------------------------------------------------------------------------------
-		// -> Ici, pOutputFrame contient une bitmap non compresse, au nouveau PIX_FMT. (=> YUV420P)
-		//------------------------------------------------------------------------------------------
+	if(frame->iSourceBufferSize < iSize)
+	{
+		av_free(frame->pSourceBuffer);
+		frame->pSourceBuffer = (uint8_t*)av_malloc(iSize);
+		frame->iSourceBufferSize = (frame->pSourceBuffer == nullptr) ? 0 : iSize;
+	}
 
+	if(frame->pSourceBuffer == nullptr)
+	{
+		log->Error("input frame buffer not allocated");
+		m_FreeFrames->Enqueue(frame);
+		return SaveResult::UnknownError;
+	}
 
-		// f. allouer le buffer pour les donnes de la frame aprs compression. ( -> valeur tire de ffmpeg.c)
-		int iSizeOutputVideoBuffer = 4 *  _SavingContext->outputSize.Width *  _SavingContext->outputSize.Height;		
-		uint8_t* pOutputVideoBuffer = (uint8_t*)av_malloc(iSizeOutputVideoBuffer);
-		if (pOutputVideoBuffer == nullptr) 
+	int iOffset = 0;
+	for(int i=0;i<4;i++)
+	{
+		if(i < iPlanes)
 		{
-			log->Error("output video buffer not allocated");
-			break;
+			// Bottom-up planes (negative stride) are copied row by row and stored top-down.
+			int iStride = Math::Abs(_pStrides[i]);
+			int iPlaneSize = iStride * iPlaneHeights[i];
+			if(_pStrides[i] >= 0)
+			{
+				memcpy(frame->pSourceBuffer + iOffset, _pPlanes[i], iPlaneSize);
+			}
+			else
+			{
+				for(int y=0;y<iPlaneHeights[i];y++)
+				{
+					memcpy(frame->pSourceBuffer + iOffset + y * iStride, _pPlanes[i] + y * _pStrides[i], iStride);
+				}
+			}
+			frame->iSourceOffsets[i] = iOffset;
+			frame->iSourceStrides[i] = iStride;
+			iOffset += iPlaneSize;
 		}
-		
-		// g. encodage vido.
-		// AccessViolationException ? => problme de memalign. Recompiler libavc avec le bon gcc.
-		int iEncodedSize = avcodec_encode_video(_SavingContext->pOutputCodecContext, pOutputVideoBuffer, iSizeOutputVideoBuffer, pOutputFrame);
-		
-		// Ecriture du packet vido dans le fichier (Force Keyframe)
-		if(!WriteFrame(iEncodedSize, _SavingContext, pOutputVideoBuffer, true ))
+		else
 		{
-			log->Error("problem while writing frame to file");
+			frame->iSourceOffsets[i] = 0;
+			frame->iSourceStrides[i] = 0;
 		}
-		
-		av_free(pOutputVideoBuffer);
-
-		bWritten = true;
 	}
-	while(false);
 
-	// Cleanup
-	if(bInputFrameAllocated)
+	frame->iSourceWidth = _iWidth;
+	frame->iSourceHeight = _iHeight;
+	frame->iSourceFormat = _pixelFormat;
+	frame->iTimestamp = _iTimestamp;
+
+	// The copy above runs concurrently for several producers, 
+	// but the frames must enter the pipeline in the order of their timestamps.
+	bool bQueued = false;
+	Monitor::Enter(m_EnqueueLock);
+	try
 	{
-		av_free(pInputFrameBuffer);
-		av_free(pInputFrame);
+		frame->pPicture->pts = NextPts(m_SavingContext, _iTimestamp, _iDuration);
+		bQueued = m_ConvertQueue->Enqueue(frame);
 	}
-
-	if(bBitmapLocked)
+	finally
 	{
-		_InputBitmap->UnlockBits(InputDataBitmap);
+		Monitor::Exit(m_EnqueueLock);
 	}
 
-	if(bOutputFrameAllocated)
+	if(!bQueued)
 	{
-		av_free(pOutputFrameBuffer);
-		av_free(pOutputFrame);
+		log->Error("conversion stage closed, frame not written");
+		Monitor::Enter(m_SavingContext->heldFrames);
+		m_SavingContext->heldFrames->Remove(frame->pPicture->pts);
+		Monitor::Exit(m_SavingContext->heldFrames);
+		m_FreeFrames->Enqueue(frame);
+		return SaveResult::UnknownError;
 	}
 
-	// (Temporary) fix to OOM error that sometimes happen with very large image size.
-	GC::Collect();
-
-	return bWritten;
+	Interlocked::Increment(m_iFramesAccepted);
+	int iPending = m_FreeFrames->Capacity - m_FreeFrames->Count;
+	if(iPending > m_iMaxPendingFrames)
+	{
+		m_iMaxPendingFrames = iPending;
+	}
+	
+	return SaveResult::Success;
 }
 
 ///<summary>
-/// VideoFileWriter::WriteFrame
-/// Commit a single frame in the video file.
+/// VideoFileWriter::ConvertLoop
+/// Stage 1. Convert the copied pixels to the encoder format and size.
 ///</summary>
-bool VideoFileWriter::WriteFrame(int _iEncodedSize, SavingContext^ _SavingContext, uint8_t* _pOutputVideoBuffer, bool bForceKeyframe)
+void VideoFileWriter::ConvertLoop()
 {
-	if (_iEncodedSize > 0) 
+	BandScaler^ scaler = gcnew BandScaler();
+	PipelineFrame^ frame = nullptr;
+	
+	while(m_ConvertQueue->Dequeue(frame))
 	{
-		AVPacket OutputPacket;
-		av_init_packet(&OutputPacket);
+		uint8_t* pSourceData[4];
+		int iSourceStride[4];
+		for(int i=0;i<4;i++)
+		{
+			pSourceData[i] = (frame->iSourceStrides[i] > 0) ? frame->pSourceBuffer + frame->iSourceOffsets[i] : nullptr;
+			iSourceStride[i] = frame->iSourceStrides[i];
+		}
 
-		// Compute packet position.
-		OutputPacket.pts = av_rescale_q(_SavingContext->pOutputCodecContext->coded_frame->pts, _SavingContext->pOutputCodecContext->time_base, _SavingContext->pOutputVideoStream->time_base);
+		int64_t iConvertStart = Stopwatch::GetTimestamp();
+		bool bConverted = RepackPicture(pSourceData, iSourceStride, frame->iSourceWidth, frame->iSourceHeight, (enum PixelFormat)frame->iSourceFormat, 
+			frame->pPicture, m_SavingContext->outputSize.Width, m_SavingContext->outputSize.Height, m_SavingContext->pOutputCodecContext->pix_fmt);
 
-		// Flag Keyframes as such.
-		if(_SavingContext->pOutputCodecContext->coded_frame->key_frame || bForceKeyframe)
+		if(!bConverted)
 		{
-			OutputPacket.flags |= AV_PKT_FLAG_KEY;
+			// The scaling contexts are kept as long as the input geometry doesn't change.
+			bConverted = scaler->Scale(pSourceData, iSourceStride, frame->iSourceWidth, frame->iSourceHeight, (enum PixelFormat)frame->iSourceFormat, 
+				frame->pPicture->data, frame->pPicture->linesize, m_SavingContext->outputSize.Width, m_SavingContext->outputSize.Height, m_SavingContext->pOutputCodecContext->pix_fmt, 
+				SWS_BICUBIC);
 		}
+		Interlocked::Add(m_SavingContext->stats->iConvertTicks, Stopwatch::GetTimestamp() - iConvertStart);
+		TraceRecorder::Span("Convert", "VideoFileWriter", iConvertStart);
 
-		// Associate various buffers before the commit.
-		OutputPacket.stream_index = _SavingContext->pOutputVideoStream->index;
-		OutputPacket.data= _pOutputVideoBuffer;
-		OutputPacket.size= _iEncodedSize;
+		if(!bConverted)
+		{
+			log->Error("scaling failed");
+			m_bPipelineError = true;
+			m_FreeFrames->Enqueue(frame);
+			continue;
+		}
 
-		// Commit the packet to the file.
-		int iWriteRes = av_write_frame(_SavingContext->pOutputFormatContext, &OutputPacket);
-	} 
-	else
-	{
-		log->Error("encoded size not positive");
+		m_EncodeQueue->Enqueue(frame);
 	}
 
-	return true;
+	delete scaler;
 }
 
+///<summary>
+/// VideoFileWriter::EncodeLoop
+/// Stage 2. Compress the picture. The encoder may use several threads internally.
+///</summary>
+void VideoFileWriter::EncodeLoop()
+{
+	PipelineFrame^ frame = nullptr;
+	
+	while(m_EncodeQueue->Dequeue(frame))
+	{
+		frame->pPicture->quality = m_SavingContext->pOutputCodecContext->global_quality;
+		
+		// The picture is recycled, reset the type forced for a previous rotation.
+		frame->pPicture->pict_type = 0;
+		if(Interlocked::Exchange(m_SavingContext->iKeyframeRequested, 0) == 1)
+		{
+			frame->pPicture->pict_type = FF_I_TYPE;
+		}
+		int64_t iEncodeStart = Stopwatch::GetTimestamp();
+		frame->iPacketSize = avcodec_encode_video(m_SavingContext->pOutputCodecContext, frame->pPacketBuffer, frame->iPacketBufferSize, frame->pPicture);
+		Interlocked::Add(m_SavingContext->stats->iEncodeTicks, Stopwatch::GetTimestamp() - iEncodeStart);
+		TraceRecorder::Span("Encode", "VideoFileWriter", iEncodeStart);
+		Interlocked::Increment(m_SavingContext->stats->iFrames);
+
+		if(frame->iPacketSize < 0)
+		{
+			log->Error("encoding failed");
+			m_bPipelineError = true;
+			m_FreeFrames->Enqueue(frame);
+			continue;
+		}
+
+		// Save the packet properties now, coded_frame will be overwritten by the next frame.
+		frame->iPts = m_SavingContext->pOutputCodecContext->coded_frame->pts;
+		frame->bKeyframe = (m_SavingContext->pOutputCodecContext->coded_frame->key_frame != 0);
+
+		m_MuxQueue->Enqueue(frame);
+	}
+}
 
+///<summary>
+/// VideoFileWriter::MuxLoop
+/// Stage 3. Commit the packets to the file and recycle the frames.
+///</summary>
+void VideoFileWriter::MuxLoop()
+{
+	PipelineFrame^ frame = nullptr;
+	
+	while(m_MuxQueue->Dequeue(frame))
+	{
+		// After a failed write the remaining packets are dropped, the producers are refused from now on.
+		if(frame->iPacketSize > 0 && !m_SavingContext->bWriteError && !WriteFrame(frame->iPacketSize, m_SavingContext, frame->pPacketBuffer, frame->iPts, frame->iTimestamp, frame->bKeyframe))
+		{
+			log->Error("problem while writing frame to file");
+			m_bPipelineError = true;
+		}
 
+		m_FreeFrames->Enqueue(frame);
+	}
+}
 
 int VideoFileWriter::GreatestCommonDenominator(int a, int b)
 {
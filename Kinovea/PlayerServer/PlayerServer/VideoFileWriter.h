@@ -58,21 +58,266 @@ extern "C"
 }
 
 #include <stdio.h>
+#include "AsyncFileOutput.h"
+#include "BoundedQueue.h"
+#include "ColorConversion.h"
 #include "SavingContext.h"
+#include "TraceRecorder.h"
 #include "VideoFile.h"    // <- remove. SaveResult should be declared here.
 
 namespace Kinovea
 {
 namespace VideoFiles
 {
+	/// <summary>
+	/// Pixel formats accepted by the raw buffer SaveFrame.
+	/// Packed formats use a single plane, Yuv420p uses three and Nv12 two.
+	/// YUV and Gray8 frames at the output size are repacked for the encoder without a color conversion.
+	/// </summary>
+	public enum class FramePixelFormat
+	{
+		Bgra32,
+		Bgr24,
+		Gray8,
+		Yuv420p,
+		Nv12,
+		Yuyv422,
+		Uyvy422
+	};
+
+	/// <summary>
+	/// What SaveFrame does in pipelined mode when every frame slot is in use.
+	/// </summary>
+	public enum class FullQueuePolicy
+	{
+		Reject,			// Return QueueFull, the caller keeps its frame.
+		DropOldest,		// Reuse the oldest frame not yet converted, the new frame replaces it.
+		Wait			// Block until a slot is free.
+	};
+
 	public ref class VideoFileWriter
 	{
 
+#pragma region Properties
+	public:
+		/// <summary>
+		/// Run the color conversion, the encoding and the muxing on their own threads.
+		/// SaveFrame then only copies the image and returns. Must be set before OpenSavingContext.
+		/// </summary>
+		property bool Pipelined
+		{
+			bool get(){ return m_bPipelined;}
+			void set(bool _bPipelined){ m_bPipelined = _bPipelined;}
+		}
+		/// <summary>
+		/// Number of threads the encoder may use internally, when the profile doesn't specify it. 
+		/// Must be set before OpenSavingContext.
+		/// </summary>
+		property int EncoderThreads
+		{
+			int get(){ return m_iEncoderThreads;}
+			void set(int _iEncoderThreads){ m_iEncoderThreads = Math::Max(1, _iEncoderThreads);}
+		}
+		/// <summary>
+		/// Maximum number of frames in flight in pipelined mode. Must be set before OpenSavingContext.
+		/// </summary>
+		property int PipelineCapacity
+		{
+			int get(){ return m_iPipelineCapacity;}
+			void set(int _iPipelineCapacity){ m_iPipelineCapacity = Math::Max(1, _iPipelineCapacity);}
+		}
+		/// <summary>
+		/// Behavior of SaveFrame when the pipeline is full. Rejecting by default.
+		/// </summary>
+		property FullQueuePolicy QueuePolicy
+		{
+			FullQueuePolicy get(){ return m_QueuePolicy;}
+			void set(FullQueuePolicy _policy){ m_QueuePolicy = _policy;}
+		}
+		/// <summary>
+		/// Number of frames accepted by SaveFrame in pipelined mode since OpenSavingContext.
+		/// </summary>
+		property int FramesAccepted
+		{
+			int get(){ return m_iFramesAccepted;}
+		}
+		/// <summary>
+		/// Number of frames waiting for conversion that were replaced by a newer one because the pipeline was full.
+		/// </summary>
+		property int FramesDropped
+		{
+			int get(){ return m_iFramesDropped;}
+		}
+		/// <summary>
+		/// Number of incoming frames refused with QueueFull because the pipeline was full.
+		/// </summary>
+		property int FramesRejected
+		{
+			int get(){ return m_iFramesRejected;}
+		}
+		/// <summary>
+		/// Highest number of frames in flight since OpenSavingContext.
+		/// </summary>
+		property int MaxPendingFrames
+		{
+			int get(){ return m_iMaxPendingFrames;}
+		}
+		/// <summary>
+		/// Number of frames accepted by SaveFrame but not yet written to the file.
+		/// </summary>
+		property int PendingFrames
+		{
+			int get(){ return (m_FreeFrames == nullptr) ? 0 : m_FreeFrames->Capacity - m_FreeFrames->Count;}
+		}
+		/// <summary>
+		/// The pipeline has no room for another frame, SaveFrame would return QueueFull.
+		/// </summary>
+		property bool Full
+		{
+			bool get(){ return (m_FreeFrames != nullptr) && (m_FreeFrames->Count == 0);}
+		}
+		/// <summary>
+		/// Start a new file after this number of seconds of recording. 0 for a single file. 
+		/// Files are cut on keyframes and named with GetSegmentPath. Must be set before OpenSavingContext.
+		/// </summary>
+		property double SegmentDuration
+		{
+			double get(){ return m_fSegmentDuration;}
+			void set(double _fSegmentDuration){ m_fSegmentDuration = Math::Max(0.0, _fSegmentDuration);}
+		}
+		/// <summary>
+		/// Start a new file once the current one reaches this number of bytes. 0 for no size limit.
+		/// Must be set before OpenSavingContext.
+		/// </summary>
+		property int64_t SegmentSize
+		{
+			int64_t get(){ return m_iSegmentSize;}
+			void set(int64_t _iSegmentSize){ m_iSegmentSize = Math::Max((int64_t)0, _iSegmentSize);}
+		}
+		/// <summary>
+		/// Write the file from a dedicated thread, so a slow disk doesn't stall the encoding. 
+		/// Must be set before OpenSavingContext.
+		/// </summary>
+		property bool AsyncWrite
+		{
+			bool get(){ return m_bAsyncWrite;}
+			void set(bool _bAsyncWrite){ m_bAsyncWrite = _bAsyncWrite;}
+		}
+		/// <summary>
+		/// Maximum number of bytes given by the muxer and not yet on disk, in asynchronous mode.
+		/// Must be set before OpenSavingContext.
+		/// </summary>
+		property int64_t WriteBudget
+		{
+			int64_t get(){ return m_iWriteBudget;}
+			void set(int64_t _iWriteBudget){ m_iWriteBudget = Math::Max((int64_t)0, _iWriteBudget);}
+		}
+		/// <summary>
+		/// Time spent converting, encoding and writing since OpenSavingContext. A copy, safe to keep.
+		/// </summary>
+		property EncodingStats^ Stats
+		{
+			EncodingStats^ get(){ return (m_SavingContext == nullptr) ? nullptr : m_SavingContext->stats->Snapshot();}
+		}
+		/// <summary>
+		/// Disk statistics of the current recording in asynchronous mode, null otherwise.
+		/// </summary>
+		property AsyncWriteStats^ WriteStats
+		{
+			AsyncWriteStats^ get(){ return (m_SavingContext == nullptr) ? nullptr : m_SavingContext->writeStats;}
+		}
+		/// <summary>
+		/// Keep the file playable while it is written and after a crash. 
+		/// The file is always Matroska, and the buffered bytes are pushed to the file every FlushInterval.
+		/// Must be set before OpenSavingContext.
+		/// </summary>
+		property bool StreamingSafe
+		{
+			bool get(){ return m_bStreamingSafe;}
+			void set(bool _bStreamingSafe){ m_bStreamingSafe = _bStreamingSafe;}
+		}
+		/// <summary>
+		/// Maximum number of seconds of recording buffered in memory in streaming safe mode.
+		/// </summary>
+		property double FlushInterval
+		{
+			double get(){ return m_fFlushInterval;}
+			void set(double _fFlushInterval){ m_fFlushInterval = Math::Max(0.0, _fFlushInterval);}
+		}
+		/// <summary>
+		/// Keep this number of seconds of compressed frames in memory instead of writing to the file. 
+		/// The file is only created when Trigger is called, and starts with the frames kept. 0 to write right away.
+		/// Must be set before OpenSavingContext.
+		/// </summary>
+		property double PreRollDuration
+		{
+			double get(){ return m_fPreRollDuration;}
+			void set(double _fPreRollDuration){ m_fPreRollDuration = Math::Max(0.0, _fPreRollDuration);}
+		}
+		/// <summary>
+		/// Memory used by the frames kept for the pre-roll, in bytes.
+		/// </summary>
+		property int64_t PreRollBytes
+		{
+			int64_t get(){ return m_iPreRollBytes;}
+		}
+		/// <summary>
+		/// Number of the file currently written, 0 for the first one.
+		/// </summary>
+		property int SegmentIndex
+		{
+			int get(){ return (m_SavingContext == nullptr) ? 0 : m_SavingContext->iSegmentIndex;}
+		}
+#pragma endregion
+
 #pragma region Members
 	private :
 		static log4net::ILog^ log = log4net::LogManager::GetLogger(MethodBase::GetCurrentMethod()->DeclaringType);
 		
 		SavingContext^ m_SavingContext;
+
+		// Pipelining.
+		bool m_bPipelined;
+		int m_iEncoderThreads;
+		int m_iPipelineCapacity;
+		bool m_bPipelineError;
+		List<PipelineFrame^>^ m_PipelineFrames;
+		BoundedQueue<PipelineFrame^>^ m_FreeFrames;
+		BoundedQueue<PipelineFrame^>^ m_ConvertQueue;
+		BoundedQueue<PipelineFrame^>^ m_EncodeQueue;
+		BoundedQueue<PipelineFrame^>^ m_MuxQueue;
+		Thread^ m_ConvertThread;
+		Thread^ m_EncodeThread;
+		Thread^ m_MuxThread;
+		FullQueuePolicy m_QueuePolicy;
+		Object^ m_EnqueueLock;
+		Object^ m_ProducersLock;				// Guards the two fields below.
+		bool m_bPipelineClosing;				// Set by StopPipeline, later calls to EnqueueFrame are refused.
+		int m_iProducers;						// Calls to EnqueueFrame in progress.
+		int m_iFramesAccepted;
+		int m_iFramesDropped;
+		int m_iFramesRejected;
+		int m_iMaxPendingFrames;
+
+		// Segmented recording.
+		double m_fSegmentDuration;
+		int64_t m_iSegmentSize;
+		Thread^ m_SegmentThread;
+
+		// Asynchronous output.
+		bool m_bAsyncWrite;
+		int64_t m_iWriteBudget;
+
+		// Streaming safe output.
+		bool m_bStreamingSafe;
+		double m_fFlushInterval;
+
+		// Pre-roll.
+		double m_fPreRollDuration;
+		List<PreRollPacket^>^ m_PreRollPackets;
+		Stack<PreRollPacket^>^ m_FreePreRollPackets;
+		int64_t m_iPreRollBytes;
+		Object^ m_PreRollLock;
 #pragma endregion
 
 #pragma region Construction/Destruction
@@ -87,9 +332,30 @@ namespace VideoFiles
 	public:
 		
 		SaveResult OpenSavingContext(String^ _FilePath, InfosVideo^ _infosVideo, double _fFramesInterval, bool _bHasMetadata);
+		SaveResult OpenSavingContext(String^ _FilePath, InfosVideo^ _infosVideo, double _fFramesInterval, bool _bHasMetadata, EncodingProfile^ _profile);
 		SaveResult CloseSavingContext(bool _bEncodingSuccess);
+		SaveResult Trigger();
 		SaveResult SaveFrame(Bitmap^ _image);
+		SaveResult SaveFrame(Bitmap^ _image, int64_t _iTimestamp);
+		SaveResult SaveFrame(Bitmap^ _image, int64_t _iTimestamp, int _iDuration);
+		SaveResult SaveFrame(array<IntPtr>^ _planes, array<int>^ _strides, int _iWidth, int _iHeight, FramePixelFormat _format, int64_t _iTimestamp);
+		SaveResult SaveFrame(array<IntPtr>^ _planes, array<int>^ _strides, int _iWidth, int _iHeight, FramePixelFormat _format, int64_t _iTimestamp, int _iDuration);
 		SaveResult SaveMetadata(String^ _Metadata);
+
+		static List<String^>^ GetSupportedEncoders();
+		static bool IsEncoderSupported(String^ _EncoderName);
+		static String^ GetSegmentPath(String^ _FilePath, int _iIndex);
+
+	internal:
+		// Stream copy.
+		static bool CanRemux(String^ _FilePath, AVCodecContext* _pInputCodecContext, bool _bHasMetadata);
+		SaveResult OpenRemuxContext(String^ _FilePath, AVStream* _pInputStream, bool _bHasMetadata);
+		SaveResult WritePacket(AVPacket* _pPacket, AVRational _timeBase);
+
+		// Smart rendering.
+		static bool CanSmartRender(AVCodecContext* _pInputCodecContext);
+		SaveResult OpenRenderEncoder();
+		SaveResult RenderPacket(Bitmap^ _image, int64_t _iTimestamp, int _iDuration, AVRational _timeBase);
 		
 #pragma endregion
 
@@ -97,11 +363,51 @@ namespace VideoFiles
 	private:
 		static AVOutputFormat* GuessOutputFormat(String^ _FilePath, bool _bHasMetadata);
 		bool	SetupMuxer(SavingContext^ _SavingContext);
+		bool	SetupMuxer(AVFormatContext* _pFormatContext, char* _pFilePath, SavingContext^ _SavingContext);
 		bool	SetupEncoder(SavingContext^ _SavingContext);
+		bool	SetupMetadataStream(SavingContext^ _SavingContext);
+		SaveResult OpenOutputFile(SavingContext^ _SavingContext);
+		int		OpenOutputIO(SavingContext^ _SavingContext, AVFormatContext* _pFormatContext, char* _pFilePath);
+		static bool CloseOutputIO(AVFormatContext* _pFormatContext);
+		SaveResult MuxPacket(AVPacket* _pPacket, AVRational _timeBase);
+		static AVCodec* FindEncoder(String^ _EncoderName);
+		static bool IsCodecSupportedByMuxer(AVOutputFormat* _pOutputFormat, enum CodecID _codecId);
+		static int GetEncoderThreads(AVCodecContext* _pCodecContext, int _iThreads);
+		static enum PixelFormat GetBitmapPixelFormat(Imaging::PixelFormat _format);
+		static int GetMpeg4HeaderSize(uint8_t* _pData, int _iSize);
+		static bool IsMpeg4Header(uint8_t* _pData, int _iSize);
 		
 		bool    WriteMetadata(SavingContext^ _SavingContext, String^ _Metadata);
-		bool	EncodeAndWriteVideoFrame(SavingContext^ _SavingContext, Bitmap^ _InputBitmap);
-		bool	WriteFrame(int _iEncodedSize, SavingContext^ _SavingContext, uint8_t* _pOutputVideoBuffer, bool _bForceKeyframe);
+		SaveResult SaveFrame(uint8_t** _pPlanes, int* _pStrides, int _iWidth, int _iHeight, enum PixelFormat _pixelFormat, int64_t _iTimestamp, int _iDuration);
+		bool	EncodeAndWriteVideoFrame(SavingContext^ _SavingContext, uint8_t** _pPlanes, int* _pStrides, int _iWidth, int _iHeight, enum PixelFormat _pixelFormat, int64_t _iTimestamp, int _iDuration);
+		static int64_t NextPts(SavingContext^ _SavingContext, int64_t _iTimestamp, int _iDuration);
+		static int GetPlaneHeights(enum PixelFormat _pixelFormat, int _iHeight, int* _pHeights);
+		static bool RepackPicture(uint8_t** _pPlanes, int* _pStrides, int _iWidth, int _iHeight, enum PixelFormat _pixelFormat, AVFrame* _pPicture, int _iOutputWidth, int _iOutputHeight, enum PixelFormat _outputFormat);
+		bool	WriteFrame(int _iEncodedSize, SavingContext^ _SavingContext, uint8_t* _pOutputVideoBuffer, int64_t _iPts, int64_t _iTimestamp, bool _bKeyframe);
+		bool	MuxFrame(int _iEncodedSize, SavingContext^ _SavingContext, uint8_t* _pOutputVideoBuffer, int64_t _iPts, int64_t _iTimestamp, bool _bKeyframe);
+		
+		// Segmented recording.
+		void	UpdateSegment(SavingContext^ _SavingContext, int64_t _iPts, bool _bKeyframe);
+		void	RotateSegment(SavingContext^ _SavingContext, int64_t _iPts);
+		void	StartSegmentThread();
+		void	PrepareNextSegment();
+		AVFormatContext* OpenSegmentFile(SavingContext^ _SavingContext, int _iIndex);
+		static bool CloseSegmentFile(AVFormatContext* _pFormatContext, AVCodecContext* _pEncoderContext, bool _bWriteTrailer);
+		static void FreeCodecCopy(AVCodecContext* _pCodecContext);
+
+		// Pre-roll.
+		void	StorePreRollPacket(SavingContext^ _SavingContext, uint8_t* _pData, int _iSize, int64_t _iPts, int64_t _iTimestamp, bool _bKeyframe);
+		void	FreePreRoll();
+		
+		// Pipelined mode.
+		bool	StartPipeline(SavingContext^ _SavingContext);
+		void	StopPipeline();
+		void	FreePipeline();
+		SaveResult EnqueueFrame(uint8_t** _pPlanes, int* _pStrides, int _iWidth, int _iHeight, enum PixelFormat _pixelFormat, int64_t _iTimestamp, int _iDuration);
+		SaveResult PushFrame(uint8_t** _pPlanes, int* _pStrides, int _iWidth, int _iHeight, enum PixelFormat _pixelFormat, int64_t _iTimestamp, int _iDuration);
+		void	ConvertLoop();
+		void	EncodeLoop();
+		void	MuxLoop();
 		void	SanityCheck(AVFormatContext* s);
 		static int GreatestCommonDenominator(int a, int b);
 
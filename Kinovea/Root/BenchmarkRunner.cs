@@ -0,0 +1,161 @@
+/*
+Copyright  Kinovea contributors 2026.
+
+This file is part of Kinovea.
+
+Kinovea is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License version 2
+as published by the Free Software Foundation.
+
+Kinovea is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Kinovea. If not, see http://www.gnu.org/licenses/.
+
+ */
+
+using Kinovea.VideoFiles;
+using log4net;
+using System;
+using System.IO;
+using System.Reflection;
+
+namespace Kinovea.Root
+{
+    /// <summary>
+    ///     Runs the PlayerServer benchmarks without the user interface, for regression tracking.
+    ///     kinovea.exe -benchmark [directory] : performance benchmarks, then the seek accuracy check.
+    ///     kinovea.exe -seekcheck [directory] : seek accuracy check only.
+    ///     The clips are generated in the directory (default: the temporary folder) and deleted afterwards,
+    ///     the results are written there as benchmark-[date].xml.
+    ///     The exit code is 0 on success, 1 if a seek returned the wrong image, 2 if the clips could not be generated.
+    /// </summary>
+    internal static class BenchmarkRunner
+    {
+        public static readonly string BenchmarkSwitch = "-benchmark";
+        public static readonly string SeekCheckSwitch = "-seekcheck";
+
+        private const int ExitSuccess = 0;
+        private const int ExitSeekCheckFailed = 1;
+        private const int ExitClipsNotGenerated = 2;
+        private const int SeekCount = 2000;
+
+        private static readonly ILog Log = LogManager.GetLogger(MethodBase.GetCurrentMethod().DeclaringType);
+
+        /// <summary>
+        ///     Index of the switch in the command line, -1 if absent.
+        /// </summary>
+        public static int FindSwitch(string[] args, string name)
+        {
+            // The first argument is the executable.
+            for (var i = 1; i < args.Length; i++)
+            {
+                if (string.Compare(args[i].Trim(), name, StringComparison.OrdinalIgnoreCase) == 0)
+                    return i;
+            }
+
+            return -1;
+        }
+
+        public static bool IsRequested(string[] args)
+        {
+            return FindSwitch(args, BenchmarkSwitch) >= 0 || FindSwitch(args, SeekCheckSwitch) >= 0;
+        }
+
+        public static int Run(string[] args)
+        {
+            var seekOnly = FindSwitch(args, BenchmarkSwitch) < 0;
+            var directory = GetDirectory(args, seekOnly ? FindSwitch(args, SeekCheckSwitch) : FindSwitch(args, BenchmarkSwitch));
+            var benchmark = new VideoBenchmark(directory);
+            var exitCode = ExitSuccess;
+
+            Log.DebugFormat("Running the benchmarks in {0}.", directory);
+
+            if (!seekOnly)
+                exitCode = RunPerformance(benchmark);
+
+            if (exitCode == ExitSuccess)
+                exitCode = RunSeekCheck(benchmark);
+
+            WriteResults(benchmark, directory);
+
+            Log.DebugFormat("Benchmarks finished. Exit code: {0}.", exitCode);
+            return exitCode;
+        }
+
+        private static int RunPerformance(VideoBenchmark benchmark)
+        {
+            benchmark.Clips = VideoBenchmark.DefaultClips();
+
+            try
+            {
+                if (!benchmark.GenerateClips())
+                {
+                    Log.Error("Benchmark clips not generated.");
+                    return ExitClipsNotGenerated;
+                }
+
+                benchmark.RunDecode();
+                benchmark.RunEncode();
+                benchmark.RunExport();
+                return ExitSuccess;
+            }
+            finally
+            {
+                benchmark.DeleteClips();
+            }
+        }
+
+        private static int RunSeekCheck(VideoBenchmark benchmark)
+        {
+            // A seek landing on the wrong image means one of the seek workarounds of VideoFile regressed.
+            benchmark.Clips = VideoBenchmark.SeekClips();
+
+            try
+            {
+                if (!benchmark.GenerateClips())
+                {
+                    Log.Error("Seek check clips not generated.");
+                    return ExitClipsNotGenerated;
+                }
+
+                if (!benchmark.RunSeekAccuracy(SeekCount))
+                {
+                    Log.Error("Seek check failed.");
+                    return ExitSeekCheckFailed;
+                }
+
+                return ExitSuccess;
+            }
+            finally
+            {
+                benchmark.DeleteClips();
+            }
+        }
+
+        private static string GetDirectory(string[] args, int index)
+        {
+            // Optional value right after the switch.
+            if (index >= 0 && index + 1 < args.Length && !args[index + 1].StartsWith("-"))
+            {
+                var directory = args[index + 1];
+                if (!Directory.Exists(directory))
+                    Directory.CreateDirectory(directory);
+                return directory;
+            }
+
+            return Path.GetTempPath();
+        }
+
+        private static void WriteResults(VideoBenchmark benchmark, string directory)
+        {
+            var file = string.Format("benchmark-{0:yyyyMMdd-HHmmss}.xml", DateTime.Now);
+            var path = Path.Combine(directory, file);
+            benchmark.WriteResults(path);
+            Log.DebugFormat("Benchmark results written to {0}.", path);
+        }
+    }
+}
@@ -18,6 +18,7 @@
 
  */
 
+using Kinovea.VideoFiles;
 using log4net;
 using log4net.Config;
 using System;
@@ -35,6 +36,8 @@ internal static class Program
     {
         public static Mutex Mutex;
         private static readonly string _appGuid = "b049b83e-90f3-4e84-9289-52ee6ea2a9ea";
+        private static readonly string TraceSwitch = "-trace";
+        private static readonly int TraceCapacity = 100000;
         private static readonly ILog Log = LogManager.GetLogger(MethodBase.GetCurrentMethod().DeclaringType);
 
         private static bool FirstInstance
@@ -52,6 +55,16 @@ private static void Main()
         {
             AppDomain.CurrentDomain.UnhandledException += AppDomain_UnhandledException;
 
+            // Benchmarks run without the user interface and report through the exit code.
+            var args = Environment.GetCommandLineArgs();
+            if (BenchmarkRunner.IsRequested(args))
+            {
+                SanityCheckDirectories();
+                Thread.CurrentThread.Name = "Main";
+                Environment.ExitCode = BenchmarkRunner.Run(args);
+                return;
+            }
+
             //--------------------------------------------------------
             // Each time the program runs, we try to register a mutex.
             // If it fails, we are already running.
@@ -78,11 +91,33 @@ private static void Main()
                 Log.Debug("Close splash screen.");
                 splashForm.Close();
 
+                // Opt-in timeline of the video engine, written on exit to be attached to a bug report.
+                if (BenchmarkRunner.FindSwitch(args, TraceSwitch) >= 0)
+                {
+                    Log.Debug("Recording a trace.");
+                    TraceRecorder.Start(TraceCapacity);
+                }
+
                 Log.Debug("Launch.");
                 kernel.Launch();
+
+                WriteTrace();
             }
         }
 
+        private static void WriteTrace()
+        {
+            if (!TraceRecorder.Enabled)
+                return;
+
+            var prefDir = Environment.GetFolderPath(Environment.SpecialFolder.ApplicationData) + "\\Kinovea\\";
+            var path = prefDir + string.Format("Trace - {0:yyyy-MM-dd HH.mm.ss}.json", DateTime.Now);
+            if (TraceRecorder.WriteChromeTrace(path))
+                Log.DebugFormat("Trace written to {0}.", path);
+
+            TraceRecorder.Stop();
+        }
+
         private static void SanityCheckDirectories()
         {
             // Create the Kinovea folder under App Data if it doesn't exist.
@@ -131,6 +166,9 @@ private static void AppDomain_UnhandledException(object sender, UnhandledExcepti
             Log.Error(target);
             Log.Error(inner);
             Log.Error(trace);
+
+            // Keep what led to the crash when tracing.
+            WriteTrace();
         }
     }
 }
\ No newline at end of file
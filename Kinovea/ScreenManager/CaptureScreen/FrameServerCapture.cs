@@ -472,6 +472,7 @@ private void DisplayError(SaveResult result)
             {
                 case SaveResult.FileHeaderNotWritten:
                 case SaveResult.FileNotOpened:
+                case SaveResult.FileNotWritten:
                     DisplayErrorMessage(ScreenManagerLang.Error_SaveMovie_FileError);
                     break;
 
@@ -545,9 +546,8 @@ private void FrameGrabbed_Invoked(object sender, EventArgs e)
 
             if (IsRecording && _mVideoRecorder != null && _mVideoRecorder.Initialized)
             {
-                // The recorder runs in its own thread.
-                // We need to make a full copy of the frame because m_ImageToDisplay may change before we actually save it.
-                // TODO: drop mechanism in case the frame queue grows too big.
+                // The writer copies the pixels and returns immediately, dropping its oldest frame if it can't keep up.
+                // The flushed image is needed anyway to burn the drawings in, it may be kept as the capture thumbnail.
                 if (!_mVideoRecorder.Cancelling)
                 {
                     var bmp = GetFlushedImage();
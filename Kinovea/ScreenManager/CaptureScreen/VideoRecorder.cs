@@ -24,7 +24,7 @@
 using Kinovea.VideoFiles;
 using log4net;
 using System;
-using System.Collections.Generic;
+using System.Diagnostics;
 using System.Drawing;
 using System.Reflection;
 using System.Threading;
@@ -32,108 +32,14 @@
 namespace Kinovea.ScreenManager
 {
     /// <summary>
-    ///     VideoRecorder - Saves images to a file using the producer-consumer paradigm.
-    ///     The class hosts a queue of frames to save, and process them as fast as possible in its own thread.
-    ///     Once all frames in the queue are processed, it just waits for the producer to add some more or signal stop.
-    ///     The producer push frames in the queue and set the signal.
-    ///     The frames pushed have to be deep copies since we don't know when we will be able to handle them.
-    ///     Ref: http://www.albahari.com/threading/part2.aspx#_Signaling_with_Event_Wait_Handles
+    ///     VideoRecorder - Saves images to a file.
+    ///     Each frame is stamped and handed to the writer, which copies its pixels into one of its own frame slots
+    ///     and returns immediately. Conversion, encoding and disk writes happen on the writer threads.
+    ///     When every slot is in use the oldest frame waiting for conversion is dropped, the producer never waits for the encoder.
+    ///     EnqueueFrame may be called from several threads. Dispose may run at the same time, frames arriving after it are discarded.
     /// </summary>
     public class VideoRecorder : IDisposable
     {
-        #region Constructor
-
-        public VideoRecorder()
-        {
-            _mWorkerThread = new Thread(Work);
-        }
-
-        #endregion Constructor
-
-        #region Private Methods
-
-        private void Work()
-        {
-            Thread.CurrentThread.Name = "Record";
-
-            while (!Cancelling)
-            {
-                Bitmap bmp = null;
-                lock (_mLocker)
-                {
-                    if (_mFrameQueue.Count > 0)
-                    {
-                        bmp = _mFrameQueue.Dequeue();
-                        if (bmp == null)
-                        {
-                            Log.Debug("Recording thread finished.");
-                            return;
-                        }
-                    }
-                }
-
-                if (bmp != null)
-                {
-                    var res = _mVideoFileWriter.SaveFrame(bmp);
-
-                    if (res != SaveResult.Success)
-                    {
-                        // Start cancellation procedure
-                        // The producer should test for .Cancelling and stop queuing items at this point.
-                        // We don't try to save the outstanding frames, but the video file should be valid.
-                        Log.Error("Error while saving frame to file.");
-                        Cancelling = true;
-                        CancelReason = res;
-
-                        bmp.Dispose();
-
-                        lock (_mLocker)
-                        {
-                            while (_mFrameQueue.Count > 0)
-                            {
-                                var outstanding = _mFrameQueue.Dequeue();
-                                if (outstanding != null)
-                                {
-                                    outstanding.Dispose();
-                                }
-                            }
-
-                            if (Initialized)
-                            {
-                                try
-                                {
-                                    _mVideoFileWriter.CloseSavingContext(true);
-                                }
-                                catch (Exception exp)
-                                {
-                                    Log.Error(exp.Message);
-                                    Log.Error(exp.StackTrace);
-                                }
-                            }
-                        }
-
-                        _mWaitHandle.Close();
-                        return;
-                    }
-                    if (!_mBCaptureThumbSet)
-                    {
-                        CaptureThumb = bmp;
-                        _mBCaptureThumbSet = true;
-                    }
-                    else
-                    {
-                        bmp.Dispose();
-                    }
-                }
-                else
-                {
-                    _mWaitHandle.WaitOne();
-                }
-            }
-        }
-
-        #endregion Private Methods
-
         #region Properties
 
         public bool Initialized { get; private set; }
@@ -146,19 +52,57 @@ private void Work()
 
         public bool Full
         {
-            get { return _mFrameQueue.Count > MICapacity; }
+            get { return _mVideoFileWriter.Full; }
         }
 
+        /// <summary>
+        ///     Frames replaced by newer ones because the writer could not keep up.
+        /// </summary>
+        public int DroppedFrames
+        {
+            get { return _mVideoFileWriter.FramesDropped; }
+        }
+
+        /// <summary>
+        ///     Frames refused because every slot was busy further down the pipeline.
+        /// </summary>
+        public int RejectedFrames
+        {
+            get { return _mVideoFileWriter.FramesRejected; }
+        }
+
+        /// <summary>
+        ///     Start a new file every this number of seconds, 0 to record a single file. Must be set before Initialize.
+        /// </summary>
+        public double SegmentDuration { get; set; }
+
+        /// <summary>
+        ///     Start a new file when the current one reaches this number of bytes, 0 for no limit. Must be set before Initialize.
+        /// </summary>
+        public long SegmentSize { get; set; }
+
+        /// <summary>
+        ///     Seconds of compressed frames kept in memory until Trigger is called, 0 to write the file right away.
+        ///     Must be set before Initialize.
+        /// </summary>
+        public double PreRollDuration { get; set; }
+
+        /// <summary>
+        ///     Record to Matroska, flushed every second, so the file stays readable if the program stops abruptly.
+        ///     Must be set before Initialize.
+        /// </summary>
+        public bool StreamingSafe { get; set; }
+
         #endregion Properties
 
         #region Members
 
-        private readonly EventWaitHandle _mWaitHandle = new AutoResetEvent(false);
-        private readonly Thread _mWorkerThread;
         private readonly object _mLocker = new object();
-        private readonly Queue<Bitmap> _mFrameQueue = new Queue<Bitmap>();
+        private readonly Stopwatch _mClock = new Stopwatch();
         private readonly VideoFileWriter _mVideoFileWriter = new VideoFileWriter();
         private bool _mBCaptureThumbSet;
+        private bool _mClosed;
+        private int _mIFramesInFlight;
         private static readonly int MICapacity = 5;
 
         private static readonly ILog Log = LogManager.GetLogger(MethodBase.GetCurrentMethod().DeclaringType);
@@ -169,8 +113,7 @@ public bool Full
 
         public SaveResult Initialize(string filepath, double interval, Size frameSize)
         {
-            // Open the recording context and start the recording thread.
-            // The thread will then wait for the first frame to drop in.
+            // Open the recording context. The writer starts its own threads.
 
             // FIXME: The FileWriter will currently only use the original size due to some problems.
             // Most notably, DV video passed into 16:9 (720x405) crashes swscale().
@@ -179,13 +122,26 @@ public SaveResult Initialize(string filepath, double interval, Size frameSize)
             iv.iWidth = frameSize.Width;
             iv.iHeight = frameSize.Height;
 
+            // Convert, encode and write on separate threads so a single core doesn't limit the frame rate.
+            _mVideoFileWriter.Pipelined = true;
+            _mVideoFileWriter.EncoderThreads = Environment.ProcessorCount;
+            _mVideoFileWriter.PipelineCapacity = Math.Max(MICapacity, Environment.ProcessorCount + 3);
+            _mVideoFileWriter.QueuePolicy = FullQueuePolicy.DropOldest;
+
+            // Disk writes on their own thread, so a slow or network drive doesn't stall the encoder.
+            _mVideoFileWriter.AsyncWrite = true;
+
+            _mVideoFileWriter.SegmentDuration = SegmentDuration;
+            _mVideoFileWriter.SegmentSize = SegmentSize;
+            _mVideoFileWriter.PreRollDuration = PreRollDuration;
+            _mVideoFileWriter.StreamingSafe = StreamingSafe;
+
             var result = _mVideoFileWriter.OpenSavingContext(filepath, iv, interval, false);
 
             if (result == SaveResult.Success)
             {
                 Initialized = true;
                 _mBCaptureThumbSet = false;
-                _mWorkerThread.Start();
             }
             else
             {
@@ -206,31 +162,135 @@ public SaveResult Initialize(string filepath, double interval, Size frameSize)
 
         public void Dispose()
         {
-            if (!Cancelling)
+            lock (_mLocker)
             {
-                EnqueueFrame(null); // Signal the consumer to exit.
-                _mWorkerThread.Join(); // Wait for the consumer's thread to finish.
-                _mWaitHandle.Close(); // Release any OS resources.
+                if (Cancelling || !Initialized || _mClosed)
+                    return;
 
-                if (Initialized)
-                    _mVideoFileWriter.CloseSavingContext(true);
+                // Stop accepting frames and let the ones being handed over finish, the writer flushes the rest.
+                _mClosed = true;
+                WaitFramesInFlight();
             }
+
+            _mVideoFileWriter.CloseSavingContext(true);
+            Log.DebugFormat("Recording finished. Frames:{0}, dropped:{1}, rejected:{2}, max pending:{3}.",
+                _mVideoFileWriter.FramesAccepted, _mVideoFileWriter.FramesDropped, _mVideoFileWriter.FramesRejected, _mVideoFileWriter.MaxPendingFrames);
+        }
+
+        /// <summary>
+        ///     Pre-roll mode. Create the file, starting with the frames kept in memory.
+        /// </summary>
+        public SaveResult Trigger()
+        {
+            if (!Initialized || Cancelling)
+                return SaveResult.UnknownError;
+
+            return _mVideoFileWriter.Trigger();
         }
 
+        /// <summary>
+        ///     Hand a frame to the writer. The pixels are copied, the caller keeps ownership of the bitmap
+        ///     unless it becomes the capture thumbnail.
+        /// </summary>
         public void EnqueueFrame(Bitmap frame)
         {
-            if (!Cancelling)
+            // The state is checked and the frame counted in flight under the same lock as Dispose,
+            // the writer is only closed once every frame in flight has been handed over.
+            long timestamp;
+            lock (_mLocker)
+            {
+                if (Cancelling || !Initialized || _mClosed)
+                {
+                    frame.Dispose();
+                    return;
+                }
+
+                // Frames are stamped on arrival so stalls of the writer don't compress the timeline.
+                // The first frame is at 0.
+                if (!_mClock.IsRunning)
+                    _mClock.Start();
+
+                timestamp = (long)(_mClock.Elapsed.TotalMilliseconds * 1000);
+                _mIFramesInFlight++;
+            }
+
+            // The pixel copy happens outside the lock, so several producers copy at the same time.
+            SaveResult res;
+            try
+            {
+                res = _mVideoFileWriter.SaveFrame(frame, timestamp);
+            }
+            finally
             {
                 lock (_mLocker)
                 {
-                    // TODO: prevent overflowing the queue.
-                    _mFrameQueue.Enqueue(frame);
+                    _mIFramesInFlight--;
+                    if (_mIFramesInFlight == 0)
+                        Monitor.PulseAll(_mLocker);
                 }
+            }
 
-                _mWaitHandle.Set();
+            // QueueFull: the conversion stage was empty and every slot was busy further down the pipeline.
+            // The frame is lost and counted in RejectedFrames.
+            if (res != SaveResult.Success && res != SaveResult.QueueFull)
+            {
+                // Start cancellation procedure
+                // The producer should test for .Cancelling and stop queuing items at this point.
+                // We don't try to save the outstanding frames, but the video file should be valid.
+                var cancel = false;
+                lock (_mLocker)
+                {
+                    if (!Cancelling)
+                    {
+                        Log.Error("Error while saving frame to file.");
+                        Cancelling = true;
+                        CancelReason = res;
+                        cancel = true;
+                        WaitFramesInFlight();
+                    }
+                }
+
+                if (cancel)
+                {
+                    try
+                    {
+                        _mVideoFileWriter.CloseSavingContext(true);
+                    }
+                    catch (Exception exp)
+                    {
+                        Log.Error(exp.Message);
+                        Log.Error(exp.StackTrace);
+                    }
+                }
+
+                frame.Dispose();
+                return;
             }
+
+            lock (_mLocker)
+            {
+                if (!_mBCaptureThumbSet && res == SaveResult.Success)
+                {
+                    CaptureThumb = frame;
+                    _mBCaptureThumbSet = true;
+                    return;
+                }
+            }
+
+            frame.Dispose();
         }
 
         #endregion Public Methods
+
+        #region Private Methods
+
+        private void WaitFramesInFlight()
+        {
+            // Called under _mLocker, after new frames are refused.
+            while (_mIFramesInFlight > 0)
+                Monitor.Wait(_mLocker);
+        }
+
+        #endregion Private Methods
     }
 }
\ No newline at end of file
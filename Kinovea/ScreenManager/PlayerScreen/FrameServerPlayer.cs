@@ -82,6 +82,7 @@ public bool Loaded
         private bool _mBSaveKeyframesOnly;
         private bool _mBSavePausedVideo;
         private DelegateGetOutputBitmap _mSaveDelegateOutputBitmap;
+        private DelegateHasDrawings _mSaveDelegateHasDrawings;
         private SaveResult _mSaveResult;
 
         #endregion Members
@@ -127,7 +128,7 @@ public override void Draw(Graphics canvas)
         }
 
         public void Save(double fPlaybackFrameInterval, double fSlowmotionPercentage, long iSelStart, long iSelEnd,
-            DelegateGetOutputBitmap delegateOutputBitmap)
+            DelegateGetOutputBitmap delegateOutputBitmap, DelegateHasDrawings delegateHasDrawings)
         {
             // Let the user select what he wants to save exactly.
             // Note: _iSelStart, _iSelEnd, _Metadata, should ultimately be taken from local members.
@@ -151,7 +152,8 @@ public override void Draw(Graphics canvas)
                         fve.BlendDrawings,
                         false,
                         false,
-                        delegateOutputBitmap);
+                        delegateOutputBitmap,
+                        delegateHasDrawings);
                 }
             }
 
@@ -159,7 +161,8 @@ public override void Draw(Graphics canvas)
             fve.Dispose();
         }
 
-        public void SaveDiaporama(long iSelStart, long iSelEnd, DelegateGetOutputBitmap delegateOutputBitmap, bool diapo)
+        public void SaveDiaporama(long iSelStart, long iSelEnd, DelegateGetOutputBitmap delegateOutputBitmap,
+            DelegateHasDrawings delegateHasDrawings, bool diapo)
         {
             // Let the user configure the diaporama export.
 
@@ -174,7 +177,8 @@ public void SaveDiaporama(long iSelStart, long iSelEnd, DelegateGetOutputBitmap
                     true,
                     fde.PausedVideo ? false : true,
                     fde.PausedVideo,
-                    delegateOutputBitmap);
+                    delegateOutputBitmap,
+                    delegateHasDrawings);
             }
 
             // Release configuration form.
@@ -197,7 +201,7 @@ public void AfterSave()
 
         private void DoSave(string filePath, Metadata metadata, double fPlaybackFrameInterval, long iSelStart,
             long iSelEnd, bool bFlushDrawings, bool bKeyframesOnly, bool bPausedVideo,
-            DelegateGetOutputBitmap delegateOutputBitmap)
+            DelegateGetOutputBitmap delegateOutputBitmap, DelegateHasDrawings delegateHasDrawings)
         {
             // Save video.
             // We use a bgWorker and a Progress Bar.
@@ -213,6 +217,7 @@ public void AfterSave()
             _mBSaveKeyframesOnly = bKeyframesOnly;
             _mBSavePausedVideo = bPausedVideo;
             _mSaveDelegateOutputBitmap = delegateOutputBitmap;
+            _mSaveDelegateHasDrawings = delegateHasDrawings;
 
             // Instanciate and configure the bgWorker.
             var bgWorkerSave = new BackgroundWorker();
@@ -225,6 +230,9 @@ public void AfterSave()
             // Attach the bgWorker to the VideoFile object so it can report progress.
             VideoFile.BgWorker = bgWorkerSave;
 
+            // Long selections are exported in independent parts, one per core by default.
+            VideoFile.ExportThreads = PreferencesManager.Instance().ExportThreads;
+
             // Create the progress bar and launch the worker.
             _mFormProgressBar = new FormProgressBar(true);
             _mFormProgressBar.Cancel = Cancel_Asked;
@@ -256,7 +264,8 @@ private void bgWorkerSave_DoWork(object sender, DoWorkEventArgs e)
                     _mBSaveFlushDrawings,
                     _mBSaveKeyframesOnly,
                     _mBSavePausedVideo,
-                    _mSaveDelegateOutputBitmap);
+                    _mSaveDelegateOutputBitmap,
+                    _mSaveDelegateHasDrawings);
                 if (_mSaveMetadata != null)
                 {
                     _mSaveMetadata.CleanupHash();
@@ -313,6 +322,7 @@ private void ReportError(SaveResult err)
 
                 case SaveResult.FileHeaderNotWritten:
                 case SaveResult.FileNotOpened:
+                case SaveResult.FileNotWritten:
                     DisplayErrorMessage(ScreenManagerLang.Error_SaveMovie_FileError);
                     break;
 
@@ -5447,7 +5447,7 @@ private void btnDiaporama_Click(object sender, EventArgs e)
                     dp.DeactivateKeyboardHandler();
                 }
 
-                _mFrameServer.SaveDiaporama(_mISelStart, _mISelEnd, GetOutputBitmap, bDiapo);
+                _mFrameServer.SaveDiaporama(_mISelStart, _mISelEnd, GetOutputBitmap, HasDrawings, bDiapo);
 
                 if (dp.ActivateKeyboardHandler != null)
                 {
@@ -5467,7 +5467,8 @@ public void Save()
                 _mFSlowmotionPercentage,
                 _mISelStart,
                 _mISelEnd,
-                GetOutputBitmap);
+                GetOutputBitmap,
+                HasDrawings);
         }
 
         public long GetOutputBitmap(Graphics canvas, Bitmap sourceImage, long iTimestamp, bool bFlushDrawings,
@@ -5479,6 +5480,7 @@ public void Save()
             // Here we we flush the drawings on it if needed.
             // We return the distance to the closest key image.
             // This can then be used by the caller.
+            // When bFlushDrawings is false, canvas and sourceImage are not used and may be null.
 
             // 1. Look for the closest key image.
             var iClosestKeyImageDistance = long.MaxValue;
@@ -5541,6 +5543,57 @@ public void Save()
             return iClosestKeyImageDistance;
         }
 
+        public bool HasDrawings(long iTimestamp)
+        {
+            // Used by the VideoFile for SaveMovie, to find the parts of the video that can be copied as is.
+            // Must be true whenever GetOutputBitmap (with bFlushDrawings) would paint something at this position.
+            // When unsure, answer true, the frame will be rendered normally.
+            var metadata = _mFrameServer.Metadata;
+
+            if (metadata.Magnifier.Mode != MagnifierMode.NotVisible)
+            {
+                return true;
+            }
+
+            // 1. Extra drawings. Chronos and tracks don't draw before they start, other kinds are always visible.
+            foreach (var drawing in metadata.ExtraDrawings)
+            {
+                var chrono = drawing as DrawingChrono;
+                var track = drawing as Track;
+
+                if (chrono != null)
+                {
+                    if (iTimestamp >= chrono.TimeVisible) return true;
+                }
+                else if (track != null)
+                {
+                    if (iTimestamp >= track.BeginTimeStamp) return true;
+                }
+                else
+                {
+                    return true;
+                }
+            }
+
+            // 2. Drawings attached to key images. Same rules as FlushDrawingsOnGraphics.
+            foreach (var kf in metadata.Keyframes)
+            {
+                if (_mPrefManager.DefaultFading.Enabled)
+                {
+                    foreach (var drawing in kf.Drawings)
+                    {
+                        if (drawing.InfosFading.GetOpacityFactor(iTimestamp) > 0) return true;
+                    }
+                }
+                else if (kf.Position == iTimestamp && kf.Drawings.Count > 0)
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
         public Bitmap GetFlushedImage()
         {
             // Returns an image with all drawings flushed, including